@@ -5,13 +5,37 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include "isa.h"
+#include "cpusim.h"
+
+// Pass 2 encodes on C11 threads when the C library provides them.
+#if !defined(__STDC_NO_THREADS__)
+#define HAVE_THREADS 1
+#include <threads.h>
+#endif
+
+// POSIX hosts can report their core count and create the --cache directory.
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/stat.h>
+#elif defined(_WIN32)
+#include <process.h>
+#endif
 
 // --- Configuration Constants ---
-#define PROGRAM_SIZE 256        // Maximum number of instructions in a program.
-#define MAX_LINE_LENGTH 100     // Maximum characters per line of assembly code.
+#define MAX_LINE_LENGTH 100     // Lines up to this long are encoded from a copy on the stack.
+#define MAX_ERROR_LENGTH 256    // Maximum length of an encoding error message.
+#define CHUNK_LINES 16384       // Source lines one pass-2 thread encodes at a time, at least.
+#define DEFAULT_THREADS 4       // Pass-2 threads when the core count is unknown.
+#define MAX_JUMP_CHAIN 16       // JMPs -O follows when retargeting a jump.
 #define MAX_FILENAME_LENGTH 256 // Maximum length for file paths.
-#define MAX_LABELS 64           // Maximum number of labels in a program.
 #define MAX_LABEL_LENGTH 32     // Maximum character length of a label.
+#define STREAM_BUFFER_SIZE (1 << 20) // Initial size of the --stream source buffer; it grows for longer lines.
+#define MNEMONIC_SLOTS 128      // Size of the mnemonic hash table; a power of two above twice the mnemonic count.
+#define FORM_COUNT (FORM_REG_REG_REG + 1)
+#define IMAGE_CODE_OFFSET IMAGE_ALIGNMENT // --image puts the code right after the header, so --stream can write it as it goes.
+#define ASSEMBLER_VERSION 1     // Bump whenever the same source would encode differently, to retire --cache entries.
 
 // --- Core Data Structures ---
 
@@ -19,33 +43,155 @@
 typedef struct {
     char name[MAX_LABEL_LENGTH];
     int address;
+    int line;               // Line of program_memory the label was defined on.
 } Label;
 
+// A mnemonic (or alias) and its opcode in each operand form, -1 where it has none. A block
+// instruction has its BLOCK_OP() field in place of the opcode.
+typedef struct {
+    const char* name;
+    int opcode[FORM_COUNT];
+} Mnemonic;
+
+// The operand of an instruction encoded in the wide form (see WIDE_PREFIX), whose word has 0 in its place.
+typedef struct {
+    int wide;               // The instruction takes the wide form.
+    int32_t operand;
+} WideOperand;
+
+// A label operand --stream met before the label's definition, patched in once the whole source is read.
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    int address;            // Instruction to patch.
+    int line;               // Source line, for errors.
+    uint16_t instruction;   // The word as encoded, with 0 in the address field.
+    int offset;             // Output word the instruction starts at.
+    int wide;               // Written in the wide form, so any address fits.
+} Fixup;
+
+// A run of source lines that pass 2 encodes on one thread, into its own slice of machine_code.
+typedef struct {
+    int first_line, end_line;   // Lines [first_line, end_line) of program_memory.
+    int first_address;          // Address of the chunk's first instruction.
+    uint16_t* machine_code;
+    WideOperand* wide_operands; // Its slice of wide_operands, with --wide.
+    int encoded;                // Instructions encoded before end_line or the first error.
+    int error_line;             // Line of the first error, or -1.
+    char error[MAX_ERROR_LENGTH];
+} EncodeChunk;
+
+// Opcodes the -O pass and the basic-block index look for.
+enum {
+    OP_HLT = 0b00000, OP_INC = 0b01001, OP_DEC = 0b01010, OP_PUSH = 0b01011, OP_POP = 0b01100, OP_CALL = 0b01101,
+    OP_RET = 0b01110, OP_MOV_REG = 0b10010, OP_ADD_IMM = 0b10011, OP_SUB_IMM = 0b10100, OP_JMP = 0b11000, OP_JLE = 0b11110
+};
+
 // --- Global State Variables ---
 
-char  program_memory[PROGRAM_SIZE][MAX_LINE_LENGTH]; // Buffer for the program's assembly instructions.
-Label symbol_table[MAX_LABELS];                      // Symbol table for labels and their addresses.
+char* source_text = NULL;                            // The whole source file, split into lines in place.
+char** program_memory = NULL;                        // The program's lines, with comments and leading whitespace removed.
+Label* symbol_table = NULL;                          // Symbol table for labels and their addresses, in source order.
+int*  label_slots = NULL;                            // Open-addressing index into symbol_table, -1 for an empty slot.
+int   label_slot_count = 0;                          // Size of label_slots; a power of two, at most half full.
 int   program_line_count = 0;                        // The number of lines in the loaded program.
 int   label_count = 0;                               // The number of labels in the symbol table.
+Mnemonic mnemonic_table[MNEMONIC_SLOTS];             // Hash table of mnemonics, filled by build_mnemonic_table().
+int   streaming = 0;                                 // Set by --stream: unseen labels become fixups.
+int   stream_address = 0;                            // Address of the instruction --stream is encoding.
+int   stream_words = 0;                              // Words --stream has written; more than stream_address with --wide.
+Fixup* fixups = NULL;                                // Forward label references, in source order.
+int   fixup_count = 0;
+int   fixup_capacity = 0;
+int   thread_count = 0;                              // Pass-2 threads, from --threads; 0 for one per core.
+int   print_listing = 1;                             // Cleared by --no-listing.
+int   optimize = 0;                                  // Set by -O.
+int   image_output = 0;                              // Set by --image: write a program image, not bare words.
+const char* cache_dir = NULL;                        // Set by --cache: where finished builds are kept.
+int   wide_encoding = 0;                             // Set by --wide: operands that do not fit their field take the wide form.
+WideOperand* wide_operands = NULL;                   // With --wide, pass 2's wide operands, one per instruction.
 
 // --- Function Prototypes ---
 int  load_program(const char* filename);
-void build_symbol_table();
+int  read_source(const char* filename, size_t* length);
+int  split_source(size_t length);
+void reset_assembler();
+int  build_symbol_table();
+int  add_label(const char* name, int address, int line);
+int  find_label_slot(const char* name);
 int  get_address_for_label(const char* name);
-int  assemble(uint16_t* machine_code);
-uint16_t encode_instruction(const char* line, int pc);
+int  resolve_label(const char* name, int pc, char* error);
+uint32_t hash_name(const char* name);
+void build_mnemonic_table();
+const Mnemonic* find_mnemonic(const char* name);
+int  optimize_program();
+int  optimizable(uint16_t* words, int* targets);
+int  next_instruction(int line);
+int  label_operand(const char* line);
+int  assemble(uint16_t* machine_code, char* error);
+int  encode_chunk(void* chunk);
+uint16_t encode_instruction(const char* line, int pc, char* error, WideOperand* wide);
+uint16_t encode_line(char* line, int pc, char* error, WideOperand* wide);
+char* next_token(char** cursor);
+void set_error(char* error, const char* format, ...);
+int  assemble_stream(const char* source_filename, const char* binary_filename, const char* symbol_filename);
+int  stream_line(char* line, int pc, FILE* out);
+int  patch_fixups(FILE* out);
+int  write_code(FILE* f, const uint16_t* machine_code, int instruction_count);
 int  write_binary_file(const char* filename, const uint16_t* machine_code, int instruction_count);
+int  write_image_file(const char* filename, const uint16_t* machine_code, int instruction_count);
+int  finish_image(FILE* f, int code_words, const uint16_t* machine_code, int instruction_count);
+int  write_symbol_file(const char* filename);
 int  get_register_code(const char* reg_name);
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size);
+uint64_t assembler_fingerprint();
+uint64_t build_key(size_t length);
+FILE* open_temporary(const char* to, char** temporary);
+char* cache_path(uint64_t key, const char* extension);
+int  copy_file(const char* from, const char* to);
+int  restore_cached(uint64_t key, const char* binary_filename, const char* symbol_filename);
+void store_cached(uint64_t key, const char* binary_filename, const char* symbol_filename);
 
 
+// Left out when linked into the library, or into a simulator that assembles --serve jobs.
+#if !defined(CPUSIM_LIBRARY) && !defined(CPUSIM_WITH_ASSEMBLER)
 int main(int argc, char* argv[]) {
     char source_filename[MAX_FILENAME_LENGTH];
     char binary_filename[MAX_FILENAME_LENGTH];
-    uint16_t machine_code[PROGRAM_SIZE] = { 0 };
+    const char* program_name = argv[0];
+    uint16_t* machine_code = NULL;
     int instruction_count = 0;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source file> <output file>\n", argv[0]);
+    // Options come before the file names.
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-O") == 0) {
+            optimize = 1;
+        } else if (strcmp(argv[1], "--stream") == 0) {
+            streaming = 1; // Assemble in a single pass.
+        } else if (strcmp(argv[1], "--image") == 0) {
+            image_output = 1;
+        } else if (strcmp(argv[1], "--wide") == 0) {
+            wide_encoding = 1;
+        } else if (strcmp(argv[1], "--no-listing") == 0) {
+            print_listing = 0;
+        } else if (strncmp(argv[1], "--cache=", 8) == 0 && argv[1][8] != '\0') {
+            cache_dir = argv[1] + 8;
+        } else if (strncmp(argv[1], "--threads=", 10) == 0 && atoi(argv[1] + 10) > 0) {
+            thread_count = atoi(argv[1] + 10);
+        } else {
+            argc = 0; // Unknown option: print the usage.
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    const char* symbol_filename = argc == 4 ? argv[3] : NULL;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s [-O] [--stream] [--image] [--wide] [--threads=N] [--no-listing] [--cache=DIR] <source file> <output file> [symbol file]\n", program_name);
+        return 1;
+    }
+    if (optimize && streaming) {
+        fprintf(stderr, "[Fatal Error] -O needs both passes and cannot be combined with --stream.\n");
         return 1;
     }
 
@@ -55,104 +201,193 @@ int main(int argc, char* argv[]) {
     strncpy(binary_filename, argv[2], sizeof(binary_filename) - 1);
     binary_filename[sizeof(binary_filename) - 1] = '\0';
 
+    // A source assembled before with the same assembler and options gets its stored outputs back.
+    uint64_t cache_key = 0;
+    size_t source_length = 0;
+    if (cache_dir != NULL) {
+        if (read_source(source_filename, &source_length) < 0) {
+            fprintf(stderr, "[Fatal Error] Program loading failed. Exiting.\n");
+            return 1;
+        }
+        cache_key = build_key(source_length);
+        if (restore_cached(cache_key, binary_filename, symbol_filename) == 0) {
+            printf("\n[Cache] '%s' is unchanged; copied its output to '%s'.\n", source_filename, binary_filename);
+            return 0;
+        }
+    }
+
+    if (streaming) {
+        free(source_text); // --stream reads the file itself.
+        source_text = NULL;
+        if (assemble_stream(source_filename, binary_filename, symbol_filename) != 0) return 1;
+        if (cache_dir != NULL) store_cached(cache_key, binary_filename, symbol_filename);
+        return 0;
+    }
+
     // Load the program from the source file.
     printf("\n[Pass 1] Loading source file '%s'...\n", source_filename);
-    if (load_program(source_filename) < 0) {
+    if ((source_text != NULL ? split_source(source_length) : load_program(source_filename)) < 0) {
         fprintf(stderr, "[Fatal Error] Program loading failed. Exiting.\n");
         return 1;
     }
 
     // Build the symbol table in the first pass.
     printf("[Pass 1] Building symbol table for labels...\n");
-    build_symbol_table();
+    if (build_symbol_table() < 0) {
+        fprintf(stderr, "[Fatal Error] Out of memory for the symbol table.\n");
+        return 1;
+    }
     printf("[Pass 1] Found %d labels.\n", label_count);
+    build_mnemonic_table();
+    if (optimize) {
+        printf("[Optimize] Rewriting instruction sequences...\n");
+        if (optimize_program() < 0) {
+            fprintf(stderr, "[Fatal Error] Out of memory for the optimizer.\n");
+            return 1;
+        }
+    }
+    if (symbol_filename != NULL) {
+        if (write_symbol_file(symbol_filename) != 0) {
+            fprintf(stderr, "[Fatal Error] Could not write to symbol file.\n");
+            return 1;
+        }
+        printf("[Pass 1] Wrote symbol table to '%s'.\n", symbol_filename);
+    }
 
     // Assemble the program into machine code in the second pass.
     printf("[Pass 2] Assembling into machine code...\n");
-    instruction_count = assemble(machine_code);
+    machine_code = malloc((program_line_count > 0 ? program_line_count : 1) * sizeof(uint16_t));
+    if (wide_encoding) wide_operands = calloc(program_line_count > 0 ? program_line_count : 1, sizeof(WideOperand));
+    if (machine_code == NULL || (wide_encoding && wide_operands == NULL)) {
+        fprintf(stderr, "[Fatal Error] Out of memory for the machine code.\n");
+        return 1;
+    }
+    char error[MAX_ERROR_LENGTH];
+    instruction_count = assemble(machine_code, error);
     if (instruction_count < 0) {
+        fputs(error, stderr);
         fprintf(stderr, "[Fatal Error] Assembly failed. Please check source file for errors.\n");
         return 1;
     }
     printf("[Pass 2] Assembly successful. %d instructions generated.\n", instruction_count);
 
     // Write the machine code to the binary file.
-    printf("\nWriting %d words to binary file '%s'...\n", instruction_count, binary_filename);
-    if (write_binary_file(binary_filename, machine_code, instruction_count) != 0) {
+    int word_count = instruction_count;
+    for (int i = 0; wide_operands != NULL && i < instruction_count; i++) word_count += wide_operands[i].wide ? WIDE_WORDS - 1 : 0;
+    printf("\nWriting %d words to %s file '%s'...\n", word_count, image_output ? "image" : "binary", binary_filename);
+    int write_status = image_output ? write_image_file(binary_filename, machine_code, instruction_count)
+                                    : write_binary_file(binary_filename, machine_code, instruction_count);
+    if (write_status != 0) {
         fprintf(stderr, "[Fatal Error] Could not write to binary file.\n");
         return 1;
     }
 
+    if (cache_dir != NULL) store_cached(cache_key, binary_filename, symbol_filename);
+
     printf("\nAssembly complete. Binary file '%s' created successfully.\n", binary_filename);
+    free(machine_code);
+    free(wide_operands);
     return 0;
 }
+#endif
 
+// Reads the whole source into source_text and splits it with split_source().
 int load_program(const char* filename) {
-    FILE* f = fopen(filename, "r");
+    size_t length;
+    return read_source(filename, &length) < 0 ? -1 : split_source(length);
+}
+
+// Reads the whole source into source_text, NUL-terminated, and its length into *length.
+int read_source(const char* filename, size_t* length_out) {
+    FILE* f = fopen(filename, "rb");
     if (f == NULL) {
         perror("[Loader Error] Failed to open program file");
         return -1;
     }
 
-    int i = 0;
-    char line_buffer[MAX_LINE_LENGTH];
+    size_t length = 0, capacity = 1 << 16;
+    source_text = malloc(capacity + 1);
+    size_t bytes;
+    while (source_text != NULL && (bytes = fread(source_text + length, 1, capacity - length, f)) > 0) {
+        length += bytes;
+        if (length == capacity) {
+            char* grown = realloc(source_text, capacity * 2 + 1);
+            if (grown == NULL) { free(source_text); source_text = NULL; break; }
+            source_text = grown;
+            capacity *= 2;
+        }
+    }
+    int failed = source_text == NULL || ferror(f);
+    fclose(f);
+    if (failed) {
+        fprintf(stderr, "[Loader Error] Could not read '%s' into memory.\n", filename);
+        return -1;
+    }
+    source_text[length] = '\0';
+    *length_out = length;
+    return 0;
+}
 
-    while (i < PROGRAM_SIZE && fgets(line_buffer, MAX_LINE_LENGTH, f) != NULL) {
-        line_buffer[strcspn(line_buffer, "\r\n")] = 0; // Remove newline.
+// Splits the `length` bytes of source_text into program_memory, one entry per non-empty line,
+// with comments and leading whitespace removed.
+int split_source(size_t length) {
+    int i = 0, line_capacity = 0;
+    char* next_line;
+    for (char* line = source_text; line < source_text + length; line = next_line) {
+        char* newline = memchr(line, '\n', source_text + length - line);
+        next_line = newline != NULL ? newline + 1 : source_text + length;
+        if (newline != NULL) *newline = '\0';
+        line[strcspn(line, "\r")] = 0; // Remove newline.
 
         // Remove comments, which start with a semicolon.
-        char* comment_start = strchr(line_buffer, ';');
+        char* comment_start = strchr(line, ';');
         if (comment_start != NULL) {
             *comment_start = '\0';
         }
 
         // Trim leading whitespace.
-        char* trimmed_line = line_buffer;
-        while (isspace((unsigned char)*trimmed_line)) {
-            trimmed_line++;
+        while (isspace((unsigned char)*line)) {
+            line++;
         }
 
         // Skip empty lines.
-        if (*trimmed_line == '\0') {
+        if (*line == '\0') {
             continue;
         }
 
-        strncpy(program_memory[i], trimmed_line, MAX_LINE_LENGTH - 1);
-        i++;
+        if (i == line_capacity) {
+            line_capacity = line_capacity ? line_capacity * 2 : 1024;
+            char** grown = realloc(program_memory, line_capacity * sizeof(char*));
+            if (grown == NULL) {
+                fprintf(stderr, "[Loader Error] Out of memory for the program's lines.\n");
+                return -1;
+            }
+            program_memory = grown;
+        }
+        program_memory[i++] = line;
     }
 
-    fclose(f);
     program_line_count = i;
     return program_line_count;
 }
 
-void build_symbol_table() {
+int build_symbol_table() {
     label_count = 0;
     int instruction_address = 0;
     for (int i = 0; i < program_line_count; i++) {
-        char line_copy[MAX_LINE_LENGTH];
-        strcpy(line_copy, program_memory[i]);
-
-        char* colon = strchr(line_copy, ':');
+        char* colon = strchr(program_memory[i], ':');
         if (colon != NULL) {
             *colon = '\0'; // Terminate the string at the colon to isolate the label name.
 
             // Add the label to the symbol table.
-            if (label_count < MAX_LABELS) {
-                strncpy(symbol_table[label_count].name, line_copy, MAX_LABEL_LENGTH - 1);
-                symbol_table[label_count].name[MAX_LABEL_LENGTH - 1] = '\0'; // Ensure null-termination.
-                symbol_table[label_count].address = instruction_address;
-                label_count++;
-            } else {
-                fprintf(stderr, "[Warning] Maximum number of labels (%d) reached. Ignoring '%s'.\n", MAX_LABELS, line_copy);
-            }
+            if (add_label(program_memory[i], instruction_address, i) < 0) return -1;
 
             // Remove the label from the instruction for the second pass.
             char* instruction_start = colon + 1;
             while (isspace((unsigned char)*instruction_start)) {
                 instruction_start++;
             }
-            strcpy(program_memory[i], instruction_start);
+            program_memory[i] = instruction_start;
         }
 
         // If the line is not empty after stripping a label, it's an instruction.
@@ -160,38 +395,560 @@ void build_symbol_table() {
             instruction_address++;
         }
     }
+    return 0;
 }
 
-int get_address_for_label(const char* name) {
-    for (int i = 0; i < label_count; i++) {
-        if (strcmp(symbol_table[i].name, name) == 0) {
-            return symbol_table[i].address;
+// FNV-1a, for the label and mnemonic hash tables.
+uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) hash = (hash ^ *p) * 16777619u;
+    return hash;
+}
+
+// Returns the slot of label_slots holding `name`, or the empty slot where it would go.
+int find_label_slot(const char* name) {
+    int mask = label_slot_count - 1;
+    int slot = hash_name(name) & mask;
+    while (label_slots[slot] != -1 && strcmp(symbol_table[label_slots[slot]].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Appends a label to the symbol table, growing it and its index as needed. Returns -1 when out of memory.
+int add_label(const char* name, int address, int line) {
+    Label label;
+    strncpy(label.name, name, MAX_LABEL_LENGTH - 1);
+    label.name[MAX_LABEL_LENGTH - 1] = '\0'; // Ensure null-termination.
+    label.address = address;
+    label.line = line;
+
+    if (2 * (label_count + 1) > label_slot_count) {
+        int slot_count = label_slot_count ? label_slot_count * 2 : 256;
+        Label* grown = realloc(symbol_table, (slot_count / 2) * sizeof(Label));
+        int* slots = malloc(slot_count * sizeof(int));
+        if (grown == NULL || slots == NULL) {
+            free(slots);
+            if (grown != NULL) symbol_table = grown;
+            return -1;
+        }
+        symbol_table = grown;
+        free(label_slots);
+        label_slots = slots;
+        label_slot_count = slot_count;
+        memset(label_slots, -1, slot_count * sizeof(int));
+        for (int i = 0; i < label_count; i++) {
+            int slot = find_label_slot(symbol_table[i].name);
+            if (label_slots[slot] == -1) label_slots[slot] = i;
         }
     }
-    return -1; // Label not found.
+
+    // The first definition of a label wins; later ones are kept only for the symbol file.
+    int slot = find_label_slot(label.name);
+    if (label_slots[slot] == -1) label_slots[slot] = label_count;
+    symbol_table[label_count++] = label;
+    return 0;
 }
 
-int assemble(uint16_t* machine_code) {
-    int instruction_count = 0;
+int get_address_for_label(const char* name) {
+    if (label_slot_count == 0) return -1;
+    int index = label_slots[find_label_slot(name)];
+    return index == -1 ? -1 : symbol_table[index].address; // -1 when the label is not found.
+}
+
+// Returns the address of a label operand, or -1 if it is undefined. Under --stream, a label not
+// seen yet is recorded as a fixup of the current instruction and reads as address 0 until patched.
+int resolve_label(const char* name, int pc, char* error) {
+    int address = get_address_for_label(name);
+    if (address != -1 || !streaming || strlen(name) >= MAX_LABEL_LENGTH) return address;
+
+    if (fixup_count == fixup_capacity) {
+        int capacity = fixup_capacity ? fixup_capacity * 2 : 256;
+        Fixup* grown = realloc(fixups, capacity * sizeof(Fixup));
+        if (grown == NULL) { set_error(error, "[Error L%d] Out of memory for label fixups.\n", pc); return -2; }
+        fixups = grown;
+        fixup_capacity = capacity;
+    }
+    Fixup* fixup = &fixups[fixup_count++];
+    strcpy(fixup->name, name);
+    fixup->address = stream_address;
+    fixup->line = pc;
+    fixup->instruction = 0; // Filled in by stream_line() once the instruction is encoded.
+    return 0;
+}
+
+// Labels defined on lines first_line..last_line of program_memory, for the -O pass.
+static int* labels_before = NULL; // labels_before[i]: labels defined on lines before i.
+static int labels_between(int first_line, int last_line) { return labels_before[last_line + 1] - labels_before[first_line]; }
+
+static char deleted_line[] = ""; // What -O leaves in place of a removed instruction.
+static char** rewritten_lines = NULL; // Text -O allocated for each line, reused if it rewrites the line again.
+
+// Returns the first line after `line` that holds an instruction, or program_line_count.
+int next_instruction(int line) {
+    do line++; while (line < program_line_count && program_memory[line][0] == '\0');
+    return line;
+}
+
+// Returns the symbol table index of the label a jump or CALL names, or -1 for a numeric address.
+int label_operand(const char* line) {
+    const char* operand = line + strcspn(line, " \t,");
+    operand += strspn(operand, " \t,");
+    size_t length = strcspn(operand, " \t,");
+    char name[MAX_LABEL_LENGTH];
+    if (!isalpha((unsigned char)operand[0]) || length >= MAX_LABEL_LENGTH) return -1;
+    memcpy(name, operand, length);
+    name[length] = '\0';
+    return label_slots != NULL ? label_slots[find_label_slot(name)] : -1;
+}
+
+// Encodes every line for the -O pass and records jump targets. Returns 0 when the program can't be
+// optimized: it doesn't assemble (pass 2 reports why), or it depends on addresses that -O would move.
+int optimizable(uint16_t* words, int* targets) {
+    char error[MAX_ERROR_LENGTH];
+    WideOperand wide;
     for (int i = 0; i < program_line_count; i++) {
+        if (program_memory[i][0] == '\0') continue;
+        uint16_t word = encode_instruction(program_memory[i], i, error, wide_encoding ? &wide : NULL);
+        if (word == 0xFFFF) return 0;
+        if (wide_encoding && wide.wide) {
+            fprintf(stderr, "[Warning] L%d needs the wide form, so -O leaves the program unchanged.\n", i);
+            return 0;
+        }
+        words[i] = word;
+
+        int opcode = word >> 11;
+        if ((opcode >= OP_JMP && opcode <= OP_JLE) || opcode == OP_CALL) {
+            targets[i] = label_operand(program_memory[i]);
+            if (targets[i] < 0) {
+                fprintf(stderr, "[Warning] L%d jumps to an absolute address, so -O leaves the program unchanged.\n", i);
+                return 0;
+            }
+        } else if (instruction_forms[opcode].form == FORM_REG_ADDR || instruction_forms[opcode].form == FORM_ADDR_REG) {
+            const char* address = strchr(program_memory[i], '[');
+            if (address != NULL && isalpha((unsigned char)address[1])) {
+                fprintf(stderr, "[Warning] L%d uses a label as a data address, so -O leaves the program unchanged.\n", i);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Replaces the text of line `i`, which pass 2 encodes instead. Returns -1 when out of memory.
+static int rewrite_line(uint16_t* words, int i, uint16_t word, const char* label) {
+    char* text = rewritten_lines[i] != NULL ? rewritten_lines[i] : malloc(MAX_LABEL_LENGTH + 16);
+    if (text == NULL) return -1;
+    rewritten_lines[i] = text;
+    const char* mnemonic = instruction_forms[word >> 11].mnemonic;
+    const char* reg1 = register_names[(word >> 8) & 0x7];
+    if (label != NULL) snprintf(text, MAX_LABEL_LENGTH + 16, "%s %s", mnemonic, label);
+    else if (instruction_forms[word >> 11].form == FORM_REG_IMM) snprintf(text, MAX_LABEL_LENGTH + 16, "%s %s, #%d", mnemonic, reg1, word & 0xFF);
+    else snprintf(text, MAX_LABEL_LENGTH + 16, "%s %s, %s", mnemonic, reg1, register_names[(word >> 5) & 0x7]);
+    program_memory[i] = text;
+    words[i] = word;
+    return 0;
+}
+
+// The change `word` makes to its register, if it is INC, DEC, ADD reg, #imm or SUB reg, #imm.
+static int register_step(uint16_t word, int* step) {
+    switch (word >> 11) {
+        case OP_INC: *step = 1; return 1;
+        case OP_DEC: *step = -1; return 1;
+        case OP_ADD_IMM: *step = word & 0xFF; return 1;
+        case OP_SUB_IMM: *step = -(word & 0xFF); return 1;
+        default: return 0;
+    }
+}
+
+// The -O pass, between the symbol table and pass 2. Rewrites the program's lines to execute fewer
+// instructions, then moves the labels to the addresses their lines end up at:
+//   - MOV r, r and ADD/SUB r, #0 are removed;
+//   - runs of INC/DEC/ADD/SUB r, #imm on one register become a single ADD or SUB;
+//   - PUSH r; POP r is removed and PUSH r1; POP r2 becomes MOV r2, r1 (not for ESP);
+//   - jumps and CALLs to a JMP go straight to its target, and jumps to the next instruction are removed.
+// No sequence is rewritten across a label, so nothing can jump into the middle of one. The pass
+// assumes nothing reads the stack below ESP. It returns -1 when out of memory.
+int optimize_program() {
+    int count = program_line_count;
+    uint16_t* words = calloc(count + 1, sizeof(uint16_t));
+    int* targets = calloc(count + 1, sizeof(int));
+    labels_before = calloc(count + 2, sizeof(int));
+    rewritten_lines = calloc(count + 1, sizeof(char*));
+    if (words == NULL || targets == NULL || labels_before == NULL || rewritten_lines == NULL) return -1;
+    for (int i = 0; i < label_count; i++) labels_before[symbol_table[i].line + 1]++;
+    for (int i = 0; i <= count; i++) labels_before[i + 1] += labels_before[i];
+
+    int removed = 0, rewritten = 0, changed = optimizable(words, targets);
+    while (changed) {
+        changed = 0;
+        for (int i = next_instruction(-1); i < count; i = next_instruction(i)) {
+            uint16_t word = words[i];
+            int opcode = word >> 11, reg1 = (word >> 8) & 0x7, reg2 = (word >> 5) & 0x7;
+            int next = next_instruction(i);
+            int step, total;
+
+            if ((opcode == OP_MOV_REG && reg1 == reg2) || ((opcode == OP_ADD_IMM || opcode == OP_SUB_IMM) && (word & 0xFF) == 0)) {
+                program_memory[i] = deleted_line;
+                removed++;
+                changed = 1;
+            }
+            else if ((opcode >= OP_JMP && opcode <= OP_JLE) || opcode == OP_CALL) {
+                // Follow the chain of JMPs from the target, giving up on a cycle.
+                int target = targets[i], seen[MAX_JUMP_CHAIN], hops = 0;
+                int line = next_instruction(symbol_table[target].line - 1);
+                while (line < count && (words[line] >> 11) == OP_JMP && hops < MAX_JUMP_CHAIN) {
+                    int repeated = line == i;
+                    for (int h = 0; h < hops; h++) repeated |= seen[h] == line;
+                    if (repeated) { target = targets[i]; break; }
+                    seen[hops++] = line;
+                    target = targets[line];
+                    line = next_instruction(symbol_table[target].line - 1);
+                }
+                if (hops == MAX_JUMP_CHAIN) target = targets[i];
+
+                if (target != targets[i]) {
+                    if (rewrite_line(words, i, word, symbol_table[target].name) < 0) return -1;
+                    targets[i] = target;
+                    rewritten++;
+                    changed = 1;
+                } else if (opcode != OP_CALL && next_instruction(symbol_table[target].line - 1) == next) {
+                    program_memory[i] = deleted_line;
+                    removed++;
+                    changed = 1;
+                }
+            }
+            else if (opcode == OP_PUSH && next < count && (words[next] >> 11) == OP_POP && !labels_between(i + 1, next)
+                     && reg1 != 7 && ((words[next] >> 8) & 0x7) != 7) {
+                int destination = (words[next] >> 8) & 0x7;
+                if (destination == reg1) {
+                    program_memory[i] = deleted_line;
+                    removed++;
+                } else {
+                    if (rewrite_line(words, i, (OP_MOV_REG << 11) | (destination << 8) | (reg1 << 5), NULL) < 0) return -1;
+                    rewritten++;
+                }
+                program_memory[next] = deleted_line;
+                removed++;
+                changed = 1;
+            }
+            else if (register_step(word, &total)) {
+                // Merge the run while the total still fits an 8-bit immediate.
+                int last = i, merged = 0;
+                while (next < count && !labels_between(last + 1, next) && register_step(words[next], &step)
+                       && ((words[next] >> 8) & 0x7) == reg1 && abs(total + step) <= 0xFF) {
+                    total += step;
+                    program_memory[next] = deleted_line;
+                    merged++;
+                    last = next;
+                    next = next_instruction(next);
+                }
+                if (merged > 0) {
+                    removed += merged;
+                    changed = 1;
+                    if (total == 0) {
+                        program_memory[i] = deleted_line;
+                        removed++;
+                    } else {
+                        int add = total > 0 ? OP_ADD_IMM : OP_SUB_IMM;
+                        if (rewrite_line(words, i, (add << 11) | (reg1 << 8) | abs(total), NULL) < 0) return -1;
+                        rewritten++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Labels move to the address of the first instruction at or after their line.
+    for (int i = 0, line = 0, address = 0; i < label_count; i++) {
+        for (; line < symbol_table[i].line; line++) address += program_memory[line][0] != '\0';
+        symbol_table[i].address = address;
+    }
+    printf("[Optimize] Removed %d instructions and rewrote %d.\n", removed, rewritten);
+    free(words);
+    free(targets);
+    free(labels_before);
+    for (int i = 0; i < count; i++) {
+        if (rewritten_lines[i] != program_memory[i]) free(rewritten_lines[i]); // Rewritten, then removed.
+    }
+    free(rewritten_lines); // The rest of the text stays in program_memory.
+    labels_before = NULL;
+    return 0;
+}
+
+static int default_thread_count() {
+#if defined(_SC_NPROCESSORS_ONLN)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0) return (int)cores;
+#endif
+    return DEFAULT_THREADS;
+}
+
+// Encodes a chunk of lines into its slice of machine_code, stopping at the first error.
+int encode_chunk(void* argument) {
+    EncodeChunk* chunk = argument;
+    chunk->encoded = 0;
+    chunk->error_line = -1;
+    for (int i = chunk->first_line; i < chunk->end_line; i++) {
         // Skip empty lines (e.g., lines that only contained a label).
         if (program_memory[i][0] == '\0') {
             continue;
         }
 
         // Use 0xFFFF as a sentinel for an encoding error.
-        uint16_t instruction = encode_instruction(program_memory[i], i);
+        WideOperand* wide = chunk->wide_operands != NULL ? &chunk->wide_operands[chunk->encoded] : NULL;
+        uint16_t instruction = encode_instruction(program_memory[i], i, chunk->error, wide);
         if (instruction == 0xFFFF) {
-            return -1; // Halt assembly on error.
+            chunk->error_line = i; // Halt the chunk on error.
+            break;
         }
-        machine_code[instruction_count] = instruction;
+        chunk->machine_code[chunk->encoded++] = instruction;
+    }
+    return 0;
+}
+
+// Pass 2. Once the symbol table is built, every line encodes independently, so the lines are split
+// into chunks that are encoded on separate threads into disjoint slices of machine_code. The listing
+// and the first error are then reported in line order, as a serial pass would. On failure the
+// first error is copied to `error`, which has room for MAX_ERROR_LENGTH bytes.
+int assemble(uint16_t* machine_code, char* error) {
+    int threads = thread_count > 0 ? thread_count : default_thread_count();
+    int chunk_count = (program_line_count + CHUNK_LINES - 1) / CHUNK_LINES;
+    if (chunk_count > threads) chunk_count = threads;
+    if (chunk_count < 1) chunk_count = 1;
+#ifndef HAVE_THREADS
+    chunk_count = 1;
+#endif
+
+    EncodeChunk* chunks = calloc(chunk_count, sizeof(EncodeChunk));
+    if (chunks == NULL) {
+        set_error(error, "[Fatal Error] Out of memory.\n");
+        return -1;
+    }
+    int address = 0;
+    for (int c = 0; c < chunk_count; c++) {
+        chunks[c].first_line = (int)((long long)program_line_count * c / chunk_count);
+        chunks[c].end_line = (int)((long long)program_line_count * (c + 1) / chunk_count);
+        chunks[c].first_address = address;
+        chunks[c].machine_code = machine_code + address;
+        chunks[c].wide_operands = wide_operands != NULL ? wide_operands + address : NULL;
+        for (int i = chunks[c].first_line; i < chunks[c].end_line; i++) address += program_memory[i][0] != '\0';
+    }
+
+#ifdef HAVE_THREADS
+    thrd_t* workers = calloc(chunk_count, sizeof(thrd_t));
+    int started = 1;
+    // The first chunk is encoded on the calling thread; so is any chunk whose thread fails to start.
+    for (int c = 1; workers != NULL && c < chunk_count && started == c; c++) {
+        if (thrd_create(&workers[c], encode_chunk, &chunks[c]) == thrd_success) started++;
+    }
+    encode_chunk(&chunks[0]);
+    for (int c = 1; c < started; c++) thrd_join(workers[c], NULL);
+    for (int c = started; c < chunk_count; c++) encode_chunk(&chunks[c]);
+    free(workers);
+#else
+    encode_chunk(&chunks[0]);
+#endif
+
+    int instruction_count = 0;
+    for (int c = 0; c < chunk_count && instruction_count >= 0; c++) {
         // Print the generated machine code for each instruction.
-        printf("  L%03d: %-25s -> 0x%04X\n", instruction_count, program_memory[i], instruction);
-        instruction_count++;
+        for (int i = chunks[c].first_line, n = 0; print_listing && n < chunks[c].encoded; i++) {
+            if (program_memory[i][0] == '\0') continue;
+            int address = chunks[c].first_address + n;
+            if (wide_operands != NULL && wide_operands[address].wide) {
+                uint32_t operand = (uint32_t)wide_operands[address].operand;
+                printf("  L%03d: %-25s -> 0x%04X 0x%04X 0x%04X 0x%04X\n", address, program_memory[i], WIDE_PREFIX,
+                       machine_code[address], operand & 0xFFFF, operand >> 16);
+            } else {
+                printf("  L%03d: %-25s -> 0x%04X\n", address, program_memory[i], machine_code[address]);
+            }
+            n++;
+        }
+        if (chunks[c].error_line >= 0) {
+            fflush(stdout);
+            memcpy(error, chunks[c].error, MAX_ERROR_LENGTH);
+            instruction_count = -1; // Halt assembly on error.
+        } else {
+            instruction_count += chunks[c].encoded;
+        }
     }
+    free(chunks);
     return instruction_count;
 }
 
+// Assembles in a single pass: reads the source once through a buffer, tokenizes each line in place
+// and writes each instruction as soon as it is encoded. Labels used before their definition are
+// patched in at the end, so memory use grows with labels and fixups rather than with the source.
+int assemble_stream(const char* source_filename, const char* binary_filename, const char* symbol_filename) {
+    printf("\n[Stream] Assembling '%s' into '%s'...\n", source_filename, binary_filename);
+    FILE* in = fopen(source_filename, "rb");
+    if (in == NULL) {
+        perror("[Loader Error] Failed to open program file");
+        return -1;
+    }
+    FILE* out = fopen(binary_filename, "wb");
+    if (out == NULL) {
+        perror("[File Error] Failed to open binary file for writing");
+        fclose(in);
+        return -1;
+    }
+    static const char header_space[IMAGE_CODE_OFFSET];
+    if (image_output && fwrite(header_space, 1, sizeof(header_space), out) != sizeof(header_space)) {
+        fprintf(stderr, "[File Error] Could not write the image header.\n");
+        fclose(in);
+        fclose(out);
+        return -1;
+    }
+    build_mnemonic_table();
+
+    size_t capacity = STREAM_BUFFER_SIZE;
+    char* buffer = malloc(capacity + 1);
+    size_t start = 0, end = 0; // buffer[start, end) holds source not yet assembled.
+    int at_eof = 0, status = 0;
+    if (buffer == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory for the source buffer.\n");
+        status = -1;
+    }
+    int pc = 0; // Index of the line among non-empty lines, as in the two-pass listing.
+
+    while (status == 0) {
+        char* newline = memchr(buffer + start, '\n', end - start);
+        if (newline == NULL && !at_eof) {
+            // Keep the partial line, growing the buffer when a single line fills it, and read more.
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            if (end == capacity) {
+                char* grown = realloc(buffer, capacity * 2 + 1);
+                if (grown == NULL) { fprintf(stderr, "[Fatal Error] Out of memory for the source buffer.\n"); status = -1; break; }
+                buffer = grown;
+                capacity *= 2;
+            }
+            size_t bytes = fread(buffer + end, 1, capacity - end, in);
+            if (bytes == 0) {
+                if (ferror(in)) { perror("[Loader Error] Failed to read program file"); status = -1; }
+                at_eof = 1;
+            }
+            end += bytes;
+            continue;
+        }
+        if (newline == NULL) {
+            if (start == end) break;
+            newline = buffer + end; // Last line, without a newline.
+        }
+        *newline = '\0';
+        char* line = buffer + start;
+        start = newline - buffer + (newline < buffer + end);
+
+        int result = stream_line(line, pc, out);
+        if (result < 0) status = -1;
+        else pc += result;
+    }
+    free(buffer);
+    fclose(in);
+
+    if (status == 0) status = patch_fixups(out);
+    if (status == 0 && image_output && finish_image(out, stream_words, NULL, stream_address) != 0) {
+        fprintf(stderr, "[File Error] Did not write all of the image to file.\n");
+        status = -1;
+    }
+    if (fclose(out) != 0 && status == 0) {
+        fprintf(stderr, "[File Error] Did not write all instructions to file.\n");
+        status = -1;
+    }
+    if (status != 0) {
+        remove(binary_filename);
+        fprintf(stderr, "[Fatal Error] Assembly failed. Please check source file for errors.\n");
+        return -1;
+    }
+    printf("[Stream] Found %d labels and patched %d forward references.\n", label_count, fixup_count);
+
+    if (symbol_filename != NULL) {
+        if (write_symbol_file(symbol_filename) != 0) {
+            fprintf(stderr, "[Fatal Error] Could not write to symbol file.\n");
+            return -1;
+        }
+        printf("[Stream] Wrote symbol table to '%s'.\n", symbol_filename);
+    }
+    printf("\nAssembly complete. %d instructions written to '%s'.\n", stream_address, binary_filename);
+    free(fixups);
+    return 0;
+}
+
+// Strips, labels and encodes one source line for --stream. Returns 1 for a non-empty line, 0 for
+// an empty one and -1 on error.
+int stream_line(char* line, int pc, FILE* out) {
+    line[strcspn(line, "\r")] = '\0';
+    char* comment_start = strchr(line, ';');
+    if (comment_start != NULL) *comment_start = '\0';
+    while (isspace((unsigned char)*line)) line++;
+    if (*line == '\0') return 0;
+
+    char* colon = strchr(line, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        if (add_label(line, stream_address, pc) < 0) {
+            fprintf(stderr, "[Fatal Error] Out of memory for the symbol table.\n");
+            return -1;
+        }
+        line = colon + 1;
+        while (isspace((unsigned char)*line)) line++;
+        if (*line == '\0') return 1;
+    }
+
+    int first_fixup = fixup_count;
+    char error[MAX_ERROR_LENGTH];
+    WideOperand wide = { 0 };
+    uint16_t instruction = encode_line(line, pc, error, wide_encoding ? &wide : NULL);
+    if (instruction == 0xFFFF) {
+        fputs(error, stderr);
+        return -1;
+    }
+    if (fixup_count > first_fixup) {
+        fixups[first_fixup].instruction = instruction;
+        fixups[first_fixup].offset = stream_words;
+        fixups[first_fixup].wide = wide.wide;
+    }
+    uint16_t words[WIDE_WORDS] = { WIDE_PREFIX, instruction, (uint16_t)((uint32_t)wide.operand & 0xFFFF), (uint16_t)((uint32_t)wide.operand >> 16) };
+    size_t word_count = wide.wide ? WIDE_WORDS : 1;
+    if (fwrite(wide.wide ? words : &instruction, sizeof(uint16_t), word_count, out) != word_count) {
+        fprintf(stderr, "[File Error] Did not write all instructions to file.\n");
+        return -1;
+    }
+    stream_address++;
+    stream_words += (int)word_count;
+    return 1;
+}
+
+// Resolves the forward references left by --stream and rewrites their instruction words.
+int patch_fixups(FILE* out) {
+    int status = 0;
+    for (int i = 0; i < fixup_count; i++) {
+        const Fixup* fixup = &fixups[i];
+        int value = get_address_for_label(fixup->name);
+        if (value == -1) { fprintf(stderr, "[Error L%d] Undefined label '%s'.\n", fixup->line, fixup->name); status = -1; continue; }
+        if (value > 0xFF && !fixup->wide) { fprintf(stderr, "[Error L%d] Address %d out of range (0-255).\n", fixup->line, value); status = -1; continue; }
+
+        // A wide instruction gets its operand words, anything else the address in its word.
+        uint16_t words[2] = { (uint16_t)(fixup->instruction | value), 0 };
+        int word = fixup->offset, word_count = 1;
+        if (fixup->wide) {
+            words[0] = (uint16_t)(value & 0xFFFF);
+            words[1] = (uint16_t)(value >> 16);
+            word += 2;
+            word_count = 2;
+        }
+        long code_offset = image_output ? IMAGE_CODE_OFFSET : 0;
+        if (fseek(out, code_offset + (long)word * (long)sizeof(uint16_t), SEEK_SET) != 0
+            || fwrite(words, sizeof(uint16_t), word_count, out) != (size_t)word_count) {
+            fprintf(stderr, "[File Error] Failed to patch instruction %d.\n", fixup->address);
+            return -1;
+        }
+    }
+    return status;
+}
+
 int get_register_code(const char* reg_name) {
     if (reg_name == NULL) return -1;
     char upper_name[MAX_LABEL_LENGTH];
@@ -199,26 +956,118 @@ int get_register_code(const char* reg_name) {
     upper_name[MAX_LABEL_LENGTH - 1] = '\0';
     for (char* p = upper_name; *p; ++p) *p = toupper(*p);
 
-    if (strcmp(upper_name, "EAX") == 0) return 0;
-    if (strcmp(upper_name, "EBX") == 0) return 1;
-    if (strcmp(upper_name, "ECX") == 0) return 2;
-    if (strcmp(upper_name, "EDX") == 0) return 3;
-    if (strcmp(upper_name, "ESI") == 0) return 4;
-    if (strcmp(upper_name, "EDI") == 0) return 5;
-    if (strcmp(upper_name, "EBP") == 0) return 6;
-    if (strcmp(upper_name, "ESP") == 0) return 7;
+    for (int i = 0; i < (int)(sizeof(register_names) / sizeof(register_names[0])); i++) {
+        if (strcmp(upper_name, register_names[i]) == 0) return i;
+    }
     return -1; // Invalid register.
 }
-uint16_t encode_instruction(const char* line, int pc) {
-    char line_copy[MAX_LINE_LENGTH];
-    strncpy(line_copy, line, MAX_LINE_LENGTH - 1);
-    line_copy[MAX_LINE_LENGTH - 1] = '\0';
-    char* parts[4] = { NULL };
+
+// Returns the mnemonic_table entry for `name`, or the empty entry where it would go.
+static Mnemonic* mnemonic_slot(const char* name) {
+    uint32_t slot = hash_name(name) & (MNEMONIC_SLOTS - 1);
+    while (mnemonic_table[slot].name != NULL && strcmp(mnemonic_table[slot].name, name) != 0) {
+        slot = (slot + 1) & (MNEMONIC_SLOTS - 1);
+    }
+    return &mnemonic_table[slot];
+}
+
+// Hashes every mnemonic of the instruction set, with the opcode of each of its forms, and the aliases.
+void build_mnemonic_table() {
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+        Mnemonic* m = mnemonic_slot(instruction_forms[opcode].mnemonic);
+        if (m->name == NULL) {
+            m->name = instruction_forms[opcode].mnemonic;
+            for (int form = 0; form < FORM_COUNT; form++) m->opcode[form] = -1;
+        }
+        m->opcode[instruction_forms[opcode].form] = opcode;
+    }
+    for (int op = 0; op < BLOCK_OP_COUNT; op++) {
+        Mnemonic* m = mnemonic_slot(block_forms[op].mnemonic);
+        m->name = block_forms[op].mnemonic;
+        for (int form = 0; form < FORM_COUNT; form++) m->opcode[form] = -1;
+        m->opcode[block_forms[op].form] = op + 1;
+    }
+    for (size_t i = 0; i < sizeof(mnemonic_aliases) / sizeof(mnemonic_aliases[0]); i++) {
+        Mnemonic* m = mnemonic_slot(mnemonic_aliases[i].alias);
+        *m = *mnemonic_slot(mnemonic_aliases[i].mnemonic);
+        m->name = mnemonic_aliases[i].alias;
+    }
+}
+
+// Looks up an upper-case mnemonic (or alias). Returns NULL for an unknown one.
+const Mnemonic* find_mnemonic(const char* name) {
+    const Mnemonic* m = mnemonic_slot(name);
+    return m->name != NULL ? m : NULL;
+}
+
+// Writes an encoding error into `error`, a buffer of MAX_ERROR_LENGTH, for the caller to report.
+void set_error(char* error, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, MAX_ERROR_LENGTH, format, args);
+    va_end(args);
+}
+
+// Splits the next operand off `*cursor` in place, like strtok() on " \t," but without hidden state,
+// so that pass-2 threads can tokenize at the same time.
+char* next_token(char** cursor) {
+    char* token = *cursor + strspn(*cursor, " \t,");
+    if (*token == '\0') return NULL;
+    char* end = token + strcspn(token, " \t,");
+    *cursor = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+    return token;
+}
+
+// Encodes a line from a copy, leaving the original intact for the listing.
+uint16_t encode_instruction(const char* line, int pc, char* error, WideOperand* wide) {
+    char stack_copy[MAX_LINE_LENGTH];
+    size_t length = strlen(line);
+    char* line_copy = length < MAX_LINE_LENGTH ? stack_copy : malloc(length + 1);
+    if (line_copy == NULL) {
+        set_error(error, "[Error L%d] Out of memory.\n", pc);
+        return 0xFFFF;
+    }
+    memcpy(line_copy, line, length + 1);
+    uint16_t instruction = encode_line(line_copy, pc, error, wide);
+    if (line_copy != stack_copy) free(line_copy);
+    return instruction;
+}
+
+// Returns what goes in an operand field that holds low..high: `value`, or 0 when `value` is moved
+// to `*wide` because it does not fit or `forced` asks for the wide form (a --stream fixup, whose
+// address is not known yet). Returns -1 when it does not fit and `wide` is NULL.
+static int fit_operand(int value, int low, int high, int forced, WideOperand* wide) {
+    if (wide == NULL) return value >= low && value <= high ? value : -1;
+    if (value >= low && value <= high && !forced) return value;
+    wide->wide = 1;
+    wide->operand = value;
+    return 0;
+}
+
+// Returns the '+' or '-' of a "[base+off]" or "[base-off]" operand, or NULL for an absolute address.
+static char* offset_sign(char* operand) {
+    char* sign = strchr(operand, '+');
+    if (sign != NULL || (sign = strchr(operand, '-')) == NULL) return sign;
+    char base[MAX_LABEL_LENGTH];
+    size_t length = (size_t)(sign - operand) - 1; // After the '['.
+    if (length == 0 || length >= sizeof(base)) return NULL;
+    memcpy(base, operand + 1, length);
+    base[length] = '\0';
+    return get_register_code(base) >= 0 ? sign : NULL; // "[label-name]" is an address.
+}
+
+// Encodes one instruction, tokenizing `line` in place. Returns 0xFFFF on error, with the message
+// in `error`. With `wide`, operands that do not fit their field are stored there (see fit_operand()).
+// --cache keys builds on ASSEMBLER_VERSION and the isa.h tables, not on this code: bump the version
+// with any change here, in fit_operand() or in -O that makes a source assemble to different words.
+uint16_t encode_line(char* line, int pc, char* error, WideOperand* wide) {
+    char* parts[5] = { NULL };
     int part_count = 0;
-    char* token = strtok(line_copy, " \t,");
-    while (token != NULL && part_count < 4) {
+    char* token = next_token(&line);
+    while (token != NULL && part_count < 5) {
         parts[part_count++] = token;
-        token = strtok(NULL, " \t,");
+        token = next_token(&line);
     }
 
     if (part_count == 0) return 0;
@@ -226,169 +1075,186 @@ uint16_t encode_instruction(const char* line, int pc) {
     char* opcode_str = parts[0];
     for (char* p = opcode_str; *p; ++p) *p = toupper(*p);
 
-    uint16_t instruction = 0, opcode = 0;
-    int reg1_code = 0, reg2_code = 0, value = 0;
+    uint16_t instruction = 0;
+    int opcode = 0, reg1_code = 0, reg2_code = 0, value = 0, field = 0;
+    int first_fixup = fixup_count; // A label operand --stream has not seen yet adds a fixup.
+    const Mnemonic* mnemonic = find_mnemonic(opcode_str);
+    if (wide != NULL) wide->wide = 0;
+
+    if (mnemonic == NULL) {
+        set_error(error, "[Error L%d] Unknown mnemonic '%s'.\n", pc, opcode_str);
+        return 0xFFFF;
+    }
 
     // 0-operand instructions.
-    if (strcmp(opcode_str, "HLT") == 0) { opcode = 0b00000; instruction = opcode << 11; }
-    else if (strcmp(opcode_str, "RET") == 0) { opcode = 0b01110; instruction = opcode << 11; }
+    if ((opcode = mnemonic->opcode[FORM_NONE]) >= 0) { instruction = opcode << 11; }
 
     // 1-operand instructions (register).
-    else if (strcmp(opcode_str, "INP") == 0 || strcmp(opcode_str, "OUT") == 0 ||
-             strcmp(opcode_str, "INC") == 0 || strcmp(opcode_str, "DEC") == 0 ||
-             strcmp(opcode_str, "NOT") == 0 || strcmp(opcode_str, "PUSH") == 0 ||
-             strcmp(opcode_str, "POP") == 0) {
-        if (part_count != 2) { fprintf(stderr, "[Error L%d] %s requires 1 register operand.\n", pc, opcode_str); return 0xFFFF; }
-        if (strcmp(opcode_str, "INP") == 0) opcode = 0b00100;
-        if (strcmp(opcode_str, "OUT") == 0) opcode = 0b00101;
-        if (strcmp(opcode_str, "INC") == 0) opcode = 0b01001;
-        if (strcmp(opcode_str, "DEC") == 0) opcode = 0b01010;
-        if (strcmp(opcode_str, "PUSH") == 0) opcode = 0b01011;
-        if (strcmp(opcode_str, "POP") == 0) opcode = 0b01100;
-        if (strcmp(opcode_str, "NOT") == 0) opcode = 0b10110;
+    else if ((opcode = mnemonic->opcode[FORM_REG]) >= 0) {
+        if (part_count != 2) { set_error(error, "[Error L%d] %s requires 1 register operand.\n", pc, opcode_str); return 0xFFFF; }
         reg1_code = get_register_code(parts[1]);
-        if (reg1_code == -1) { fprintf(stderr, "[Error L%d] Invalid register '%s'.\n", pc, parts[1]); return 0xFFFF; }
+        if (reg1_code == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, parts[1]); return 0xFFFF; }
         instruction = (opcode << 11) | (reg1_code << 8);
     }
 
     // 1-operand instructions (address/label).
-    else if (strcmp(opcode_str, "JMP") == 0 || strcmp(opcode_str, "JE") == 0 || strcmp(opcode_str, "JZ") == 0 ||
-             strcmp(opcode_str, "JNE") == 0 || strcmp(opcode_str, "JNZ") == 0 || strcmp(opcode_str, "JG") == 0 ||
-             strcmp(opcode_str, "JNLE") == 0 || strcmp(opcode_str, "JL") == 0 || strcmp(opcode_str, "JNGE") == 0 ||
-             strcmp(opcode_str, "JGE") == 0 || strcmp(opcode_str, "JNL") == 0 || strcmp(opcode_str, "JLE") == 0 ||
-             strcmp(opcode_str, "JNG") == 0 || strcmp(opcode_str, "CALL") == 0) {
-        if (part_count != 2) { fprintf(stderr, "[Error L%d] %s requires 1 address/label operand.\n", pc, opcode_str); return 0xFFFF; }
-        if (strcmp(opcode_str, "JMP") == 0) opcode = 0b11000;
-        if (strcmp(opcode_str, "JE") == 0 || strcmp(opcode_str, "JZ") == 0) opcode = 0b11001;
-        if (strcmp(opcode_str, "JNE") == 0 || strcmp(opcode_str, "JNZ") == 0) opcode = 0b11010;
-        if (strcmp(opcode_str, "JG") == 0 || strcmp(opcode_str, "JNLE") == 0) opcode = 0b11011;
-        if (strcmp(opcode_str, "JL") == 0 || strcmp(opcode_str, "JNGE") == 0) opcode = 0b11100;
-        if (strcmp(opcode_str, "JGE") == 0 || strcmp(opcode_str, "JNL") == 0) opcode = 0b11101;
-        if (strcmp(opcode_str, "JLE") == 0 || strcmp(opcode_str, "JNG") == 0) opcode = 0b11110;
-        if (strcmp(opcode_str, "CALL") == 0) opcode = 0b01101;
-        value = isalpha((unsigned char)parts[1][0]) ? get_address_for_label(parts[1]) : atoi(parts[1]);
-        if (value == -1) { fprintf(stderr, "[Error L%d] Undefined label '%s'.\n", pc, parts[1]); return 0xFFFF; }
-        if (value < 0 || value > 0xFF) { fprintf(stderr, "[Error L%d] Address %d out of range (0-255).\n", pc, value); return 0xFFFF; }
-        instruction = (opcode << 11) | value;
-    }
-
-    // 2-operand instructions.
-    else if (strcmp(opcode_str, "ADD") == 0 || strcmp(opcode_str, "SUB") == 0 || strcmp(opcode_str, "CMP") == 0 ||
-             strcmp(opcode_str, "MUL") == 0 || strcmp(opcode_str, "DIV") == 0 || strcmp(opcode_str, "XOR") == 0) {
-        if (part_count != 3) { fprintf(stderr, "[Error L%d] %s requires 2 operands.\n", pc, opcode_str); return 0xFFFF; }
+    else if ((opcode = mnemonic->opcode[FORM_ADDR]) >= 0) {
+        if (part_count != 2) { set_error(error, "[Error L%d] %s requires 1 address/label operand.\n", pc, opcode_str); return 0xFFFF; }
+        value = isalpha((unsigned char)parts[1][0]) ? resolve_label(parts[1], pc, error) : atoi(parts[1]);
+        if (value == -2) return 0xFFFF;
+        if (value == -1) { set_error(error, "[Error L%d] Undefined label '%s'.\n", pc, parts[1]); return 0xFFFF; }
+        if (value < 0 || (field = fit_operand(value, 0, 0xFF, fixup_count > first_fixup, wide)) < 0) {
+            set_error(error, "[Error L%d] Address %d out of range (0-255).\n", pc, value);
+            return 0xFFFF;
+        }
+        instruction = (opcode << 11) | field;
+    }
+
+    // Block instructions: three registers, in the HLT word's free bits.
+    else if ((opcode = mnemonic->opcode[FORM_REG_REG_REG]) >= 0) {
+        if (part_count != 4) { set_error(error, "[Error L%d] %s requires 3 register operands.\n", pc, opcode_str); return 0xFFFF; }
+        int codes[3];
+        for (int i = 0; i < 3; i++) {
+            codes[i] = get_register_code(parts[i + 1]);
+            if (codes[i] == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, parts[i + 1]); return 0xFFFF; }
+        }
+        instruction = (OP_HLT << 11) | (codes[0] << 8) | (codes[1] << 5) | (opcode << 3) | codes[2];
+    }
+
+    // 2-operand instructions. MOV has memory forms too and is handled separately below.
+    else if (mnemonic->opcode[FORM_REG_REG] >= 0 && mnemonic->opcode[FORM_REG_ADDR] < 0) {
+        if (part_count != 3) { set_error(error, "[Error L%d] %s requires 2 operands.\n", pc, opcode_str); return 0xFFFF; }
         char* operand2 = parts[2];
 
         // Check if the second operand is an immediate value.
         if (operand2[0] == '#') {
-            if (strcmp(opcode_str, "ADD") == 0) opcode = 0b10011;
-            else if (strcmp(opcode_str, "SUB") == 0) opcode = 0b10100;
-            else if (strcmp(opcode_str, "CMP") == 0) opcode = 0b10101;
-            else { fprintf(stderr, "[Error L%d] Immediate value not supported for %s.\n", pc, opcode_str); return 0xFFFF; }
+            opcode = mnemonic->opcode[FORM_REG_IMM];
+            if (opcode < 0) { set_error(error, "[Error L%d] Immediate value not supported for %s.\n", pc, opcode_str); return 0xFFFF; }
 
             reg1_code = get_register_code(parts[1]);
             value = atoi(operand2 + 1);
-            if (reg1_code == -1) { fprintf(stderr, "[Error L%d] Invalid register '%s'.\n", pc, parts[1]); return 0xFFFF; }
-            if (value < 0 || value > 0xFF) { fprintf(stderr, "[Error L%d] Immediate value %d out of range (0-255).\n", pc, value); return 0xFFFF; }
-            instruction = (opcode << 11) | (reg1_code << 8) | value;
+            if (reg1_code == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, parts[1]); return 0xFFFF; }
+            if ((field = fit_operand(value, 0, 0xFF, 0, wide)) < 0) { set_error(error, "[Error L%d] Immediate value %d out of range (0-255).\n", pc, value); return 0xFFFF; }
+            instruction = (opcode << 11) | (reg1_code << 8) | field;
         }
         // Otherwise, it's a register-register operation.
         else {
-            if (strcmp(opcode_str, "ADD") == 0) opcode = 0b10000;
-            if (strcmp(opcode_str, "SUB") == 0) opcode = 0b10001;
-            if (strcmp(opcode_str, "CMP") == 0) opcode = 0b10111;
-            if (strcmp(opcode_str, "MUL") == 0) opcode = 0b00001;
-            if (strcmp(opcode_str, "DIV") == 0) opcode = 0b00010;
-            if (strcmp(opcode_str, "XOR") == 0) opcode = 0b00011;
+            opcode = mnemonic->opcode[FORM_REG_REG];
             reg1_code = get_register_code(parts[1]);
             reg2_code = get_register_code(parts[2]);
-            if (reg1_code == -1 || reg2_code == -1) { fprintf(stderr, "[Error L%d] Invalid register in %s instruction.\n", pc, opcode_str); return 0xFFFF; }
+            if (reg1_code == -1 || reg2_code == -1) { set_error(error, "[Error L%d] Invalid register in %s instruction.\n", pc, opcode_str); return 0xFFFF; }
             instruction = (opcode << 11) | (reg1_code << 8) | (reg2_code << 5);
         }
     }
 
     // The MOV instruction has special handling due to its multiple forms.
-    else if (strcmp(opcode_str, "MOV") == 0) {
-        if (part_count != 3) { fprintf(stderr, "[Error L%d] MOV requires 2 operands.\n", pc); return 0xFFFF; }
+    else if (mnemonic->opcode[FORM_REG_REG] >= 0) {
+        if (part_count != 3) { set_error(error, "[Error L%d] MOV requires 2 operands.\n", pc); return 0xFFFF; }
         char* dest = parts[1]; char* src = parts[2];
         int dest_is_mem = (dest[0] == '['); int src_is_mem = (src[0] == '[');
 
-        if (dest_is_mem && src_is_mem) { fprintf(stderr, "[Error L%d] Memory-to-memory MOV is not supported.\n", pc); return 0xFFFF; }
+        if (dest_is_mem && src_is_mem) { set_error(error, "[Error L%d] Memory-to-memory MOV is not supported.\n", pc); return 0xFFFF; }
 
-        // Check for base+offset addressing, e.g., [EBP+1].
-        char* plus = strchr(dest_is_mem ? dest : src, '+');
-        if ((dest_is_mem || src_is_mem) && plus != NULL) {
-            char base_reg_str[MAX_LABEL_LENGTH];
+        // Check for base+offset addressing, e.g., [EBP+1] or [EBP-8].
+        char* sign = offset_sign(dest_is_mem ? dest : src);
+        if ((dest_is_mem || src_is_mem) && sign != NULL) {
+            char* base_reg_str;
             int offset = 0;
             int base_reg_code = -1;
             int reg_code = -1;
 
             char* mem_operand = dest_is_mem ? dest : src;
             // Extract the base register and offset.
-            strncpy(base_reg_str, mem_operand + 1, plus - (mem_operand + 1));
-            base_reg_str[plus - (mem_operand + 1)] = '\0';
-            offset = atoi(plus + 1);
+            offset = *sign == '-' ? -atoi(sign + 1) : atoi(sign + 1);
+            *sign = '\0';
+            base_reg_str = mem_operand + 1;
             base_reg_code = get_register_code(base_reg_str);
 
-            if (base_reg_code == -1) { fprintf(stderr, "[Error L%d] Invalid base register '%s' in memory operand.\n", pc, base_reg_str); return 0xFFFF; }
-            if (offset < 0 || offset > 0x1F) { fprintf(stderr, "[Error L%d] Offset %d out of range (0-31).\n", pc, offset); return 0xFFFF; }
+            if (base_reg_code == -1) { set_error(error, "[Error L%d] Invalid base register '%s' in memory operand.\n", pc, base_reg_str); return 0xFFFF; }
+            if ((field = fit_operand(offset, 0, 0x1F, 0, wide)) < 0) { set_error(error, "[Error L%d] Offset %d out of range (0-31).\n", pc, offset); return 0xFFFF; }
 
             if (dest_is_mem) { // MOV [base+off], reg.
-                opcode = 0b11111;
+                opcode = mnemonic->opcode[FORM_BASE_OFF_REG];
                 reg_code = get_register_code(src);
-                if (reg_code == -1) { fprintf(stderr, "[Error L%d] Invalid source register '%s'.\n", pc, src); return 0xFFFF; }
-                instruction = (opcode << 11) | (reg_code << 8) | (base_reg_code << 5) | offset;
+                if (reg_code == -1) { set_error(error, "[Error L%d] Invalid source register '%s'.\n", pc, src); return 0xFFFF; }
+                instruction = (opcode << 11) | (reg_code << 8) | (base_reg_code << 5) | field;
             } else { // MOV reg, [base+off].
-                opcode = 0b01111;
+                opcode = mnemonic->opcode[FORM_REG_BASE_OFF];
                 reg_code = get_register_code(dest);
-                if (reg_code == -1) { fprintf(stderr, "[Error L%d] Invalid destination register '%s'.\n", pc, dest); return 0xFFFF; }
-                instruction = (opcode << 11) | (reg_code << 8) | (base_reg_code << 5) | offset;
+                if (reg_code == -1) { set_error(error, "[Error L%d] Invalid destination register '%s'.\n", pc, dest); return 0xFFFF; }
+                instruction = (opcode << 11) | (reg_code << 8) | (base_reg_code << 5) | field;
             }
         }
         else if (!dest_is_mem && src[0] == '#') { // MOV reg, imm.
-            opcode = 0b00110;
+            opcode = mnemonic->opcode[FORM_REG_IMM];
             reg1_code = get_register_code(dest);
             value = atoi(src + 1);
-            if (reg1_code == -1) { fprintf(stderr, "[Error L%d] Invalid register '%s'.\n", pc, dest); return 0xFFFF; }
-            if (value < 0 || value > 0xFF) { fprintf(stderr, "[Error L%d] Immediate value %d out of range (0-255).\n", pc, value); return 0xFFFF; }
-            instruction = (opcode << 11) | (reg1_code << 8) | value;
+            if (reg1_code == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, dest); return 0xFFFF; }
+            if ((field = fit_operand(value, 0, 0xFF, 0, wide)) < 0) { set_error(error, "[Error L%d] Immediate value %d out of range (0-255).\n", pc, value); return 0xFFFF; }
+            instruction = (opcode << 11) | (reg1_code << 8) | field;
         }
         else if (!dest_is_mem && src_is_mem) { // MOV reg, [addr].
-            opcode = 0b00111;
+            opcode = mnemonic->opcode[FORM_REG_ADDR];
             reg1_code = get_register_code(dest);
-            char addr_str[MAX_LABEL_LENGTH]; strncpy(addr_str, src + 1, strlen(src) - 2); addr_str[strlen(src) - 2] = '\0';
-            value = isalpha((unsigned char)addr_str[0]) ? get_address_for_label(addr_str) : atoi(addr_str);
-            if (reg1_code == -1) { fprintf(stderr, "[Error L%d] Invalid register '%s'.\n", pc, dest); return 0xFFFF; }
-            if (value == -1) { fprintf(stderr, "[Error L%d] Undefined label '%s'.\n", pc, addr_str); return 0xFFFF; }
-            if (value < 0 || value > 0xFF) { fprintf(stderr, "[Error L%d] Address %d out of range (0-255).\n", pc, value); return 0xFFFF; }
-            instruction = (opcode << 11) | (reg1_code << 8) | value;
+            char* addr_str = src + 1; if (strlen(src) >= 2) src[strlen(src) - 1] = '\0'; // Drop the ']'.
+            value = isalpha((unsigned char)addr_str[0]) ? resolve_label(addr_str, pc, error) : atoi(addr_str);
+            if (value == -2) return 0xFFFF;
+            if (reg1_code == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, dest); return 0xFFFF; }
+            if (value == -1) { set_error(error, "[Error L%d] Undefined label '%s'.\n", pc, addr_str); return 0xFFFF; }
+            if (value < 0 || (field = fit_operand(value, 0, 0xFF, fixup_count > first_fixup, wide)) < 0) {
+                set_error(error, "[Error L%d] Address %d out of range (0-255).\n", pc, value);
+                return 0xFFFF;
+            }
+            instruction = (opcode << 11) | (reg1_code << 8) | field;
         }
         else if (dest_is_mem && !src_is_mem) { // MOV [addr], reg.
-            opcode = 0b01000;
+            opcode = mnemonic->opcode[FORM_ADDR_REG];
             reg1_code = get_register_code(src);
-            char addr_str[MAX_LABEL_LENGTH]; strncpy(addr_str, dest + 1, strlen(dest) - 2); addr_str[strlen(dest) - 2] = '\0';
-            value = isalpha((unsigned char)addr_str[0]) ? get_address_for_label(addr_str) : atoi(addr_str);
-            if (reg1_code == -1) { fprintf(stderr, "[Error L%d] Invalid register '%s'.\n", pc, src); return 0xFFFF; }
-            if (value == -1) { fprintf(stderr, "[Error L%d] Undefined label '%s'.\n", pc, addr_str); return 0xFFFF; }
-            if (value < 0 || value > 0xFF) { fprintf(stderr, "[Error L%d] Address %d out of range (0-255).\n", pc, value); return 0xFFFF; }
-            instruction = (opcode << 11) | (reg1_code << 8) | value;
+            char* addr_str = dest + 1; if (strlen(dest) >= 2) dest[strlen(dest) - 1] = '\0'; // Drop the ']'.
+            value = isalpha((unsigned char)addr_str[0]) ? resolve_label(addr_str, pc, error) : atoi(addr_str);
+            if (value == -2) return 0xFFFF;
+            if (reg1_code == -1) { set_error(error, "[Error L%d] Invalid register '%s'.\n", pc, src); return 0xFFFF; }
+            if (value == -1) { set_error(error, "[Error L%d] Undefined label '%s'.\n", pc, addr_str); return 0xFFFF; }
+            if (value < 0 || (field = fit_operand(value, 0, 0xFF, fixup_count > first_fixup, wide)) < 0) {
+                set_error(error, "[Error L%d] Address %d out of range (0-255).\n", pc, value);
+                return 0xFFFF;
+            }
+            instruction = (opcode << 11) | (reg1_code << 8) | field;
         }
         else if (!dest_is_mem && !src_is_mem) { // MOV reg, reg.
-            opcode = 0b10010;
+            opcode = mnemonic->opcode[FORM_REG_REG];
             reg1_code = get_register_code(dest);
             reg2_code = get_register_code(src);
-            if (reg1_code == -1 || reg2_code == -1) { fprintf(stderr, "[Error L%d] Invalid register in MOV instruction.\n", pc); return 0xFFFF; }
+            if (reg1_code == -1 || reg2_code == -1) { set_error(error, "[Error L%d] Invalid register in MOV instruction.\n", pc); return 0xFFFF; }
             instruction = (opcode << 11) | (reg1_code << 8) | (reg2_code << 5);
         }
-        else { fprintf(stderr, "[Error L%d] Invalid operands for MOV: %s, %s\n", pc, dest, src); return 0xFFFF; }
+        else { set_error(error, "[Error L%d] Invalid operands for MOV: %s, %s\n", pc, dest, src); return 0xFFFF; }
     }
     else {
-        fprintf(stderr, "[Error L%d] Unknown mnemonic '%s'.\n", pc, opcode_str);
+        set_error(error, "[Error L%d] Unknown mnemonic '%s'.\n", pc, opcode_str);
         return 0xFFFF;
     }
     return instruction;
 }
 
 
+// Writes the instruction words, each wide one preceded by WIDE_PREFIX and followed by its operand.
+// Returns the number of words written, or -1.
+int write_code(FILE* f, const uint16_t* machine_code, int instruction_count) {
+    if (wide_operands == NULL) {
+        return fwrite(machine_code, sizeof(uint16_t), instruction_count, f) == (size_t)instruction_count ? instruction_count : -1;
+    }
+    int words = 0;
+    for (int pc = 0; pc < instruction_count; pc++) {
+        uint32_t operand = (uint32_t)wide_operands[pc].operand;
+        uint16_t wide[WIDE_WORDS] = { WIDE_PREFIX, machine_code[pc], (uint16_t)(operand & 0xFFFF), (uint16_t)(operand >> 16) };
+        size_t count = wide_operands[pc].wide ? WIDE_WORDS : 1;
+        if (fwrite(wide_operands[pc].wide ? wide : &machine_code[pc], sizeof(uint16_t), count, f) != count) return -1;
+        words += (int)count;
+    }
+    return words;
+}
+
 int write_binary_file(const char* filename, const uint16_t* machine_code, int instruction_count) {
     FILE* f = fopen(filename, "wb");
     if (f == NULL) {
@@ -396,12 +1262,319 @@ int write_binary_file(const char* filename, const uint16_t* machine_code, int in
         return -1;
     }
 
-    size_t written = fwrite(machine_code, sizeof(uint16_t), instruction_count, f);
-    fclose(f);
+    int written = write_code(f, machine_code, instruction_count);
+    if (fclose(f) != 0) written = -1;
 
-    if (written != instruction_count) {
+    if (written < 0) {
         fprintf(stderr, "[File Error] Did not write all instructions to file.\n");
         return -1;
     }
     return 0;
 }
+
+// Writes the machine code as a program image (see isa.h) with the symbol table and basic-block index.
+int write_image_file(const char* filename, const uint16_t* machine_code, int instruction_count) {
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        perror("[File Error] Failed to open image file for writing");
+        return -1;
+    }
+
+    static const char header_space[IMAGE_CODE_OFFSET];
+    int words = fwrite(header_space, 1, sizeof(header_space), f) == sizeof(header_space) ? write_code(f, machine_code, instruction_count) : -1;
+    int status = words >= 0 ? finish_image(f, words, machine_code, instruction_count) : -1;
+    if (fclose(f) != 0) status = -1;
+    if (status != 0) fprintf(stderr, "[File Error] Did not write all of the image to file.\n");
+    return status;
+}
+
+// Pads `f` to the next IMAGE_ALIGNMENT boundary and appends `size` bytes there, at `*offset`.
+static int append_aligned(FILE* f, const void* data, size_t size, uint64_t* offset) {
+    static const char padding[IMAGE_ALIGNMENT];
+    if (fseek(f, 0, SEEK_END) != 0) return -1;
+    long end = ftell(f);
+    if (end < 0) return -1;
+    size_t pad = (IMAGE_ALIGNMENT - end % IMAGE_ALIGNMENT) % IMAGE_ALIGNMENT;
+    if (fwrite(padding, 1, pad, f) != pad || fwrite(data, 1, size, f) != size) return -1;
+    *offset = (uint64_t)end + pad;
+    return 0;
+}
+
+// PCs that start a basic block: the entry, every jump or call target in the program, and every
+// instruction after a control transfer. Returns them ascending in a new array, or NULL.
+static uint32_t* find_block_leaders(const uint16_t* machine_code, int instruction_count, int* count) {
+    uint8_t* leader = calloc(instruction_count + 1, 1);
+    uint32_t* blocks = leader ? malloc((instruction_count + 1) * sizeof(uint32_t)) : NULL;
+    if (blocks == NULL) {
+        free(leader);
+        return NULL;
+    }
+    leader[0] = 1;
+    for (int pc = 0; pc < instruction_count; pc++) {
+        int opcode = machine_code[pc] >> 11;
+        int target = wide_operands != NULL && wide_operands[pc].wide ? wide_operands[pc].operand : machine_code[pc] & 0xFF;
+        if ((opcode >= OP_JMP && opcode <= OP_JLE) || opcode == OP_CALL) {
+            if (target < instruction_count) leader[target] = 1;
+        } else if (opcode != OP_RET && (opcode != OP_HLT || BLOCK_OP(machine_code[pc]) != 0)) {
+            continue;
+        }
+        leader[pc + 1] = 1;
+    }
+    *count = 0;
+    for (int pc = 0; pc < instruction_count; pc++) {
+        if (leader[pc]) blocks[(*count)++] = (uint32_t)pc;
+    }
+    free(leader);
+    return blocks;
+}
+
+// Completes an image whose `code_words` words of code already follow its header: appends the
+// symbol table and, when given the code, the basic-block index, then the section table, and
+// writes the header last.
+int finish_image(FILE* f, int code_words, const uint16_t* machine_code, int instruction_count) {
+    ImageSection sections[3] = { { IMAGE_CODE, 0, IMAGE_CODE_OFFSET, (uint64_t)code_words * sizeof(uint16_t) } };
+    int section_count = 1;
+    int status = 0;
+
+    ImageSymbol* symbols = calloc(label_count > 0 ? label_count : 1, sizeof(ImageSymbol));
+    if (symbols == NULL) return -1;
+    for (int i = 0; i < label_count; i++) {
+        symbols[i].address = (uint32_t)symbol_table[i].address;
+        strncpy(symbols[i].name, symbol_table[i].name, sizeof(symbols[i].name) - 1);
+    }
+    if (label_count > 0) {
+        sections[section_count] = (ImageSection){ IMAGE_SYMBOLS, 0, 0, (uint64_t)label_count * sizeof(ImageSymbol) };
+        status = append_aligned(f, symbols, sections[section_count].size, &sections[section_count].offset);
+        section_count++;
+    }
+    free(symbols);
+
+    if (status == 0 && machine_code != NULL && instruction_count > 0) {
+        int block_count = 0;
+        uint32_t* blocks = find_block_leaders(machine_code, instruction_count, &block_count);
+        if (blocks == NULL) return -1;
+        sections[section_count] = (ImageSection){ IMAGE_BLOCKS, 0, 0, (uint64_t)block_count * sizeof(uint32_t) };
+        status = append_aligned(f, blocks, sections[section_count].size, &sections[section_count].offset);
+        section_count++;
+        free(blocks);
+    }
+
+    ImageHeader header = { 0 };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.code_length = (uint32_t)code_words;
+    header.section_count = (uint32_t)section_count;
+    if (status == 0) status = append_aligned(f, sections, section_count * sizeof(ImageSection), &header.section_table);
+    if (status == 0 && (fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, f) != 1)) status = -1;
+    return status;
+}
+
+// Writes the symbol table as "ADDRESS NAME" lines, which the simulator's --symbols option reads.
+int write_symbol_file(const char* filename) {
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror("[File Error] Failed to open symbol file for writing");
+        return -1;
+    }
+
+    for (int i = 0; i < label_count; i++) {
+        fprintf(f, "%d %s\n", symbol_table[i].address, symbol_table[i].name);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// --- Build Cache ---
+// Under --cache=DIR, a finished build is stored as DIR/<key>.out (and .sym), keyed by a hash of
+// the assembler, the options and the source, and an identical build copies it back.
+
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    for (const unsigned char* p = data; size-- > 0; p++) hash = (hash ^ *p) * 1099511628211u;
+    return hash;
+}
+
+// Changes with ASSEMBLER_VERSION and with the instruction set tables in isa.h.
+uint64_t assembler_fingerprint() {
+    int version = ASSEMBLER_VERSION;
+    uint64_t hash = hash_bytes(14695981039346656037u, &version, sizeof(version));
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        hash = hash_bytes(hash, instruction_forms[i].mnemonic, strlen(instruction_forms[i].mnemonic) + 1);
+        hash = hash_bytes(hash, &instruction_forms[i].form, sizeof(instruction_forms[i].form));
+    }
+    for (int i = 0; i < BLOCK_OP_COUNT; i++) {
+        hash = hash_bytes(hash, block_forms[i].mnemonic, strlen(block_forms[i].mnemonic) + 1);
+    }
+    for (size_t i = 0; i < sizeof(mnemonic_aliases) / sizeof(mnemonic_aliases[0]); i++) {
+        hash = hash_bytes(hash, mnemonic_aliases[i].alias, strlen(mnemonic_aliases[i].alias) + 1);
+        hash = hash_bytes(hash, mnemonic_aliases[i].mnemonic, strlen(mnemonic_aliases[i].mnemonic) + 1);
+    }
+    return hash;
+}
+
+// Keys a whole build of the `length` bytes of source_text.
+uint64_t build_key(size_t length) {
+    int options[] = { optimize, streaming, image_output, wide_encoding };
+    uint64_t key = hash_bytes(assembler_fingerprint(), options, sizeof(options));
+    return hash_bytes(key, source_text, length);
+}
+
+// Creates a temporary file beside `to` for writing, and a malloc()ed copy of its name in
+// *temporary. The name is unique, so assemblers that store or restore the same build at once never
+// write into each other's copy. Returns NULL on failure.
+FILE* open_temporary(const char* to, char** temporary) {
+    size_t size = strlen(to) + 32;
+    char* name = malloc(size);
+    *temporary = name;
+    if (name == NULL) return NULL;
+#if defined(__unix__) || defined(__APPLE__)
+    snprintf(name, size, "%s.XXXXXX", to);
+    int fd = mkstemp(name);
+    FILE* f = NULL;
+    if (fd >= 0) {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask); // mkstemp() creates the file 0600; give the output the usual mode.
+        if ((f = fdopen(fd, "wb")) == NULL) {
+            close(fd);
+            remove(name);
+        }
+    }
+#else
+    static unsigned counter = 0;
+#ifdef _WIN32
+    snprintf(name, size, "%s.%d.%u.tmp", to, _getpid(), counter++);
+#else
+    snprintf(name, size, "%s.%u.tmp", to, counter++);
+#endif
+    FILE* f = fopen(name, "wb");
+#endif
+    if (f == NULL) {
+        free(name);
+        *temporary = NULL;
+    }
+    return f;
+}
+
+// Copies a file by way of a temporary beside `to`, so that `to` is never left half-written.
+// Returns -1 on failure.
+int copy_file(const char* from, const char* to) {
+    char* temporary = NULL;
+    FILE* in = fopen(from, "rb");
+    FILE* out = in != NULL ? open_temporary(to, &temporary) : NULL;
+    int status = in != NULL && out != NULL ? 0 : -1;
+    char buffer[1 << 16];
+    size_t bytes;
+    while (status == 0 && (bytes = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, bytes, out) != bytes) status = -1;
+    }
+    if (in != NULL && ferror(in)) status = -1;
+    if (in != NULL) fclose(in);
+    if (out != NULL && fclose(out) != 0) status = -1;
+    if (status == 0) {
+#ifdef _WIN32
+        remove(to); // rename() only replaces an existing file on POSIX.
+#endif
+        status = rename(temporary, to) == 0 ? 0 : -1;
+    }
+    if (status != 0 && out != NULL) remove(temporary);
+    free(temporary);
+    return status;
+}
+
+// The malloc()ed path of build `key`'s output with `extension` in the cache, "DIR/<key>.ext", or
+// NULL when out of memory. It is sized from cache_dir, so every entry keeps all 16 digits of its key.
+char* cache_path(uint64_t key, const char* extension) {
+    size_t size = strlen(cache_dir) + strlen(extension) + 20;
+    char* path = malloc(size);
+    if (path != NULL) snprintf(path, size, "%s/%016llx%s", cache_dir, (unsigned long long)key, extension);
+    return path;
+}
+
+// Copies the stored outputs of build `key` out of the cache. Returns -1 when they are not all there.
+int restore_cached(uint64_t key, const char* binary_filename, const char* symbol_filename) {
+    char* binary_path = cache_path(key, ".out");
+    char* symbol_path = cache_path(key, ".sym");
+    int status = binary_path != NULL && symbol_path != NULL ? 0 : -1;
+    FILE* f;
+    if (status == 0 && (f = fopen(binary_path, "rb")) != NULL) fclose(f);
+    else status = -1;
+    if (status == 0 && symbol_filename != NULL) {
+        if ((f = fopen(symbol_path, "rb")) != NULL) fclose(f);
+        else status = -1; // Stored by a build without a symbol file.
+    }
+
+    if (status == 0 && (copy_file(binary_path, binary_filename) != 0 || (symbol_filename != NULL && copy_file(symbol_path, symbol_filename) != 0))) {
+        fprintf(stderr, "[Cache Error] Could not copy the stored output of '%s'; assembling instead.\n", binary_path);
+        status = -1;
+    }
+    free(binary_path);
+    free(symbol_path);
+    return status;
+}
+
+// Stores the outputs of a successful build under `key`. A failure only costs the next build its hit.
+void store_cached(uint64_t key, const char* binary_filename, const char* symbol_filename) {
+    char* binary_path = cache_path(key, ".out");
+    char* symbol_path = cache_path(key, ".sym");
+#if defined(__unix__) || defined(__APPLE__)
+    mkdir(cache_dir, 0777); // Fails harmlessly when it exists.
+#endif
+    if (binary_path == NULL || symbol_path == NULL || (symbol_filename != NULL && copy_file(symbol_filename, symbol_path) != 0) || copy_file(binary_filename, binary_path) != 0) {
+        fprintf(stderr, "[Cache Error] Could not store the output in '%s'.\n", cache_dir);
+    }
+    free(binary_path);
+    free(symbol_path);
+}
+
+// --- Library API ---
+// Assembles source text held in memory, in two passes and without a listing, into a malloc()ed
+// array of instruction words at *machine_code. Returns the instruction count, or -1 with the first
+// error in `error`. The assembler keeps its state in globals, reset after each call, so calls
+// must not overlap.
+int cpusim_assemble(const char* source, size_t length, uint16_t** machine_code, char* error, size_t error_size) {
+    char message[MAX_ERROR_LENGTH] = "";
+    uint16_t* code = NULL;
+    int instruction_count = -1;
+    *machine_code = NULL;
+
+    source_text = malloc(length + 1);
+    if (source_text != NULL) {
+        memcpy(source_text, source, length);
+        source_text[length] = '\0';
+    }
+    if (source_text == NULL || split_source(length) < 0 || build_symbol_table() < 0) {
+        set_error(message, "[Fatal Error] Out of memory.");
+    } else {
+        build_mnemonic_table();
+        code = malloc((program_line_count > 0 ? program_line_count : 1) * sizeof(uint16_t));
+        int listing = print_listing;
+        print_listing = 0;
+        if (code == NULL) set_error(message, "[Fatal Error] Out of memory for the machine code.");
+        else instruction_count = assemble(code, message);
+        print_listing = listing;
+    }
+
+    if (instruction_count < 0) {
+        free(code);
+        if (error != NULL && error_size > 0) snprintf(error, error_size, "%.*s", (int)strcspn(message, "\n"), message);
+    } else {
+        *machine_code = code;
+    }
+    reset_assembler();
+    return instruction_count;
+}
+
+// Frees the source, its lines and the symbol table, for the next cpusim_assemble() call.
+void reset_assembler() {
+    free(source_text);
+    free(program_memory);
+    free(symbol_table);
+    free(label_slots);
+    source_text = NULL;
+    program_memory = NULL;
+    symbol_table = NULL;
+    label_slots = NULL;
+    label_slot_count = 0;
+    program_line_count = 0;
+    label_count = 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Builds libcpusim.so and libcpusim.a as cpusim.h describes and checks that each one exports
+# exactly the functions cpusim.h declares, so no internal name of the tools leaks into a host.
+#
+# usage: bench/check_exports.sh
+#   CC, CFLAGS         Compiler and flags for the build (default cc, -O2).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=$ROOT/bench/out
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-O2"}
+
+mkdir -p "$OUT"
+$CC $CFLAGS -DCPUSIM_LIBRARY -fvisibility=hidden -shared -fPIC "$ROOT/simulator.c" "$ROOT/assembler.c" -o "$OUT/libcpusim.so" -lm
+$CC $CFLAGS -DCPUSIM_LIBRARY -fvisibility=hidden -c "$ROOT/simulator.c" -o "$OUT/simulator.o"
+$CC $CFLAGS -DCPUSIM_LIBRARY -fvisibility=hidden -c "$ROOT/assembler.c" -o "$OUT/assembler.o"
+ld -r "$OUT/simulator.o" "$OUT/assembler.o" -o "$OUT/cpusim.o"
+objcopy --localize-hidden "$OUT/cpusim.o"
+rm -f "$OUT/libcpusim.a"
+ar rcs "$OUT/libcpusim.a" "$OUT/cpusim.o"
+
+sed -n 's/^CPUSIM_API .*\(cpusim_[a-z_]*\)(.*/\1/p' "$ROOT/cpusim.h" | sort > "$OUT/api.txt"
+nm -D --defined-only "$OUT/libcpusim.so" | awk '$2 ~ /^[A-Z]$/ { print $3 }' | sort > "$OUT/exports.txt"
+nm -g --defined-only "$OUT/libcpusim.a" | awk 'NF == 3 { print $3 }' | sort > "$OUT/archive.txt"
+
+status=0
+for exports in "$OUT/exports.txt" "$OUT/archive.txt"; do
+    if ! diff -u "$OUT/api.txt" "$exports"; then
+        echo "[Export Error] $(basename "$exports" .txt) symbols differ from the cpusim.h API." >&2
+        status=1
+    fi
+done
+[ $status -eq 0 ] && echo "libcpusim exports the $(wc -l < "$OUT/api.txt") cpusim.h functions and nothing else."
+exit $status
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Writes a large, valid assembly source for timing the assembler.
+# usage: gen_stress.sh [LINES] > stress.txt
+LINES=${1:-100000}
+
+awk -v lines="$LINES" 'BEGIN {
+    srand(1); # Fixed seed, so every run times the same source.
+    split("EAX EBX ECX EDX ESI EDI", reg, " ");
+    split("JMP JE JNE JG JL JGE JLE", jump, " ");
+    print "; Generated assembler stress input (" lines " lines)."
+    labels = 0;
+    for (i = 0; i < lines; i++) {
+        r1 = reg[int(rand() * 6) + 1]; r2 = reg[int(rand() * 6) + 1]; imm = int(rand() * 256);
+        if (i % 64 == 0) { printf "block%d:\n", labels++; continue; }
+        k = int(rand() * 12);
+        if (k == 0) printf "    MOV %s, #%d\n", r1, imm;
+        else if (k == 1) printf "    MOV %s, %s\n", r1, r2;
+        else if (k == 2) printf "    ADD %s, %s      ; register add\n", r1, r2;
+        else if (k == 3) printf "    SUB %s, #%d\n", r1, imm;
+        else if (k == 4) printf "    MOV %s, [EBP+%d]\n", r1, imm % 32;
+        else if (k == 5) printf "    MOV [%d], %s\n", imm, r1;
+        else if (k == 6) printf "    CMP %s, #%d\n", r1, imm;
+        else if (k == 7) printf "    %s block%d\n", jump[int(rand() * 7) + 1], int(rand() * (labels < 4 ? labels : 4)); # Jump targets must be below 256.
+        else if (k == 8) printf "    PUSH %s\n", r1;
+        else if (k == 9) printf "    POP %s\n", r1;
+        else if (k == 10) printf "    XOR %s, %s\n", r1, r2;
+        else printf "    INC %s\n", r1;
+    }
+    print "    HLT";
+}'
@@ -0,0 +1,115 @@
+#!/bin/sh
+# Benchmark harness: builds the simulator and assembler, runs every kernel in bench/ on each
+# engine and reports ns/instruction and MIPS, then times the assembler on a generated source.
+# Every figure is the median of RUNS runs, with the 10th and 90th percentiles.
+#
+# usage: bench/run.sh
+#   RUNS=N             Repeats per measurement (default 7).
+#   ENGINES="..."      Simulator engines to measure (default "call threaded jit").
+#   STRESS_LINES=N     Size of the generated assembler input (default 100000).
+#   CC, CFLAGS         Compiler and flags for the build (default cc, -O2).
+#   BENCH_SAVE=FILE    Write the medians to FILE for later comparison.
+#   BENCH_COMPARE=FILE Compare the medians with FILE and exit 1 on any regression larger than
+#                      BENCH_TOLERANCE percent (default 10).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=$ROOT/bench/out
+RUNS=${RUNS:-7}
+ENGINES=${ENGINES:-"call threaded jit"}
+STRESS_LINES=${STRESS_LINES:-100000}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-O2"}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-10}
+
+mkdir -p "$OUT"
+$CC $CFLAGS "$ROOT/simulator.c" -o "$OUT/simulator"
+$CC $CFLAGS "$ROOT/assembler.c" -o "$OUT/assembler"
+: > "$OUT/results.txt"
+
+now_ns() { date +%s%N; }
+
+# Prints "median p10 p90" of the numbers on stdin.
+summarize() {
+    sort -g | awk '{ v[NR] = $1 } END {
+        p10 = int(NR * 0.1 + 0.999); if (p10 < 1) p10 = 1;
+        p90 = int(NR * 0.9 + 0.999);
+        printf "%s %s %s\n", v[int((NR + 1) / 2)], v[p10], v[p90];
+    }'
+}
+
+# Records one result line; the key and median feed BENCH_SAVE/BENCH_COMPARE.
+record() { echo "$1 $2" >> "$OUT/results.txt"; }
+
+printf "%-16s %-9s %12s %10s %10s %10s %9s\n" kernel engine instructions "ns/insn" p10 p90 MIPS
+for source in "$ROOT"/bench/*.txt; do
+    kernel=$(basename "$source" .txt)
+    "$OUT/assembler" "$source" "$OUT/$kernel.bin" > /dev/null
+    retired=$("$OUT/simulator" --headless --stats=json "$OUT/$kernel.bin" < /dev/null 2>&1 > /dev/null |
+        sed -n 's/.*"retired": \([0-9]*\).*/\1/p')
+    expected=$("$OUT/simulator" --headless "$OUT/$kernel.bin" < /dev/null)
+
+    for engine in $ENGINES; do
+        : > "$OUT/times"
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            output=$("$OUT/simulator" --engine="$engine" --headless --time "$OUT/$kernel.bin" < /dev/null 2> "$OUT/stderr")
+            if [ "$output" != "$expected" ]; then
+                echo "[Bench Error] $kernel produced different output on the $engine engine." >&2
+                exit 1
+            fi
+            sed -n 's/^Run time: \([0-9.]*\) s$/\1/p' "$OUT/stderr" | awk -v n="$retired" '{ printf "%.3f\n", $1 * 1e9 / n }' >> "$OUT/times"
+            i=$((i + 1))
+        done
+        set -- $(summarize < "$OUT/times")
+        printf "%-16s %-9s %12s %10s %10s %10s %9.1f\n" "$kernel" "$engine" "$retired" "$1" "$2" "$3" "$(awk -v ns="$1" 'BEGIN { print 1000 / ns }')"
+        record "$kernel/$engine" "$1"
+    done
+done
+
+# The assembler is timed end to end; lines/sec counts the instructions it actually assembled.
+# Two-pass mode is timed with its listing, and again without it, when pass 2 runs on every core.
+sh "$ROOT/bench/gen_stress.sh" "$STRESS_LINES" > "$OUT/stress.txt"
+echo
+printf "%-16s %12s %12s %12s %12s\n" assembler lines "lines/sec" p10 p90
+for mode in two-pass parallel stream; do
+    : > "$OUT/times"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now_ns)
+        if [ $mode = stream ]; then
+            "$OUT/assembler" --stream "$OUT/stress.txt" "$OUT/stress.bin" > "$OUT/assembler.log"
+            words=$(sed -n "s/^Assembly complete. \([0-9]*\) instructions.*/\1/p" "$OUT/assembler.log")
+        else
+            [ $mode = parallel ] && options=--no-listing || options=
+            "$OUT/assembler" $options "$OUT/stress.txt" "$OUT/stress.bin" > "$OUT/assembler.log"
+            words=$(sed -n "s/^Writing \([0-9]*\) words.*/\1/p" "$OUT/assembler.log")
+        fi
+        end=$(now_ns)
+        awk -v ns=$((end - start)) -v n="$words" 'BEGIN { printf "%.0f\n", n / (ns / 1e9) }' >> "$OUT/times"
+        i=$((i + 1))
+    done
+    set -- $(summarize < "$OUT/times")
+    printf "%-16s %12s %12s %12s %12s\n" $mode "$words" "$1" "$2" "$3"
+    # Higher is better here, so store the inverse to compare like the ns/insn figures.
+    case $mode in
+        two-pass) name=assembler/stress ;;
+        *) name=assembler/$mode ;;
+    esac
+    record "$name" "$(awk -v r="$1" 'BEGIN { printf "%.3f\n", 1e9 / r }')"
+done
+
+if [ -n "$BENCH_SAVE" ]; then
+    cp "$OUT/results.txt" "$BENCH_SAVE"
+fi
+if [ -n "$BENCH_COMPARE" ]; then
+    echo
+    awk -v tolerance="$BENCH_TOLERANCE" '
+        NR == FNR { base[$1] = $2; next }
+        ($1 in base) {
+            change = ($2 / base[$1] - 1) * 100;
+            printf "%-24s %+7.1f%%%s\n", $1, change, (change > tolerance ? "  REGRESSION" : "");
+            if (change > tolerance) failed = 1;
+        }
+        END { exit failed }' "$BENCH_COMPARE" "$OUT/results.txt"
+fi
@@ -0,0 +1,104 @@
+#ifndef CPUSIM_H
+#define CPUSIM_H
+
+// The simulator and the assembler as a library, for hosts that run programs in-process instead of
+// through files. It is built from the same two sources as the tools, with their main()s left out:
+//
+//   cc -O2 -DCPUSIM_LIBRARY -fvisibility=hidden -c simulator.c assembler.c
+//   ld -r simulator.o assembler.o -o cpusim.o && objcopy --localize-hidden cpusim.o
+//   ar rcs libcpusim.a cpusim.o
+//   cc -O2 -DCPUSIM_LIBRARY -fvisibility=hidden -shared -fPIC simulator.c assembler.c -o libcpusim.so
+//
+// With -fvisibility=hidden only the CPUSIM_API functions below are exported, and the tools'
+// internal names (assemble, memory_words, run_program, ...) cannot collide with the host's; the
+// ld -r and objcopy steps do the same for the static archive.
+//
+// Each CpuSim is independent, so threads can run one each. cpusim_assemble() is not reentrant.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CPUSIM_API __attribute__((visibility("default")))
+#else
+#define CPUSIM_API
+#endif
+
+typedef struct CpuSim CpuSim;
+
+typedef enum {
+    CPUSIM_RUNNING,                 // Stopped by the budget or after a step; run or step again to carry on.
+    CPUSIM_HALTED,                  // Executed HLT, jumped out of the program, or has no program loaded.
+    CPUSIM_FAULTED                  // Stopped on a runtime error (division by zero).
+} CpuSimStatus;
+
+typedef enum {
+    CPUSIM_ENGINE_CALL,             // Same order as the simulator's --engine choices.
+    CPUSIM_ENGINE_THREADED,
+    CPUSIM_ENGINE_JIT
+} CpuSimEngine;
+
+typedef enum {
+    CPUSIM_DUMP_TEXT,               // Same order as the simulator's --dump-format choices.
+    CPUSIM_DUMP_JSON,
+    CPUSIM_DUMP_BINARY
+} CpuSimDumpFormat;
+
+#define CPUSIM_FLAG_ZF 0x1          // cpusim_get_flags(): the last comparison was equal.
+#define CPUSIM_FLAG_SF 0x2          // cpusim_get_flags(): the last comparison was negative.
+
+// INP asks `input` for a value: it stores one in *value and returns 0, or returns nonzero when
+// there is none, and INP reports an error and reads 0. OUT hands each value to `output`.
+typedef int  (*CpuSimInput)(void* user, int* value);
+typedef void (*CpuSimOutput)(void* user, int value);
+
+// A simulator with `memory_words` words of memory, or 0 for the default 256, which a program
+// image may override. Returns NULL for an out-of-range size or when out of memory.
+CPUSIM_API CpuSim* cpusim_create(int memory_words);
+CPUSIM_API void    cpusim_destroy(CpuSim* sim);
+
+// Loads bare machine code words or a program image from memory (the buffer is copied) and resets
+// the CPU. Returns the instruction count, or -1 after reporting why on the error stream.
+CPUSIM_API int     cpusim_load(CpuSim* sim, const void* program, size_t size);
+
+// Puts the CPU back in its power-on state, at the program's entry point.
+CPUSIM_API void    cpusim_reset(CpuSim* sim);
+
+// Runs for about `budget` instructions (0 for no limit); the budget is only checked on backward
+// branches. cpusim_step() runs exactly one instruction.
+CPUSIM_API CpuSimStatus cpusim_run(CpuSim* sim, long long budget);
+CPUSIM_API CpuSimStatus cpusim_step(CpuSim* sim);
+CPUSIM_API CpuSimStatus cpusim_status(const CpuSim* sim);
+
+// Registers are numbered EAX, EBX, ECX, EDX, ESI, EDI, EBP, ESP from 0. cpusim_set_pc() returns
+// -1, changing nothing, for a PC outside the program.
+CPUSIM_API int     cpusim_get_register(const CpuSim* sim, int reg);
+CPUSIM_API void    cpusim_set_register(CpuSim* sim, int reg, int value);
+CPUSIM_API int     cpusim_get_pc(const CpuSim* sim);
+CPUSIM_API int     cpusim_set_pc(CpuSim* sim, int pc);
+CPUSIM_API int     cpusim_get_flags(const CpuSim* sim);
+
+// Memory accessors return -1 for an address outside memory.
+CPUSIM_API int     cpusim_memory_size(const CpuSim* sim);
+CPUSIM_API int     cpusim_read_memory(const CpuSim* sim, int address, int* value);
+CPUSIM_API int     cpusim_write_memory(CpuSim* sim, int address, int value);
+
+// Writes the registers, flags and memory to `file` as the simulator's --dump does: all of memory
+// as text, or as JSON or a binary DumpHeader (see isa.h) only the words that changed since the
+// previous dump or reset. Returns 0, or -1 with nothing loaded, when out of memory or when
+// writing to `file` fails.
+CPUSIM_API int     cpusim_dump(CpuSim* sim, FILE* file, CpuSimDumpFormat format);
+
+// Without callbacks, INP reports an error and reads 0, and OUT values are printed to stdout one
+// per line. Errors go to stderr unless another stream is set (NULL restores stderr).
+CPUSIM_API void    cpusim_set_io(CpuSim* sim, CpuSimInput input, CpuSimOutput output, void* user);
+CPUSIM_API void    cpusim_set_error_stream(CpuSim* sim, FILE* err);
+CPUSIM_API void    cpusim_set_engine(CpuSim* sim, CpuSimEngine engine); // CPUSIM_ENGINE_THREADED by default.
+
+// Assembles `length` bytes of source text into a malloc()ed array of instruction words at
+// *machine_code, for the caller to free(). Returns the instruction count, or -1 with the first
+// error in `error`.
+CPUSIM_API int     cpusim_assemble(const char* source, size_t length, uint16_t** machine_code, char* error, size_t error_size);
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef CPUSIM_ISA_H
+#define CPUSIM_ISA_H
+
+// Definitions shared by the assembler, the simulator and the trace decoder: the instruction set
+// tables the assembler encodes with and the decoder disassembles with, the program image format,
+// the trace file format, the state dump format and the --serve protocol.
+
+#include <stdint.h>
+
+// --- Instruction Set ---
+// An instruction word is opcode(5) | reg1(3) | reg2(3) | ... , with an 8-bit immediate or address
+// in the low byte, or a 5-bit offset in the low bits for the [base+off] forms.
+#define OPCODE_COUNT 32
+
+// An operand too wide for its field (larger immediates and addresses, negative offsets) takes the
+// wide form, written by the assembler's --wide: WIDE_PREFIX, the instruction word with 0 in that
+// field, then the operand as a 32-bit two's complement value in two words, low half first. A wide
+// instruction still occupies one address, so labels and jumps count instructions, not words.
+#define WIDE_PREFIX 0x0400          // An HLT word with a bit set that HLT itself never has.
+#define WIDE_WORDS 4                // Words in a wide instruction, WIDE_PREFIX included.
+
+// The block instructions have no opcode of their own: they are HLT words with a nonzero block
+// field, opcode(5)=0 | reg1(3) | reg2(3) | block(2) | count(3), where HLT itself has 0. reg1 names
+// the destination (or first) block, reg2 the source block, fill value or second block, and the
+// `count` register its length in words. They never take the wide form.
+#define BLOCK_OP_COUNT 3
+#define BLOCK_OP(word) (((word) >> 3) & 0x3) // 0 for HLT, else 1 + the index into block_forms.
+
+typedef enum {
+    FORM_NONE,          // HLT
+    FORM_REG,           // INC reg
+    FORM_ADDR,          // JMP addr
+    FORM_REG_REG,       // ADD reg, reg
+    FORM_REG_IMM,       // ADD reg, #imm
+    FORM_REG_ADDR,      // MOV reg, [addr]
+    FORM_ADDR_REG,      // MOV [addr], reg
+    FORM_REG_BASE_OFF,  // MOV reg, [base+off]
+    FORM_BASE_OFF_REG,  // MOV [base+off], reg
+    FORM_REG_REG_REG    // MEMCPY reg, reg, reg
+} OperandForm;
+
+typedef struct {
+    const char* mnemonic;
+    OperandForm form;
+} InstructionForm;
+
+// Indexed by opcode.
+static const InstructionForm instruction_forms[OPCODE_COUNT] = {
+    { "HLT", FORM_NONE },       { "MUL", FORM_REG_REG },    { "DIV", FORM_REG_REG },    { "XOR", FORM_REG_REG },
+    { "INP", FORM_REG },        { "OUT", FORM_REG },        { "MOV", FORM_REG_IMM },    { "MOV", FORM_REG_ADDR },
+    { "MOV", FORM_ADDR_REG },   { "INC", FORM_REG },        { "DEC", FORM_REG },        { "PUSH", FORM_REG },
+    { "POP", FORM_REG },        { "CALL", FORM_ADDR },      { "RET", FORM_NONE },       { "MOV", FORM_REG_BASE_OFF },
+    { "ADD", FORM_REG_REG },    { "SUB", FORM_REG_REG },    { "MOV", FORM_REG_REG },    { "ADD", FORM_REG_IMM },
+    { "SUB", FORM_REG_IMM },    { "CMP", FORM_REG_IMM },    { "NOT", FORM_REG },        { "CMP", FORM_REG_REG },
+    { "JMP", FORM_ADDR },       { "JE", FORM_ADDR },        { "JNE", FORM_ADDR },       { "JG", FORM_ADDR },
+    { "JL", FORM_ADDR },        { "JGE", FORM_ADDR },       { "JLE", FORM_ADDR },       { "MOV", FORM_BASE_OFF_REG },
+};
+
+// Indexed by BLOCK_OP() - 1.
+static const InstructionForm block_forms[BLOCK_OP_COUNT] = {
+    { "MEMCPY", FORM_REG_REG_REG }, { "MEMSET", FORM_REG_REG_REG }, { "MEMCMP", FORM_REG_REG_REG },
+};
+
+// Alternative spellings of the conditional jumps.
+static const struct { const char* alias; const char* mnemonic; } mnemonic_aliases[] = {
+    { "JZ", "JE" }, { "JNZ", "JNE" }, { "JNLE", "JG" }, { "JNGE", "JL" }, { "JNL", "JGE" }, { "JNG", "JLE" },
+};
+
+// Indexed by register code.
+static const char* const register_names[] = { "EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP" };
+
+// --- Program Images ---
+// Written by the assembler's --image option and the simulator's --save-image, and mapped by the
+// simulator in place of a bare binary. An ImageHeader is followed by sections, each starting on an
+// IMAGE_ALIGNMENT boundary, and by the table of ImageSections at header.section_table. Only the
+// code section is required. Everything is in the byte order of the host that wrote it.
+#define IMAGE_MAGIC "CPUIMAGE"
+#define IMAGE_VERSION 1
+#define IMAGE_BYTE_ORDER 0x01020304
+#define IMAGE_ALIGNMENT 64
+#define IMAGE_SYMBOL_LENGTH 60      // Bytes of ImageSymbol.name, including the terminator.
+
+typedef enum {
+    IMAGE_CODE = 1,                 // code_length uint16_t words of machine code, as in a bare binary.
+    IMAGE_DATA = 2,                 // data_length int32_t words, copied to memory at data_address before each run.
+    IMAGE_SYMBOLS = 3,              // ImageSymbols in address order.
+    IMAGE_BLOCKS = 4,               // uint32_t PCs that start a basic block, ascending.
+    IMAGE_DECODED = 5               // An ImageDecodedHeader and the simulator's decoded instructions.
+} ImageSectionType;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;            // IMAGE_BYTE_ORDER as written.
+    uint32_t entry_pc;              // Where execution starts.
+    uint32_t code_length;           // Words in the code section.
+    uint32_t data_address;          // First memory word of the data segment.
+    uint32_t data_length;           // Words in the data section; 0 without one.
+    uint32_t memory_size;           // Words of main memory to run with; 0 for the simulator's default.
+    uint32_t section_count;
+    uint64_t section_table;         // File offset of the ImageSection table.
+} ImageHeader;
+
+typedef struct {
+    uint32_t type;                  // An ImageSectionType; readers skip types they do not know.
+    uint32_t reserved;
+    uint64_t offset;                // File offset, a multiple of IMAGE_ALIGNMENT.
+    uint64_t size;                  // In bytes.
+} ImageSection;
+
+typedef struct {
+    uint32_t address;
+    char name[IMAGE_SYMBOL_LENGTH];
+} ImageSymbol;
+
+// Heads the decoded section. The records that follow are only meaningful to the simulator build
+// that wrote them; any other build, memory size or set of options decodes the code section again.
+typedef struct {
+    uint32_t decoder;               // Fingerprint of the decoder that wrote the records.
+    uint32_t record_size;
+    uint32_t memory_size;           // Memory size the absolute accesses were verified against.
+    uint32_t options;               // Decoder options the records were built with.
+} ImageDecodedHeader;
+
+// --- Serve Protocol ---
+// Spoken by simulator --serve over stdin/stdout or a Unix socket. Each request is a ServeRequest,
+// its input_count int32_t INP values and then the program, to the end of the request: bare machine
+// code words or an image (SERVE_BINARY), or assembly source (SERVE_SOURCE). Every request gets one
+// ServeResponse, followed by output_count int32_t OUT values and message_length bytes of error
+// text. Responses carry the request's ID and may arrive in any order. All fields are in the byte
+// order of the host, and `length` counts the bytes after itself.
+#define SERVE_MAX_REQUEST (1u << 30) // Longest request the server accepts, in bytes.
+
+typedef enum {
+    SERVE_BINARY = 1,
+    SERVE_SOURCE = 2
+} ServeProgramKind;
+
+typedef enum {
+    SERVE_HALTED = 0,               // Ran to HLT or off the end of the program.
+    SERVE_ERROR = 1,                // Could not be assembled or loaded; see the message.
+    SERVE_FAULTED = 2,              // Stopped on a runtime error (division by zero).
+    SERVE_BUDGET = 3,               // Stopped by the budget, as --budget exits with 3.
+    SERVE_DEADLINE = 4              // Stopped by the server's --deadline.
+} ServeStatus;
+
+typedef struct {
+    uint32_t length;
+    uint32_t request_id;            // Chosen by the client, echoed in the response.
+    uint32_t kind;                  // A ServeProgramKind.
+    uint32_t input_count;
+    uint64_t budget;                // Instruction budget; 0 for the server's --budget.
+} ServeRequest;
+
+typedef struct {
+    uint32_t length;
+    uint32_t request_id;
+    uint32_t status;                // A ServeStatus.
+    uint32_t output_count;
+    uint32_t message_length;
+    uint32_t cached;                // 1 when the decoded program came from the server's cache.
+} ServeResponse;
+
+// --- Trace Files ---
+// Written by the simulator's --trace option, read by tracedump. A TraceFileHeader is followed by
+// fixed-size TraceRecords, all in the byte order of the host that wrote them.
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304
+#define TRACE_NO_REGISTER 0xFF      // TraceRecord.reg when no register changed.
+#define TRACE_MEMORY_READ  0x01     // TraceRecord.flags: address/value describe a load.
+#define TRACE_MEMORY_WRITE 0x02     // TraceRecord.flags: address/value describe a store.
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;           // sizeof(TraceRecord), so a mismatched decoder notices.
+    uint32_t byte_order;            // TRACE_BYTE_ORDER as written.
+    uint32_t reserved;
+    uint64_t first_record;          // Index of the first record; nonzero when a ring dropped older ones.
+} TraceFileHeader;
+
+typedef struct {
+    uint32_t pc;
+    uint16_t word;                  // The instruction word at pc.
+    uint8_t reg;                    // Register the instruction changed, or TRACE_NO_REGISTER.
+    uint8_t flags;                  // TRACE_MEMORY_READ or TRACE_MEMORY_WRITE, if it accessed memory.
+    int32_t reg_value;              // New value of reg.
+    int32_t address;                // Memory word accessed.
+    int32_t value;                  // Value loaded from or stored to address.
+} TraceRecord;
+
+// --- State Dumps ---
+// Written by the simulator's --dump-format=binary: a DumpHeader and change_count DumpChanges in
+// address order, one for each memory word that differs from the previous dump of the same run, or
+// from zero for the first. A batch run writes one dump per program, in input order. Everything is
+// in the byte order of the host that wrote it.
+#define DUMP_MAGIC "CPUDUMP"
+#define DUMP_VERSION 1
+#define DUMP_BYTE_ORDER 0x01020304
+#define DUMP_FLAG_ZF 0x1            // DumpHeader.flags: the last comparison was equal.
+#define DUMP_FLAG_SF 0x2            // DumpHeader.flags: the last comparison was negative.
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;            // DUMP_BYTE_ORDER as written.
+    int32_t regs[8];                // In register_names[] order.
+    uint32_t flags;
+    uint32_t memory_size;           // Words of main memory.
+    uint32_t change_count;
+    uint32_t reserved;
+} DumpHeader;
+
+typedef struct {
+    uint32_t address;
+    int32_t value;
+} DumpChange;
+
+#endif
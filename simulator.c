@@ -4,256 +4,4743 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // For uint16_t
+#include <stddef.h> // For offsetof
+#include <errno.h>
+#include <time.h>   // For timespec_get
+#include "isa.h"    // Register names, the program image and the trace file format
+#include "cpusim.h" // The library API
+
+// Batch mode runs programs on C11 threads when the C library provides them.
+#if !defined(__STDC_NO_THREADS__)
+#define HAVE_THREADS 1
+#include <threads.h>
+#endif
+
+// POSIX hosts capture batch output in memory, can report their core count, back guest memory
+// with demand-zero pages and serve on Unix sockets.
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX 1
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#elif defined(_WIN32)
+#include <process.h>
+#endif
+
+// The JIT engine translates to x86-64 and needs POSIX executable memory.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define HAVE_JIT 1
+#endif
 
 // --- Configuration Constants ---
-#define MEMORY_SIZE 256             // The total size of the main memory.
-#define PROGRAM_SIZE 256            // Maximum number of instructions in a program.
+#define MEMORY_SIZE 256             // Default size of the main memory, in words (see --memory).
+#define MAX_MEMORY_SIZE (1 << 30)   // Largest main memory --memory accepts, in words.
+#define PROGRAM_CHUNK 256           // Instructions read from a binary file at a time.
 #define MAX_FILENAME_LENGTH 256     // Maximum length for file paths.
 #define NUM_REGISTERS 8             // The number of general-purpose registers.
-#define STACK_TOP (MEMORY_SIZE - 1) // The stack grows downwards from the top of memory.
+#define MEMSET_RESET_LIMIT 65536    // Memories up to this many bytes are cleared with memset, not remapped.
+#define DIRTY_PAGE_SHIFT 10         // Memory is tracked for resets and dumps in pages of 1 << this many words.
+#define DIRTY_RESET_LIMIT (4 << 20) // Resets clear up to this many bytes of dirty pages, and remap beyond.
+#define DEFAULT_BATCH_THREADS 4     // Worker count for --batch when the core count is unknown.
+#define VECTOR_LANES 64             // Program instances run in lockstep by --vector.
+#define IO_BUFFER_SIZE 65536        // Bytes of headless OUT data collected before each write.
+#define WATCHDOG_SLICE (1 << 20)    // Instructions of fuel handed out between budget and clock checks.
+#define EXIT_BUDGET 3               // Exit status of a run stopped by --budget.
+#define EXIT_DEADLINE 4             // Exit status of a run stopped by --deadline.
+#define SERVE_CACHE_ENTRIES 1024    // Programs --serve keeps decoded, unless --serve-cache says otherwise.
+#define SERVE_QUEUE_LENGTH 1024     // Requests --serve reads ahead of its workers.
+#define MEMO_ENTRIES 4096           // Results --memoize keeps per context; a power of two.
+#define MEMO_MAX_ROUTINE 4096       // Longest routine, in instructions, the purity analysis follows.
+#define MEMO_MAX_FRAME 4096         // Most stack words a memoized call may leave behind.
+#define MEMO_MAX_NESTING 256        // Misses run one inside the other before calls run unmemoized.
+#define RUN_PIPELINE_DEPTH 4        // Sources `run` assembles ahead of the program running.
 
 // --- Core Data Structures ---
-// Holds the state of the CPU's general-purpose registers.
-typedef struct {
-    int EAX, EBX, ECX, EDX;
-    int ESI, EDI;
-    int EBP, ESP;
+// Holds the state of the CPU's general-purpose registers. Instructions index regs[] directly by
+// register code; the named fields alias the same storage, in register_names[] order.
+typedef union {
+    int regs[NUM_REGISTERS];
+    struct {
+        int EAX, EBX, ECX, EDX;
+        int ESI, EDI;
+        int EBP, ESP;
+    };
 } Registers;
 
-// Holds the state of the CPU's flags.
+// Holds the state of the CPU's flags, lazily: CMP only records its result, and ZF/SF are derived
+// from it when a conditional jump or dump_contents() asks.
 typedef struct {
-    int ZF; // Zero Flag
-    int SF; // Sign Flag
+    int result; // Result of the last comparison (1 before any, so both flags start clear).
 } Flags;
 
+#define FLAG_ZF(flags) ((flags).result == 0) // Zero Flag
+#define FLAG_SF(flags) ((flags).result < 0)  // Sign Flag
+
+// A machine code word decoded once at load time, so the hot loop never re-extracts bit fields.
+typedef struct {
+    uint8_t handler; // Index into handler_table.
+    uint8_t opcode;  // The raw 5-bit opcode, or OP_MEMCPY and up for a block instruction.
+    uint8_t reg1;    // First register operand (destination, or source for stores).
+    uint8_t reg2;    // Second register operand, or the base register for [reg+off].
+    int operand;     // Immediate value, absolute address or base+offset displacement; a block instruction's count register.
+} DecodedInstruction;
+
+// Decoded opcodes of the block instructions (see BLOCK_OP), after the 5-bit ones.
+#define OP_MEMCPY OPCODE_COUNT
+#define OP_MEMSET (OPCODE_COUNT + 1)
+#define OP_MEMCMP (OPCODE_COUNT + 2)
+#define DECODED_OPCODE_COUNT (OPCODE_COUNT + BLOCK_OP_COUNT)
+
+// The operand of a wide instruction (see WIDE_PREFIX), which no longer sits in its word.
+typedef struct {
+    int pc;
+    int32_t operand;
+} WideOperand;
+
+// The headless INP/OUT channel: INP takes values from a pre-loaded array and OUT appends raw
+// values to a buffer written out in large chunks, with no prompts in between. Library callers can
+// hand both to callbacks instead.
+typedef struct {
+    int headless;                  // INP/OUT use this channel instead of prompting on in/out.
+    int binary;                    // OUT values are 32-bit little-endian words instead of text lines.
+    CpuSimInput input_fn;          // Supplies INP values, if set; takes precedence over input.
+    CpuSimOutput output_fn;        // Receives OUT values, if set; nothing is buffered then.
+    void* user;                    // Passed to input_fn and output_fn.
+    const int* input;              // Pre-loaded INP values (owned by the caller).
+    int input_count;
+    int input_pos;                 // The next value INP returns.
+    FILE* sink;                    // Where OUT values are written (NULL: the context's out stream).
+    size_t length;                 // Bytes pending in buffer.
+    char buffer[IO_BUFFER_SIZE];
+} IoChannel;
+
+// Execution statistics gathered by the counting engine when --stats is on.
+typedef struct {
+    uint64_t retired;              // Instructions executed.
+    uint64_t opcode_count[DECODED_OPCODE_COUNT]; // Executions per opcode.
+    uint64_t taken[DECODED_OPCODE_COUNT];        // Executions per jump opcode that went to the target.
+    uint64_t block_words[BLOCK_OP_COUNT];        // Words covered per block instruction, from OP_MEMCPY.
+    int lowest_esp;                // Lowest stack pointer seen; the stack's high-water mark.
+    double seconds;                // Wall-clock time spent running.
+} PerfCounters;
+
+// Run limits from --budget and --deadline. Only backward branches can repeat code, so they charge
+// fuel by how far they jump back; when it runs out, watchdog_expired() checks the budget and the
+// clock and hands out more.
+typedef struct {
+    int fuel;                      // Charge left before the next check; translated code updates it in place.
+    int enabled;                   // A budget or deadline is set, so branches charge fuel.
+    int64_t budget;                // Instructions still to hand out as fuel; -1 for no budget.
+    double deadline;               // wall_seconds() at which the run stops; 0 for none.
+    int expired;                   // EXIT_BUDGET or EXIT_DEADLINE once the watchdog stopped the run.
+    int stop_pc;                   // Where the run stopped, to resume from, once expired.
+    int64_t granted;               // Fuel handed out so far, so a memoized call can measure its charge.
+} Watchdog;
+
+// One remembered result of a pure routine (see Memoization). Values are indexed by register code,
+// with the comparison result in the last slot.
+#define MEMO_VALUES (NUM_REGISTERS + 1)
+#define MEMO_FLAGS (1 << NUM_REGISTERS) // The comparison result's bit in a register mask.
+typedef struct {
+    int valid;                     // Holds a result.
+    int target;                    // The routine's entry PC.
+    int inputs[MEMO_VALUES];       // The routine's live-in values, 0 for the rest.
+    int outputs[MEMO_VALUES];      // Values when it returned.
+    uint16_t written;              // Mask of the values the call wrote.
+    int frame_words;               // Stack words it left below its return address.
+    int frame_capacity;
+    int* frame;
+    int64_t charge;                // Watchdog fuel the call consumed.
+} MemoEntry;
+
+typedef struct MemoTable {
+    uint16_t* live;                // Per PC of a pure routine: the values read there before being written.
+    uint16_t* writes;              // Per PC: the values the slot's handler writes.
+    int nesting;                   // Misses running, one inside the other.
+    int low_esp;                   // Lowest stack word the innermost miss has written.
+    uint16_t written;              // Values the innermost miss has written so far.
+    MemoEntry entries[MEMO_ENTRIES];
+} MemoTable;
+
+// Formats of --dump, in the order of CpuSimDumpFormat.
+typedef enum {
+    DUMP_TEXT,      // Every register and memory word, readably.
+    DUMP_JSON,      // Registers, flags and the words that changed, as one JSON object.
+    DUMP_BINARY     // The same as a DumpHeader and DumpChanges (see isa.h).
+} DumpFormat;
+
+// The interpreter loops that can run a decoded program.
+typedef enum {
+    ENGINE_CALL,    // Reference engine: calls the handler for each instruction from a loop.
+    ENGINE_THREADED, // Direct-threaded engine using computed goto (falls back to ENGINE_CALL).
+    ENGINE_JIT       // Basic-block JIT to x86-64 (falls back to ENGINE_THREADED).
+} Engine;
+
+// A program image (see isa.h) the loaded program came from, mapped copy-on-write. The context's
+// machine code points into it, and so does its decoded program when the decoded section was used.
+typedef struct {
+    uint8_t* base;                 // The whole file.
+    size_t size;
+    int mapped;                    // base is an mmap() of the file rather than a malloc() copy.
+    const ImageHeader* header;
+    uint16_t* code;
+    const int32_t* data;           // The data segment, or NULL.
+    const ImageSymbol* symbols;
+    int symbol_count;
+    const uint32_t* blocks;        // The basic-block index, or NULL.
+    int block_count;
+    const ImageDecodedHeader* decoded; // The decoded section, or NULL.
+    size_t decoded_size;
+} ProgramImage;
+
+// Everything one simulated CPU owns. Each running program gets its own context, so several
+// programs can execute side by side in one process.
+typedef struct CpuContext {
+    Registers registers;                                  // The CPU registers.
+    Flags flags;                                          // The CPU flags.
+    int* memory;                                          // The main memory, in demand-zero pages.
+    int memory_size;                                      // Words of main memory; the stack starts at the top.
+    uint8_t* dirty;                                       // One byte per memory page, set once it may be nonzero.
+    int* dump_base;                                       // Memory as of the last --dump, for the next diff.
+    int memory_mask;                                      // memory_size - 1, for --mask-addresses.
+    int masked_addresses;                                 // Stack and base+offset addresses wrap instead of faulting.
+    int watched;                                          // Control transfers charge the watchdog (see watch_branches).
+    Engine engine;                                        // The engine run_engine() dispatches with.
+    int faulted;                                          // The last run stopped on a runtime error.
+    int memoized;                                         // --memoize: CALLs of pure routines go through memo.
+    struct MemoTable* memo;                               // Results of pure routines, once decoded with memoized.
+    uint16_t* machine_code;                               // Buffer for the machine code, one word per instruction.
+    WideOperand* wide_operands;                           // Operands of the wide instructions, by PC.
+    int wide_count;
+    DecodedInstruction* decoded_program;                  // The decoded machine code, plus a terminal slot.
+    int program_instruction_count;                        // The number of instructions in the loaded program.
+    int program_capacity;                                 // Instructions machine_code has room for.
+    int entry_pc;                                         // Where run_program() starts.
+    ProgramImage image;                                   // The image the program was loaded from, if any.
+    FILE* in;                                             // Where INP reads from (NULL: no input available).
+    FILE* out;                                            // Where OUT, HLT and loader messages are printed.
+    FILE* err;                                            // Where loader and runtime errors are printed.
+    IoChannel io;                                         // Headless INP/OUT, when enabled.
+    PerfCounters counters;                                // Statistics of the last run, with --stats.
+    Watchdog watchdog;                                    // Limits of the current run.
+    struct JitState* jit;                                 // Translated code for the loaded program, if any.
+} CpuContext;
+
+// Every store into main memory marks its page, so resets clear and dumps compare only the pages a
+// run touched. `address` must already be in range (or wrapped into it).
+#define MARK_DIRTY(ctx, address) ((ctx)->dirty[(unsigned)(address) >> DIRTY_PAGE_SHIFT] = 1)
+
+// Executes one decoded instruction and returns the next program counter (-1 halts).
+typedef int (*InstructionHandler)(CpuContext* ctx, const DecodedInstruction* insn, int pc);
+
+typedef enum {
+    STATS_OFF,      // No counters: the selected engine runs untouched.
+    STATS_TEXT,     // Count with the counting engine and print a readable report.
+    STATS_JSON      // Same counters, printed as one JSON object.
+} StatsFormat;
+
 // --- Global State ---
-Registers registers = { 0 }; // The CPU registers.
-Flags flags = { 0 }; // The CPU flags.
-const char* register_names[] = { "EAX", "EBX", "ECX", "EDX", "ESI", "EDI", "EBP", "ESP" }; // Names of the registers for printing.
-int memory[MEMORY_SIZE]; // The main memory.
-uint16_t machine_code[PROGRAM_SIZE] = { 0 }; // Buffer for the machine code.
-int program_instruction_count = 0; // The number of instructions in the loaded program.
+Engine selected_engine = ENGINE_CALL; // The engine new contexts run with.
+int headless_io = 0;                  // New contexts use the headless INP/OUT channel.
+int binary_output = 0;                // Headless OUT writes binary words instead of text.
+int memory_words = MEMORY_SIZE;       // Main memory size of new contexts.
+int memory_words_set = 0;             // --memory was given, so it overrides the size an image asks for.
+StatsFormat stats_format = STATS_OFF; // Whether run_program() gathers and reports counters.
+int report_run_time = 0;              // run_program() prints how long the engine ran.
+int mask_addresses = 0;               // New contexts wrap unverified addresses into memory.
+const char* profile_filename = NULL;  // run_program() profiles and writes collapsed stacks here.
+const char* symbols_filename = NULL;  // Assembler symbol file that names the profile's frames.
+const char* trace_filename = NULL;    // run_program() writes an execution trace here.
+int trace_ring_records = 0;           // With --trace-ring, only the last this many records are kept.
+long long run_budget = 0;             // Instructions each run may execute (--budget); 0 for no limit.
+double run_deadline = 0.0;            // Seconds each run may take (--deadline); 0 for no limit.
+const char* save_image_filename = NULL; // --save-image writes the loaded, decoded program here instead of running it.
+int serve_cache_entries = SERVE_CACHE_ENTRIES; // Programs --serve keeps in its cache; 0 turns it off.
+int memoize_calls = 0;                // New contexts memoize calls of pure routines (--memoize).
+const char* dump_filename = NULL;     // Where single and batch runs dump their final state (--dump).
+DumpFormat dump_format = DUMP_TEXT;   // How they dump it (--dump-format).
 
 // --- Function Prototypes ---
-void dump_contents();
-int  load_binary_program(const char* filename);
-void run_program();
-int  execute_instruction(uint16_t instruction, int pc);
-int  get_register_value(int reg_code);
-void set_register_value(int reg_code, int value);
-void write_memory(int address, int data);
-int  read_memory(int address);
+void init_context(CpuContext* ctx);
+void destroy_context(CpuContext* ctx);
+void dump_contents(CpuContext* ctx, FILE* f);
+int  write_dump(CpuContext* ctx, FILE* f, DumpFormat format);
+int  load_binary_program(CpuContext* ctx, const char* filename);
+int  load_program_buffer(CpuContext* ctx, const void* program, size_t size, const char* name, int words, int forced);
+int  load_image(CpuContext* ctx, FILE* f, const char* filename);
+static int install_image(CpuContext* ctx, ProgramImage* image, const char* name);
+static int grow_program(CpuContext* ctx, int capacity);
+static int unpack_wide_instructions(CpuContext* ctx, const char* name);
+static int finish_loading(CpuContext* ctx, const char* name, int words, int forced);
+void release_image(CpuContext* ctx);
+int  save_image(CpuContext* ctx, const char* filename);
+void run_program(CpuContext* ctx);
+void reset_cpu(CpuContext* ctx);
+void resume_program(CpuContext* ctx, int pc);
+void decode_program(CpuContext* ctx);
+static void memoize_pure_calls(CpuContext* ctx);
+static void release_memo(CpuContext* ctx);
+int  adopt_decoded_program(CpuContext* ctx);
+int  execute_instruction(CpuContext* ctx, const DecodedInstruction* insn, int pc);
+void write_memory(CpuContext* ctx, int address, int data);
+int  read_memory(CpuContext* ctx, int address);
+int  run_batch(const char** filenames, int count, int thread_count, FILE* dump_file);
+int  load_source_program(CpuContext* ctx, const char* filename);
+int  run_sources(const char** filenames, int count, FILE* dump_file);
+int  run_vector(CpuContext* ctx, const char* input_filename);
+int* read_input_values(const char* filename, int* count);
+void flush_output(CpuContext* ctx);
+int* alloc_guest_memory(size_t words);
+void clear_guest_memory(int* memory, size_t words);
+void free_guest_memory(int* memory, size_t words);
+static int resize_memory(CpuContext* ctx, int words);
+static void mark_dirty_block(CpuContext* ctx, int address, int count);
+static void clear_dirty_memory(CpuContext* ctx);
+int  run_snapshot_mode(CpuContext* ctx, int snapshot_pc, const char* save_filename, const char* load_filename, const char* explore_filename);
+int  run_serve(const char* socket_path, int thread_count);
 
 // --- Main Function ---
+#ifndef CPUSIM_LIBRARY
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <binary file>\n", argv[0]);
+    const char** filenames = calloc(argc, sizeof(const char*));
+    int file_count = 0;
+    int batch_mode = 0;
+    int serve_mode = 0;
+    const char* serve_socket_path = NULL;
+    int thread_count = 0;
+    const char* vector_filename = NULL;
+    const char* input_filename = NULL;
+    const char* output_filename = NULL;
+    int snapshot_pc = -1;
+    const char* save_snapshot_filename = NULL;
+    const char* load_snapshot_filename = NULL;
+    const char* explore_filename = NULL;
+    int source_mode = argc > 1 && strcmp(argv[1], "run") == 0; // `run`: the files are assembly sources.
+
+    if (filenames == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+
+    for (int i = 1 + source_mode; i < argc; i++) {
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            const char* name = argv[i] + 9;
+            if (strcmp(name, "call") == 0) selected_engine = ENGINE_CALL;
+            else if (strcmp(name, "threaded") == 0) selected_engine = ENGINE_THREADED;
+            else if (strcmp(name, "jit") == 0) selected_engine = ENGINE_JIT;
+            else {
+                fprintf(stderr, "[Fatal Error] Unknown engine '%s' (expected 'call', 'threaded' or 'jit').\n", name);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--vector=", 9) == 0) {
+            vector_filename = argv[i] + 9;
+        } else if (strncmp(argv[i], "--memory=", 9) == 0) {
+            // A word count, optionally in K (1024) or M (1048576) words.
+            char* end;
+            long long words = strtoll(argv[i] + 9, &end, 10);
+            if (*end == 'K' || *end == 'k') { words *= 1024; end++; }
+            else if (*end == 'M' || *end == 'm') { words *= 1024 * 1024; end++; }
+            if (*end != '\0' || words < MEMORY_SIZE || words > MAX_MEMORY_SIZE) {
+                fprintf(stderr, "[Fatal Error] --memory expects a word count from %d to %d.\n", MEMORY_SIZE, MAX_MEMORY_SIZE);
+                return 1;
+            }
+            memory_words = (int)words;
+            memory_words_set = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            stats_format = STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_format = STATS_JSON;
+        } else if (strcmp(argv[i], "--mask-addresses") == 0) {
+            mask_addresses = 1;
+        } else if (strcmp(argv[i], "--memoize") == 0) {
+            memoize_calls = 1;
+        } else if (strncmp(argv[i], "--snapshot-at=", 14) == 0) {
+            snapshot_pc = atoi(argv[i] + 14);
+            if (snapshot_pc < 0) {
+                fprintf(stderr, "[Fatal Error] --snapshot-at expects a program counter.\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--save-snapshot=", 16) == 0) {
+            save_snapshot_filename = argv[i] + 16;
+        } else if (strncmp(argv[i], "--load-snapshot=", 16) == 0) {
+            load_snapshot_filename = argv[i] + 16;
+        } else if (strncmp(argv[i], "--explore=", 10) == 0) {
+            explore_filename = argv[i] + 10;
+        } else if (strncmp(argv[i], "--save-image=", 13) == 0) {
+            save_image_filename = argv[i] + 13;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile_filename = argv[i] + 10;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_filename = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-ring=", 13) == 0) {
+            trace_ring_records = atoi(argv[i] + 13);
+            if (trace_ring_records < 1) {
+                fprintf(stderr, "[Fatal Error] --trace-ring expects a positive record count.\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--symbols=", 10) == 0) {
+            symbols_filename = argv[i] + 10;
+        } else if (strncmp(argv[i], "--budget=", 9) == 0) {
+            run_budget = strtoll(argv[i] + 9, NULL, 10);
+            if (run_budget < 1) {
+                fprintf(stderr, "[Fatal Error] --budget expects a positive instruction count.\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--deadline=", 11) == 0) {
+            run_deadline = strtod(argv[i] + 11, NULL);
+            if (!(run_deadline > 0)) {
+                fprintf(stderr, "[Fatal Error] --deadline expects a positive number of seconds.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--time") == 0) {
+            report_run_time = 1;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless_io = 1;
+        } else if (strncmp(argv[i], "--input=", 8) == 0) {
+            input_filename = argv[i] + 8;
+            headless_io = 1;
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output_filename = argv[i] + 9;
+            headless_io = 1;
+        } else if (strncmp(argv[i], "--output-format=", 16) == 0) {
+            const char* format = argv[i] + 16;
+            if (strcmp(format, "text") == 0) binary_output = 0;
+            else if (strcmp(format, "binary") == 0) binary_output = 1;
+            else {
+                fprintf(stderr, "[Fatal Error] Unknown output format '%s' (expected 'text' or 'binary').\n", format);
+                return 1;
+            }
+            headless_io = 1;
+        } else if (strncmp(argv[i], "--dump=", 7) == 0) {
+            dump_filename = argv[i] + 7;
+        } else if (strncmp(argv[i], "--dump-format=", 14) == 0) {
+            const char* format = argv[i] + 14;
+            if (strcmp(format, "text") == 0) dump_format = DUMP_TEXT;
+            else if (strcmp(format, "json") == 0) dump_format = DUMP_JSON;
+            else if (strcmp(format, "binary") == 0) dump_format = DUMP_BINARY;
+            else {
+                fprintf(stderr, "[Fatal Error] Unknown dump format '%s' (expected 'text', 'json' or 'binary').\n", format);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 || strncmp(argv[i], "--serve=", 8) == 0) {
+            serve_mode = 1;
+            serve_socket_path = argv[i][7] == '=' ? argv[i] + 8 : NULL;
+        } else if (strncmp(argv[i], "--serve-cache=", 14) == 0) {
+            serve_cache_entries = atoi(argv[i] + 14);
+            if (serve_cache_entries < 0) {
+                fprintf(stderr, "[Fatal Error] --serve-cache expects a program count.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_mode = 1;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            thread_count = atoi(argv[i] + 10);
+            if (thread_count < 1) {
+                fprintf(stderr, "[Fatal Error] --threads expects a positive number.\n");
+                return 1;
+            }
+        } else {
+            filenames[file_count++] = argv[i];
+        }
+    }
+
+    if (mask_addresses && (memory_words & (memory_words - 1)) != 0) {
+        fprintf(stderr, "[Fatal Error] --mask-addresses needs a power-of-two --memory size.\n");
         return 1;
     }
 
-    if (load_binary_program(argv[1]) < 0) {
-        fprintf(stderr, "[Fatal Error] Could not load binary file. Exiting.\n");
+    int snapshot_mode = snapshot_pc >= 0 || load_snapshot_filename != NULL;
+    int single_only = vector_filename != NULL || input_filename != NULL || output_filename != NULL || snapshot_mode ||
+        profile_filename != NULL || trace_filename != NULL || save_image_filename != NULL;
+    int run_loops = (stats_format != STATS_OFF) + (profile_filename != NULL) + (trace_filename != NULL);
+    int bad_run_options = run_loops > 1 || (run_loops > 0 && vector_filename != NULL) ||
+        (symbols_filename != NULL && profile_filename == NULL) || (trace_ring_records > 0 && trace_filename == NULL) ||
+        (save_image_filename != NULL && (run_loops > 0 || vector_filename != NULL || snapshot_mode)) ||
+        (dump_filename != NULL && (vector_filename != NULL || snapshot_mode || save_image_filename != NULL));
+    int bad_snapshot_options = (snapshot_pc >= 0 && load_snapshot_filename != NULL) ||
+        ((save_snapshot_filename != NULL || explore_filename != NULL) && !snapshot_mode) ||
+        (save_snapshot_filename != NULL && snapshot_pc < 0) || (snapshot_mode && vector_filename != NULL);
+    int bad_serve_options = serve_mode && (file_count != 0 || batch_mode || single_only || run_loops > 0 || dump_filename != NULL);
+    int bad_source_options = source_mode && (serve_mode || batch_mode || (file_count > 1 && single_only));
+    if (serve_mode ? bad_serve_options : file_count == 0 || (!batch_mode && !source_mode && file_count != 1) || (batch_mode && single_only) ||
+                                         bad_snapshot_options || bad_run_options || bad_source_options) {
+        fprintf(stderr, "Usage: %s [--engine=call|threaded|jit] [--memory=WORDS] [--memoize] [--stats[=text|json]] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s [--budget=INSTRUCTIONS] [--deadline=SECONDS] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --profile=FILE [--symbols=FILE] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --trace=FILE [--trace-ring=RECORDS] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --headless [--input=FILE] [--output=FILE] [--output-format=text|binary] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --dump=FILE [--dump-format=text|json|binary] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --batch [--threads=N] [--engine=...] [--dump=FILE] <binary file>...\n", argv[0]);
+        fprintf(stderr, "       %s --vector=<input file> <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --snapshot-at=PC [--save-snapshot=FILE] [--explore=FILE] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --load-snapshot=FILE [--explore=FILE] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --save-image=FILE [--memory=WORDS] [--mask-addresses] <binary file>\n", argv[0]);
+        fprintf(stderr, "       %s --serve[=SOCKET] [--threads=N] [--serve-cache=PROGRAMS] [--engine=...] [--budget=...]\n", argv[0]);
+        fprintf(stderr, "       %s run [options] <source file>...\n", argv[0]);
         return 1;
     }
+    if (serve_mode) {
+        free(filenames);
+        return run_serve(serve_socket_path, thread_count);
+    }
 
-    run_program();
+    FILE* dump_file = NULL;
+    if (dump_filename != NULL && (dump_file = fopen(dump_filename, dump_format == DUMP_BINARY ? "wb" : "w")) == NULL) {
+        fprintf(stderr, "[Fatal Error] Failed to open dump file: %s\n", strerror(errno));
+        return 1;
+    }
 
-    return 0;
+    if (batch_mode || (source_mode && file_count > 1)) {
+        int status = batch_mode ? run_batch(filenames, file_count, thread_count, dump_file) : run_sources(filenames, file_count, dump_file);
+        int dump_failed = dump_file != NULL && ferror(dump_file); // Set by a failed copy of a batch dump.
+        if (dump_file != NULL && (fclose(dump_file) != 0 || dump_failed)) {
+            fprintf(stderr, "[Fatal Error] Failed to write dump file: %s\n", strerror(errno));
+            status = 1;
+        }
+        free(filenames);
+        return status;
+    }
+
+    CpuContext* ctx = malloc(sizeof(CpuContext));
+    if (ctx == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+    init_context(ctx);
+
+    // Headless INP values come from --input, or from everything on stdin.
+    int* input_values = NULL;
+    if (headless_io && vector_filename == NULL) {
+        input_values = read_input_values(input_filename, &ctx->io.input_count);
+        if (input_values == NULL) return 1;
+        ctx->io.input = input_values;
+    }
+    FILE* output_file = NULL;
+    if (output_filename != NULL) {
+        output_file = fopen(output_filename, binary_output ? "wb" : "w");
+        if (output_file == NULL) {
+            fprintf(stderr, "[Fatal Error] Failed to open output file: %s\n", strerror(errno));
+            return 1;
+        }
+        ctx->io.sink = output_file;
+    }
+
+    if ((source_mode ? load_source_program(ctx, filenames[0]) : load_binary_program(ctx, filenames[0])) < 0) {
+        fprintf(stderr, source_mode ? "[Fatal Error] Could not load source file. Exiting.\n" : "[Fatal Error] Could not load binary file. Exiting.\n");
+        return 1;
+    }
+
+    int status = 0;
+    if (save_image_filename != NULL) {
+        status = save_image(ctx, save_image_filename) < 0 ? 1 : 0;
+    } else if (vector_filename != NULL) {
+        status = run_vector(ctx, vector_filename);
+    } else if (snapshot_mode) {
+        status = run_snapshot_mode(ctx, snapshot_pc, save_snapshot_filename, load_snapshot_filename, explore_filename);
+    } else {
+        run_program(ctx);
+        status = ctx->watchdog.expired;
+        if (dump_file != NULL && write_dump(ctx, dump_file, dump_format) < 0) status = 1;
+    }
+
+    destroy_context(ctx);
+    free(ctx);
+    free(filenames);
+    free(input_values);
+    if (output_file != NULL && fclose(output_file) != 0) {
+        fprintf(stderr, "[Fatal Error] Failed to write output file: %s\n", strerror(errno));
+        status = 1;
+    }
+    if (dump_file != NULL && fclose(dump_file) != 0) {
+        fprintf(stderr, "[Fatal Error] Failed to write dump file: %s\n", strerror(errno));
+        status = 1;
+    }
+    return status;
 }
+#endif
 
-int load_binary_program(const char* filename) {
+int load_binary_program(CpuContext* ctx, const char* filename) {
     FILE* f = fopen(filename, "rb");
     if (f == NULL) {
-        perror("[Loader Error] Failed to open binary file");
+        fprintf(ctx->err, "[Loader Error] Failed to open binary file: %s\n", strerror(errno));
         return -1;
     }
+    release_image(ctx); // The previous program's, if it came from one.
+    ctx->entry_pc = 0;
 
-    // Read the binary file into the machine code buffer.
-    size_t instructions_read = fread(machine_code, sizeof(uint16_t), PROGRAM_SIZE, f);
-    if (instructions_read == 0 && !feof(f)) {
-        fprintf(stderr, "[Loader Error] An error occurred while reading the file.\n");
+    // Program images start with IMAGE_MAGIC; anything else is bare machine code words.
+    char magic[sizeof(((ImageHeader*)0)->magic)];
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0) {
+        int instructions = load_image(ctx, f, filename);
         fclose(f);
-        return -1;
+        if (instructions < 0) return -1;
+    } else {
+        rewind(f);
+        // Read the whole binary file into the machine code buffer, growing it as needed.
+        size_t instructions_read = 0;
+        for (;;) {
+            if (instructions_read + PROGRAM_CHUNK > (size_t)ctx->program_capacity &&
+                grow_program(ctx, ctx->program_capacity ? ctx->program_capacity * 2 : PROGRAM_CHUNK) < 0) {
+                fclose(f);
+                return -1;
+            }
+            size_t n = fread(ctx->machine_code + instructions_read, sizeof(uint16_t), PROGRAM_CHUNK, f);
+            instructions_read += n;
+            if (n < PROGRAM_CHUNK) break;
+        }
+        if (ferror(f)) {
+            fprintf(ctx->err, "[Loader Error] An error occurred while reading the file.\n");
+            fclose(f);
+            return -1;
+        }
+        fclose(f);
+        ctx->program_instruction_count = (int)instructions_read;
     }
-    fclose(f);
+    return finish_loading(ctx, filename, memory_words, memory_words_set);
+}
+
+// Loads a program from memory instead of a file, for the library: bare machine code words or a
+// whole image, which is copied so the caller may free `program` afterwards. `words` and `forced`
+// size memory as for finish_loading().
+int load_program_buffer(CpuContext* ctx, const void* program, size_t size, const char* name, int words, int forced) {
+    release_image(ctx);
+    ctx->entry_pc = 0;
+    if (size >= sizeof(((ImageHeader*)0)->magic) && memcmp(program, IMAGE_MAGIC, sizeof(((ImageHeader*)0)->magic)) == 0) {
+        ProgramImage image = { 0 };
+        image.base = malloc(size);
+        image.size = size;
+        if (image.base == NULL) {
+            fprintf(ctx->err, "[Loader Error] Program is too large to load.\n");
+            return -1;
+        }
+        memcpy(image.base, program, size);
+        if (install_image(ctx, &image, name) < 0) return -1;
+    } else {
+        size_t instructions = size / sizeof(uint16_t);
+        if (instructions >= INT32_MAX || (instructions > (size_t)ctx->program_capacity && grow_program(ctx, (int)instructions) < 0)) {
+            if (instructions >= INT32_MAX) fprintf(ctx->err, "[Loader Error] Program is too large to load.\n");
+            return -1;
+        }
+        if (instructions > 0) memcpy(ctx->machine_code, program, instructions * sizeof(uint16_t));
+        ctx->program_instruction_count = (int)instructions;
+    }
+    return finish_loading(ctx, name, words, forced);
+}
 
-    program_instruction_count = instructions_read;
-    printf("Loaded %d instructions from '%s'.\n", program_instruction_count, filename);
-    return program_instruction_count;
+// Makes room for `capacity` instructions of bare machine code and their decoded slots.
+static int grow_program(CpuContext* ctx, int capacity) {
+    uint16_t* code = realloc(ctx->machine_code, capacity * sizeof(uint16_t));
+    DecodedInstruction* decoded = code ? realloc(ctx->decoded_program, (capacity + 1) * sizeof(DecodedInstruction)) : NULL;
+    if (code != NULL) ctx->machine_code = code;
+    if (decoded == NULL) {
+        fprintf(ctx->err, "[Loader Error] Program is too large to load.\n");
+        return -1;
+    }
+    ctx->decoded_program = decoded;
+    ctx->program_capacity = capacity;
+    return 0;
 }
 
-void run_program() {
-    int pc = 0; // The program counter starts at 0.
-    memset(memory, 0, sizeof(memory)); // Clear main memory before execution.
-    registers.ESP = STACK_TOP + 1; // ESP starts just above the highest memory address.
-    registers.EBP = registers.ESP;
+// Folds each wide instruction of the loaded words into a single word, moving its operand to
+// wide_operands, so that machine_code again holds one word per instruction. Returns -1 after
+// printing an error for a wide instruction that is cut off or has no operand field.
+static int unpack_wide_instructions(CpuContext* ctx, const char* name) {
+    uint16_t* code = ctx->machine_code;
+    int words = ctx->program_instruction_count, prefixes = 0;
+    free(ctx->wide_operands);
+    ctx->wide_operands = NULL;
+    ctx->wide_count = 0;
+    for (int i = 0; i < words; i++) prefixes += code[i] == WIDE_PREFIX;
+    if (prefixes == 0) return 0;
+    ctx->wide_operands = malloc(prefixes * sizeof(WideOperand));
+    if (ctx->wide_operands == NULL) {
+        fprintf(ctx->err, "[Loader Error] Program is too large to load.\n");
+        return -1;
+    }
 
-    while (pc >= 0 && pc < program_instruction_count) {
-        int next_pc = execute_instruction(machine_code[pc], pc);
-        pc = next_pc;
+    int count = 0;
+    for (int i = 0; i < words; count++) {
+        if (code[i] != WIDE_PREFIX) {
+            code[count] = code[i++];
+            continue;
+        }
+        OperandForm form = i + 1 < words ? instruction_forms[code[i + 1] >> 11].form : FORM_NONE;
+        if (i + WIDE_WORDS > words || form == FORM_NONE || form == FORM_REG || form == FORM_REG_REG) {
+            fprintf(ctx->err, "[Loader Error] '%s' has a malformed wide instruction at word %d.\n", name, i);
+            return -1;
+        }
+        ctx->wide_operands[ctx->wide_count++] = (WideOperand){ count, (int32_t)(code[i + 2] | (uint32_t)code[i + 3] << 16) };
+        code[count] = code[i + 1];
+        i += WIDE_WORDS;
     }
+    ctx->program_instruction_count = count;
+    return 0;
 }
 
-int execute_instruction(uint16_t instruction, int pc) {
-    uint16_t opcode = instruction >> 11;
+// The part of loading shared by files and buffers, once the machine code is in place: sizes
+// memory, checks the data segment and decodes. `words` is the memory size to use, unless an image
+// asks for another and `forced` is not set. Returns the instruction count, or -1.
+static int finish_loading(CpuContext* ctx, const char* name, int words, int forced) {
+    if (unpack_wide_instructions(ctx, name) < 0) return -1;
+    if (ctx->entry_pc > ctx->program_instruction_count) {
+        fprintf(ctx->err, "[Loader Error] '%s' is corrupt.\n", name);
+        return -1;
+    }
+
+    // Main memory is sized when the first program is loaded, or again for an image that asks for
+    // another size; pages are only backed once touched.
+    const ImageHeader* header = ctx->image.header;
+    if (header != NULL && header->memory_size != 0 && !forced) words = (int)header->memory_size;
+    if (ctx->memory == NULL || ctx->memory_size != words) {
+        if (ctx->masked_addresses && (words & (words - 1)) != 0) {
+            fprintf(ctx->err, "[Loader Error] '%s' asks for %d words of memory, which --mask-addresses cannot wrap.\n", name, words);
+            return -1;
+        }
+        if (resize_memory(ctx, words) < 0) {
+            fprintf(ctx->err, "[Loader Error] Could not reserve %d words of memory.\n", words);
+            return -1;
+        }
+    }
+    if (header != NULL && (uint64_t)header->data_address + header->data_length > (uint64_t)ctx->memory_size) {
+        fprintf(ctx->err, "[Loader Error] The data segment of '%s' does not fit in %d words of memory.\n", name, ctx->memory_size);
+        return -1;
+    }
 
-    // Handle base+offset addressing for MOV instructions.
-    if (opcode == 0b01111 || opcode == 0b11111) {
-        uint16_t reg_dest_src = (instruction >> 8) & 0x07;
-        uint16_t reg_base = (instruction >> 5) & 0x07;
-        uint16_t offset = instruction & 0x1F;
-        int effective_address = get_register_value(reg_base) + offset;
+    // An image's decoded section replaces decoding when this build wrote it for the same setup.
+    if (header == NULL || !adopt_decoded_program(ctx)) {
+        if (ctx->decoded_program == NULL) {
+            ctx->decoded_program = malloc(((size_t)ctx->program_instruction_count + 1) * sizeof(DecodedInstruction));
+            if (ctx->decoded_program == NULL) {
+                fprintf(ctx->err, "[Loader Error] Program is too large to load.\n");
+                return -1;
+            }
+        }
+        decode_program(ctx);
+    }
+    if (!ctx->io.headless) fprintf(ctx->out, "Loaded %d instructions from '%s'.\n", ctx->program_instruction_count, name);
+    return ctx->program_instruction_count;
+}
 
-        if (opcode == 0b01111) { // MOV reg, [reg+off]
-            set_register_value(reg_dest_src, read_memory(effective_address));
-        } else { // MOV [reg+off], reg
-            write_memory(effective_address, get_register_value(reg_dest_src));
+// --- Instruction Handlers ---
+// One handler per opcode. The operands come pre-extracted from the decoded slot.
+static int op_hlt(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    if (!ctx->io.headless) fprintf(ctx->out, "--- HLT instruction at PC %d ---\n", pc);
+    return -1;
+}
+static int op_mul(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] *= ctx->registers.regs[insn->reg2]; return pc + 1; }
+static int op_div(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int divisor = ctx->registers.regs[insn->reg2];
+    if (divisor == 0) {
+        fprintf(ctx->err, "[Runtime Error] Division by zero at PC %d.\n", pc);
+        ctx->faulted = 1;
+        return -1; // Halt on error.
+    }
+    ctx->registers.regs[insn->reg1] /= divisor;
+    return pc + 1;
+}
+static int op_xor(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] ^= ctx->registers.regs[insn->reg2]; return pc + 1; }
+static int op_inp(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int input_val, c;
+    if (ctx->io.input_fn != NULL) {
+        if (ctx->io.input_fn(ctx->io.user, &input_val) != 0) {
+            fprintf(ctx->err, "[Runtime Error] Invalid integer input.\n");
+            input_val = 0;
         }
+        ctx->registers.regs[insn->reg1] = input_val;
+        return pc + 1;
+    }
+    if (ctx->io.headless) {
+        if (ctx->io.input_pos < ctx->io.input_count) {
+            ctx->registers.regs[insn->reg1] = ctx->io.input[ctx->io.input_pos++];
+        } else {
+            fprintf(ctx->err, "[Runtime Error] Invalid integer input.\n");
+            ctx->registers.regs[insn->reg1] = 0;
+        }
+        return pc + 1;
+    }
+    fprintf(ctx->out, "INPUT required for register %s: ", register_names[insn->reg1]);
+    if (ctx->in == NULL || fscanf(ctx->in, "%d", &input_val) != 1) {
+        fprintf(ctx->err, "[Runtime Error] Invalid integer input.\n");
+        ctx->registers.regs[insn->reg1] = 0;
+    } else {
+        ctx->registers.regs[insn->reg1] = input_val;
+    }
+    // Discard the rest of the input line.
+    if (ctx->in != NULL) {
+        while ((c = fgetc(ctx->in)) != '\n' && c != EOF);
+    }
+    return pc + 1;
+}
+static int op_out(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int value = ctx->registers.regs[insn->reg1];
+    if (ctx->io.output_fn != NULL) {
+        ctx->io.output_fn(ctx->io.user, value);
+        return pc + 1;
+    }
+    if (!ctx->io.headless) {
+        fprintf(ctx->out, "OUTPUT from register %s: %d\n", register_names[insn->reg1], value);
+        return pc + 1;
+    }
+    IoChannel* io = &ctx->io;
+    if (io->length > IO_BUFFER_SIZE - 16) flush_output(ctx); // Room for the longest encoded value.
+    if (io->binary) {
+        uint32_t word = (uint32_t)value;
+        for (int i = 0; i < 4; i++) io->buffer[io->length++] = (char)(word >> (8 * i));
+    } else {
+        io->length += sprintf(io->buffer + io->length, "%d\n", value);
+    }
+    return pc + 1;
+}
+static int op_mov_imm(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = insn->operand; return pc + 1; }
+static int op_load(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = read_memory(ctx, insn->operand); return pc + 1; }
+static int op_store(CpuContext* ctx, const DecodedInstruction* insn, int pc) { write_memory(ctx, insn->operand, ctx->registers.regs[insn->reg1]); return pc + 1; }
+
+// Arithmetic
+static int op_inc(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1]++; return pc + 1; }
+static int op_dec(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1]--; return pc + 1; }
+static int op_add(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] += ctx->registers.regs[insn->reg2]; return pc + 1; }
+static int op_sub(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] -= ctx->registers.regs[insn->reg2]; return pc + 1; }
+static int op_mov_reg(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = ctx->registers.regs[insn->reg2]; return pc + 1; }
+
+// Logical & Immediate Arithmetic
+static int op_add_imm(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] += insn->operand; return pc + 1; }
+static int op_sub_imm(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] -= insn->operand; return pc + 1; }
+static int op_cmp_imm(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    ctx->flags.result = ctx->registers.regs[insn->reg1] - insn->operand;
+    return pc + 1;
+}
+static int op_not(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = ~ctx->registers.regs[insn->reg1]; return pc + 1; }
+
+// Comparison & Jumps
+static int op_cmp(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    ctx->flags.result = ctx->registers.regs[insn->reg1] - ctx->registers.regs[insn->reg2];
+    return pc + 1;
+}
+static int op_jmp(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return insn->operand; }
+// Each condition reads the stored comparison result directly: ZF is result == 0, SF is result < 0.
+static int op_je(CpuContext* ctx, const DecodedInstruction* insn, int pc)  { return ctx->flags.result == 0 ? insn->operand : pc + 1; }
+static int op_jne(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return ctx->flags.result != 0 ? insn->operand : pc + 1; }
+static int op_jg(CpuContext* ctx, const DecodedInstruction* insn, int pc)  { return ctx->flags.result > 0 ? insn->operand : pc + 1; }
+static int op_jl(CpuContext* ctx, const DecodedInstruction* insn, int pc)  { return ctx->flags.result < 0 ? insn->operand : pc + 1; }
+static int op_jge(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return ctx->flags.result >= 0 ? insn->operand : pc + 1; }
+static int op_jle(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return ctx->flags.result <= 0 ? insn->operand : pc + 1; }
+
+// Stack & Functions
+static int op_push(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.ESP--; write_memory(ctx, ctx->registers.ESP, ctx->registers.regs[insn->reg1]); return pc + 1; }
+static int op_pop(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = read_memory(ctx, ctx->registers.ESP); ctx->registers.ESP++; return pc + 1; }
+static int op_call(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.ESP--; write_memory(ctx, ctx->registers.ESP, pc + 1); return insn->operand; }
+static int op_ret(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int ret_addr = read_memory(ctx, ctx->registers.ESP);
+    ctx->registers.ESP++;
+    return ret_addr;
+}
+
+// Base+offset addressing
+static int op_load_indexed(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = read_memory(ctx, ctx->registers.regs[insn->reg2] + insn->operand); return pc + 1; }
+static int op_store_indexed(CpuContext* ctx, const DecodedInstruction* insn, int pc) { write_memory(ctx, ctx->registers.regs[insn->reg2] + insn->operand, ctx->registers.regs[insn->reg1]); return pc + 1; }
+
+// Block instructions. Each block is checked once, as a whole, and then handed to the C library's
+// memmove/memcmp or a loop the compiler vectorizes; a block that does not fit faults and is left
+// alone. With --mask-addresses blocks wrap, and one that crosses the end of memory goes word by word.
+static int block_fits(const CpuContext* ctx, int address, int count) {
+    return count >= 0 && (ctx->masked_addresses || (address >= 0 && count <= ctx->memory_size - address));
+}
+static void block_fault(CpuContext* ctx, const char* access, int address, int count) {
+    fprintf(ctx->err, "[Memory Error] Attempted to %s invalid memory block of %d words at address %d.\n", access, count, address);
+}
+// Words a block instruction is about to move, set or compare; 0 when it will fault.
+static int block_length(const CpuContext* ctx, const DecodedInstruction* insn) {
+    int count = ctx->registers.regs[insn->operand];
+    if (!block_fits(ctx, ctx->registers.regs[insn->reg1], count)) return 0;
+    return insn->opcode == OP_MEMSET || block_fits(ctx, ctx->registers.regs[insn->reg2], count) ? count : 0;
+}
+// memcmp() finds the chunk that differs with the library's vector code, but its byte order says
+// nothing about signed words, so the chunk is then scanned for the first one.
+static int compare_words(const int* a, const int* b, int count) {
+    int i = 0;
+    for (int n; i < count; i += n) {
+        n = count - i < 64 ? count - i : 64;
+        if (memcmp(a + i, b + i, n * sizeof(int)) != 0) break;
+    }
+    for (; i < count; i++) {
+        if (a[i] != b[i]) return (a[i] > b[i]) - (a[i] < b[i]);
+    }
+    return 0;
+}
+#define WRAPS(ctx, address, count) ((ctx)->masked_addresses && (count) > (ctx)->memory_size - ((address) & (ctx)->memory_mask))
+#define MASKED(ctx, address) ((ctx)->memory[(address) & (ctx)->memory_mask])
+static int op_memcpy(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int to = ctx->registers.regs[insn->reg1], from = ctx->registers.regs[insn->reg2], count = ctx->registers.regs[insn->operand];
+    if (!block_fits(ctx, to, count)) { block_fault(ctx, "write to", to, count); return pc + 1; }
+    if (!block_fits(ctx, from, count)) { block_fault(ctx, "read", from, count); return pc + 1; }
+    mark_dirty_block(ctx, to, count);
+    if (WRAPS(ctx, to, count) || WRAPS(ctx, from, count)) {
+        if (((to - from) & ctx->memory_mask) >= count) { for (int i = 0; i < count; i++) MASKED(ctx, to + i) = MASKED(ctx, from + i); }
+        else { for (int i = count - 1; i >= 0; i--) MASKED(ctx, to + i) = MASKED(ctx, from + i); }
+    } else if (count > 0) {
+        if (ctx->masked_addresses) { to &= ctx->memory_mask; from &= ctx->memory_mask; }
+        memmove(ctx->memory + to, ctx->memory + from, count * sizeof(int));
+    }
+    return pc + 1;
+}
+static int op_memset(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int to = ctx->registers.regs[insn->reg1], value = ctx->registers.regs[insn->reg2], count = ctx->registers.regs[insn->operand];
+    if (!block_fits(ctx, to, count)) { block_fault(ctx, "write to", to, count); return pc + 1; }
+    mark_dirty_block(ctx, to, count);
+    if (WRAPS(ctx, to, count)) {
+        for (int i = 0; i < count; i++) MASKED(ctx, to + i) = value;
         return pc + 1;
     }
+    int* block = ctx->memory + (ctx->masked_addresses ? to & ctx->memory_mask : to);
+    for (int i = 0; i < count; i++) block[i] = value;
+    return pc + 1;
+}
+static int op_memcmp(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    int a = ctx->registers.regs[insn->reg1], b = ctx->registers.regs[insn->reg2], count = ctx->registers.regs[insn->operand];
+    if (!block_fits(ctx, a, count)) { block_fault(ctx, "read", a, count); return pc + 1; }
+    if (!block_fits(ctx, b, count)) { block_fault(ctx, "read", b, count); return pc + 1; }
+    int result = 0;
+    if (WRAPS(ctx, a, count) || WRAPS(ctx, b, count)) {
+        for (int i = 0; i < count && result == 0; i++) result = (MASKED(ctx, a + i) > MASKED(ctx, b + i)) - (MASKED(ctx, a + i) < MASKED(ctx, b + i));
+    } else {
+        if (ctx->masked_addresses) { a &= ctx->memory_mask; b &= ctx->memory_mask; }
+        result = compare_words(ctx->memory + a, ctx->memory + b, count);
+    }
+    ctx->flags.result = result; // Like CMP of the first words that differ: JL when block a is lower.
+    return pc + 1;
+}
+#undef MASKED
+#undef WRAPS
+
+// Absolute accesses the load-time verifier proved to be in range
+static int op_load_unchecked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = ctx->memory[insn->operand]; return pc + 1; }
+static int op_store_unchecked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->memory[insn->operand] = ctx->registers.regs[insn->reg1]; MARK_DIRTY(ctx, insn->operand); return pc + 1; }
+
+// --mask-addresses: stack and base+offset addresses wrap around a power-of-two memory
+#define MASKED(ctx, address) ((ctx)->memory[(address) & (ctx)->memory_mask])
+static inline void store_masked(CpuContext* ctx, int address, int value) {
+    address &= ctx->memory_mask;
+    ctx->memory[address] = value;
+    MARK_DIRTY(ctx, address);
+}
+static int op_push_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.ESP--; store_masked(ctx, ctx->registers.ESP, ctx->registers.regs[insn->reg1]); return pc + 1; }
+static int op_pop_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = MASKED(ctx, ctx->registers.ESP); ctx->registers.ESP++; return pc + 1; }
+static int op_call_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.ESP--; store_masked(ctx, ctx->registers.ESP, pc + 1); return insn->operand; }
+static int op_ret_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { int ret_addr = MASKED(ctx, ctx->registers.ESP); ctx->registers.ESP++; return ret_addr; }
+static int op_load_indexed_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { ctx->registers.regs[insn->reg1] = MASKED(ctx, ctx->registers.regs[insn->reg2] + insn->operand); return pc + 1; }
+static int op_store_indexed_masked(CpuContext* ctx, const DecodedInstruction* insn, int pc) { store_masked(ctx, ctx->registers.regs[insn->reg2] + insn->operand, ctx->registers.regs[insn->reg1]); return pc + 1; }
+#undef MASKED
+
+// --budget/--deadline: control transfers that charge the watchdog's fuel for each backward
+// branch, since only those can repeat code. The decoder switches to them when a limit is set.
+static int watchdog_expired(CpuContext* ctx, int target);
+static inline int branch_to(CpuContext* ctx, int pc, int target) {
+    if (target <= pc && (ctx->watchdog.fuel -= pc - target + 1) < 0) return watchdog_expired(ctx, target);
+    return target;
+}
+#define WATCHED(base) \
+    static int base##_watched(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return branch_to(ctx, pc, base(ctx, insn, pc)); }
+WATCHED(op_jmp) WATCHED(op_je) WATCHED(op_jne) WATCHED(op_jg) WATCHED(op_jl) WATCHED(op_jge) WATCHED(op_jle)
+WATCHED(op_call) WATCHED(op_ret) WATCHED(op_call_masked) WATCHED(op_ret_masked)
+#undef WATCHED
+
+// --memoize: CALLs of routines the decoder proved pure look their result up (see Memoization).
+static int call_memoized(CpuContext* ctx, const DecodedInstruction* insn, int pc, int watched);
+static int op_call_memo(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return call_memoized(ctx, insn, pc, 0); }
+static int op_call_memo_watched(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return call_memoized(ctx, insn, pc, 1); }
+
+// Superinstructions: one dispatch for a sequence the decoder fused (see fusion_table). insn is the
+// first instruction of the sequence and the rest follow it, so each part runs its own handler
+// inline; only the last part may branch.
+#define FUSE2(name, a, b) \
+    static int name(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return b(ctx, insn + 1, a(ctx, insn, pc)); }
+#define FUSE3(name, a, b, c) \
+    static int name(CpuContext* ctx, const DecodedInstruction* insn, int pc) { return c(ctx, insn + 2, b(ctx, insn + 1, a(ctx, insn, pc))); }
+FUSE2(op_cmp_imm_je, op_cmp_imm, op_je)   FUSE2(op_cmp_imm_jne, op_cmp_imm, op_jne) FUSE2(op_cmp_imm_jg, op_cmp_imm, op_jg)
+FUSE2(op_cmp_imm_jl, op_cmp_imm, op_jl)   FUSE2(op_cmp_imm_jge, op_cmp_imm, op_jge) FUSE2(op_cmp_imm_jle, op_cmp_imm, op_jle)
+FUSE2(op_cmp_je, op_cmp, op_je)           FUSE2(op_cmp_jne, op_cmp, op_jne)         FUSE2(op_cmp_jg, op_cmp, op_jg)
+FUSE2(op_cmp_jl, op_cmp, op_jl)           FUSE2(op_cmp_jge, op_cmp, op_jge)         FUSE2(op_cmp_jle, op_cmp, op_jle)
+FUSE3(op_dec_cmp_imm_jne, op_dec, op_cmp_imm, op_jne)
+FUSE3(op_inc_cmp_imm_jne, op_inc, op_cmp_imm, op_jne)
+FUSE2(op_push_mov_reg, op_push, op_mov_reg)
+#undef FUSE3
+#undef FUSE2
+
+// Every handler in handler-id order; the first DECODED_OPCODE_COUNT ids line up with the opcodes.
+// The second column marks handlers that can leave the program (halt, error or a computed RET
+// target), which are the only ones the threaded engine has to range-check.
+#define HANDLER_LIST(X) \
+    X(op_hlt, 1) X(op_mul, 0) X(op_div, 1) X(op_xor, 0)                                   /* 0b00000 - 0b00011 */ \
+    X(op_inp, 0) X(op_out, 0) X(op_mov_imm, 0) X(op_load, 0)                              /* 0b00100 - 0b00111 */ \
+    X(op_store, 0) X(op_inc, 0) X(op_dec, 0) X(op_push, 0)                                /* 0b01000 - 0b01011 */ \
+    X(op_pop, 0) X(op_call, 0) X(op_ret, 1) X(op_load_indexed, 0)                         /* 0b01100 - 0b01111 */ \
+    X(op_add, 0) X(op_sub, 0) X(op_mov_reg, 0) X(op_add_imm, 0)                           /* 0b10000 - 0b10011 */ \
+    X(op_sub_imm, 0) X(op_cmp_imm, 0) X(op_not, 0) X(op_cmp, 0)                           /* 0b10100 - 0b10111 */ \
+    X(op_jmp, 0) X(op_je, 0) X(op_jne, 0) X(op_jg, 0)                                     /* 0b11000 - 0b11011 */ \
+    X(op_jl, 0) X(op_jge, 0) X(op_jle, 0) X(op_store_indexed, 0)                          /* 0b11100 - 0b11111 */ \
+    X(op_memcpy, 0) X(op_memset, 0) X(op_memcmp, 0)                                       /* Block instructions */ \
+    X(op_load_unchecked, 0) X(op_store_unchecked, 0)                                      /* Verified absolute accesses */ \
+    X(op_push_masked, 0) X(op_pop_masked, 0) X(op_call_masked, 0) X(op_ret_masked, 1)     /* --mask-addresses */ \
+    X(op_load_indexed_masked, 0) X(op_store_indexed_masked, 0)                            \
+    X(op_jmp_watched, 0) X(op_je_watched, 0) X(op_jne_watched, 0) X(op_jg_watched, 0)     /* --budget/--deadline */ \
+    X(op_jl_watched, 0) X(op_jge_watched, 0) X(op_jle_watched, 0)                         \
+    X(op_call_watched, 0) X(op_ret_watched, 1) X(op_call_masked_watched, 0) X(op_ret_masked_watched, 1) \
+    X(op_call_memo, 1) X(op_call_memo_watched, 1)                                         /* --memoize */ \
+    X(op_cmp_imm_je, 0) X(op_cmp_imm_jne, 0) X(op_cmp_imm_jg, 0)                          /* Superinstructions */ \
+    X(op_cmp_imm_jl, 0) X(op_cmp_imm_jge, 0) X(op_cmp_imm_jle, 0)                         \
+    X(op_cmp_je, 0) X(op_cmp_jne, 0) X(op_cmp_jg, 0) X(op_cmp_jl, 0) X(op_cmp_jge, 0) X(op_cmp_jle, 0) \
+    X(op_dec_cmp_imm_jne, 0) X(op_inc_cmp_imm_jne, 0) X(op_push_mov_reg, 0)
+
+#define AS_HANDLER(fn, exits) fn,
+static const InstructionHandler handler_table[] = { HANDLER_LIST(AS_HANDLER) };
+#undef AS_HANDLER
+
+// Handler ids past the opcode range, for the decoder to pick specialized handlers by name.
+#define AS_HANDLER_ID(fn, exits) id_##fn,
+enum { HANDLER_LIST(AS_HANDLER_ID) HANDLER_COUNT };
+#undef AS_HANDLER_ID
+#define FIRST_FUSED_HANDLER id_op_cmp_imm_je // Ids from here on run several instructions.
+
+// The plain CALL handler a memoized one stands in for, for loops that must see every call.
+static int unmemoized_handler(int handler) {
+    if (handler == id_op_call_memo) return id_op_call;
+    if (handler == id_op_call_memo_watched) return id_op_call_watched;
+    return handler;
+}
+
+// The handler that runs just this instruction, for engines that must see every instruction.
+static int unfused_handler(const DecodedInstruction* insn) {
+    return insn->handler >= FIRST_FUSED_HANDLER ? insn->opcode : unmemoized_handler(insn->handler);
+}
+
+// --- Execution Engines ---
+// Reference engine: one indirect call per instruction, with the PC range-checked every step.
+static void run_call_engine(CpuContext* ctx, int pc) {
+    while (pc >= 0 && pc < ctx->program_instruction_count) {
+        int next_pc = execute_instruction(ctx, &ctx->decoded_program[pc], pc);
+        pc = next_pc;
+    }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+#ifdef HAVE_COMPUTED_GOTO
+// Direct-threaded engine: each slot holds the address of its handler's label, and every handler
+// ends in its own indirect jump. Branch targets past the end of the program are clamped to the
+// terminal slot by decode_program(), so only the handlers flagged in HANDLER_LIST check the PC.
+static void run_threaded_engine(CpuContext* ctx, int pc) {
+#define AS_LABEL(fn, exits) &&L_##fn,
+    static const void* const handler_labels[] = { HANDLER_LIST(AS_LABEL) };
+#undef AS_LABEL
+    const DecodedInstruction* decoded_program = ctx->decoded_program;
+    const int program_instruction_count = ctx->program_instruction_count;
+    const void** threaded_code = malloc((program_instruction_count + 1) * sizeof(void*));
+    if (threaded_code == NULL) {
+        run_call_engine(ctx, pc);
+        return;
+    }
+
+    for (int i = 0; i < program_instruction_count; i++) {
+        threaded_code[i] = handler_labels[decoded_program[i].handler];
+    }
+    threaded_code[program_instruction_count] = &&L_end;
+
+    if (pc < 0 || pc >= program_instruction_count) goto L_end;
+    goto *threaded_code[pc];
+
+#define AS_BODY(fn, exits)                                                          \
+    L_##fn:                                                                         \
+        pc = fn(ctx, &decoded_program[pc], pc);                                      \
+        if ((exits) && (pc < 0 || pc >= program_instruction_count)) goto L_end;   \
+        goto *threaded_code[pc];
+    HANDLER_LIST(AS_BODY)
+#undef AS_BODY
+
+L_end:
+    free(threaded_code);
+}
+#endif
+
+#ifdef HAVE_JIT
+// --- JIT Compiler (x86-64) ---
+// Translates basic blocks into host code the first time they run. Inside translated code the guest
+// registers EAX..ESP are pinned in r8d..r15d, rbx points at memory[], rbp at the register file, rdi
+// at the dirty page map, and esi holds Flags.result, the lazy flags of the interpreters, so a CMP
+// is a native sub and a jump a native test and branch on it. Blocks jump straight to each other
+// once both are translated. Instructions it does not translate (INP, OUT, HLT) and accesses that
+// would fault leave through a side exit and run in their normal handler, which keeps error
+// reporting identical to the interpreters.
+#define JIT_CODE_SIZE (1 << 20)      // Bytes of executable memory reserved for translated code.
+#define JIT_MAX_BLOCK_LENGTH 64      // Longest run of instructions translated as one block.
+#define JIT_MAX_BLOCK_BYTES 4096     // Upper bound on the host code emitted for one block.
+#define JIT_MAX_PATCH_SITES 4096     // Block exits that can wait at once for their target.
+#define JIT_INTERPRET 0x40000000     // Flag in a block result: run this PC's handler, then resume.
+#define JIT_WATCHDOG 0x20000000      // Flag in a block result: fuel ran out on the way to this PC.
+#define JIT_FUEL_OFFSET ((int)(offsetof(CpuContext, watchdog.fuel) - offsetof(CpuContext, registers))) // From rbp.
+#define JIT_DIRTY_OFFSET ((int)(offsetof(CpuContext, dirty) - offsetof(CpuContext, registers)))    // From rbp.
+
+// Host register numbers, as used in ModRM/REX encodings.
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R8 = 8 };
+#define GUEST_REG(r) (R8 + (r)) // Guest register r lives in host register r8 + r.
+
+typedef int (*JitEntry)(Registers* regs, int* mem, Flags* flags, const uint8_t* block);
+
+typedef struct JitState {
+    uint8_t* code;                          // Executable buffer holding the trampoline and blocks.
+    uint8_t* cursor;                        // Next free byte in the buffer.
+    JitEntry enter;                         // Loads guest state and jumps to a block.
+    uint8_t* exit;                          // Spills guest state and returns eax to the caller.
+    uint8_t* blocks;                        // Where translated blocks start, after the trampoline.
+    uint8_t** block_entry;                  // Translated block starting at each PC, or NULL.
+    int block_capacity;                     // Slots in block_entry.
+    struct {
+        uint8_t* site;                      // A `mov eax, target; jmp exit` waiting to be chained.
+        int target;
+    } patch_sites[JIT_MAX_PATCH_SITES];
+    int patch_site_count;
+    int unavailable;                        // Set when executable memory could not be mapped.
+} JitState;
+
+static void emit8(JitState* jit, int byte) { *jit->cursor++ = (uint8_t)byte; }
+static void emit32(JitState* jit, int32_t value) { memcpy(jit->cursor, &value, 4); jit->cursor += 4; }
+
+static void emit_rex(JitState* jit, int reg, int index, int base) {
+    int rex = 0x40 | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40) emit8(jit, rex);
+}
+
+static void emit_opcode(JitState* jit, int opcode) {
+    if (opcode > 0xFF) emit8(jit, opcode >> 8); // Two-byte opcodes are written as 0x0Fxx.
+    emit8(jit, opcode & 0xFF);
+}
+
+// 32-bit operation with a register-direct ModRM operand.
+static void emit_rr(JitState* jit, int opcode, int reg, int rm) {
+    emit_rex(jit, reg, 0, rm);
+    emit_opcode(jit, opcode);
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// 32-bit operation on [base + index * (1 << scale) + disp]; index < 0 means no index register.
+static void emit_mem(JitState* jit, int opcode, int reg, int base, int index, int scale, int32_t disp) {
+    int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+    emit_rex(jit, reg, index < 0 ? 0 : index, base);
+    emit_opcode(jit, opcode);
+    if (index >= 0 || (base & 7) == RSP) {
+        emit8(jit, (mod << 6) | ((reg & 7) << 3) | 4);
+        emit8(jit, (scale << 6) | (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    } else {
+        emit8(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    }
+    if (mod == 1) emit8(jit, disp);
+    else if (mod == 2) emit32(jit, disp);
+}
+
+static void emit_mov_imm(JitState* jit, int reg, int32_t value) {
+    emit_rex(jit, 0, 0, reg);
+    emit8(jit, 0xB8 + (reg & 7));
+    emit32(jit, value);
+}
+
+// Emits a rel32 conditional jump and returns the end of it, for patch_rel32().
+static uint8_t* emit_jcc(JitState* jit, int cc) {
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 | cc);
+    emit32(jit, 0);
+    return jit->cursor;
+}
+
+static void patch_rel32(uint8_t* jump_end, const uint8_t* target) {
+    int32_t rel = (int32_t)(target - jump_end);
+    memcpy(jump_end - 4, &rel, 4);
+}
+
+static void emit_jmp(JitState* jit, const uint8_t* target) {
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    patch_rel32(jit->cursor, target);
+}
+
+// Leaves translated code, returning `result` from the trampoline.
+static void emit_exit(JitState* jit, int result) {
+    emit_mov_imm(jit, RAX, result);
+    emit_jmp(jit, jit->exit);
+}
+
+// Marks a page dirty after a store, as MARK_DIRTY() does: `page`, or the page of the word in eax
+// when it is -1, which clobbers eax.
+static void emit_mark_dirty(JitState* jit, int page) {
+    if (page >= 0) {
+        emit_mem(jit, 0xC6, 0, RDI, -1, 0, page); emit8(jit, 1);                 // mov byte [rdi + page], 1
+        return;
+    }
+    emit_rr(jit, 0xC1, 5, RAX); emit8(jit, DIRTY_PAGE_SHIFT);                    // shr eax, shift
+    emit_mem(jit, 0xC6, 0, RDI, RAX, 0, 0); emit8(jit, 1);                       // mov byte [rdi + rax], 1
+}
+
+static int jit_translatable(const CpuContext* ctx, int pc);
+
+// Continues at `target`: a direct jump when that block exists, otherwise an exit that
+// jit_translate_block() rewrites into a direct jump once the target has been translated.
+static void emit_chain(CpuContext* ctx, int target) {
+    JitState* jit = ctx->jit;
+    if (jit->block_entry[target] != NULL) {
+        emit_jmp(jit, jit->block_entry[target]);
+        return;
+    }
+    if (jit_translatable(ctx, target) && jit->patch_site_count < JIT_MAX_PATCH_SITES) {
+        jit->patch_sites[jit->patch_site_count].site = jit->cursor;
+        jit->patch_sites[jit->patch_site_count].target = target;
+        jit->patch_site_count++;
+    }
+    emit_exit(jit, target);
+}
+
+// Continues at a branch target like emit_chain(), first charging the watchdog's fuel for a
+// backward branch the way branch_to() does.
+static void emit_branch(CpuContext* ctx, int pc, int target) {
+    JitState* jit = ctx->jit;
+    if (!ctx->watchdog.enabled || target > pc) {
+        emit_chain(ctx, target);
+        return;
+    }
+    emit_mem(jit, 0x81, 5, RBP, -1, 0, JIT_FUEL_OFFSET); emit32(jit, pc - target + 1);   // sub dword [rbp + fuel], n
+    uint8_t* expired = emit_jcc(jit, 0xC);                                               // jl
+    emit_chain(ctx, target);
+    patch_rel32(expired, jit->cursor);
+    emit_exit(jit, target | JIT_WATCHDOG);
+}
+
+static int jit_reset(CpuContext* ctx);
+static void jit_destroy(CpuContext* ctx);
+
+// Maps the context's code buffer and builds the trampoline, jit->enter(regs, mem, flags, block),
+// and the shared exit path. Returns 0 if no executable memory is available.
+static int jit_init(CpuContext* ctx) {
+    if (ctx->jit != NULL) return 1;
+
+    void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return 0;
+    JitState* jit = calloc(1, sizeof(JitState));
+    if (jit == NULL) {
+        munmap(code, JIT_CODE_SIZE);
+        return 0;
+    }
+    ctx->jit = jit;
+    jit->code = jit->cursor = code;
+    jit->enter = (JitEntry)(void*)jit->cursor;
+
+    emit8(jit, 0x53); emit8(jit, 0x55);                             // push rbx; push rbp
+    emit8(jit, 0x41); emit8(jit, 0x54); emit8(jit, 0x41); emit8(jit, 0x55);   // push r12; push r13
+    emit8(jit, 0x41); emit8(jit, 0x56); emit8(jit, 0x41); emit8(jit, 0x57);   // push r14; push r15
+    emit8(jit, 0x52);                                          // push rdx (flags)
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xFD);                // mov rbp, rdi
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xF3);                // mov rbx, rsi
+    emit8(jit, 0x48); emit_mem(jit, 0x8B, RDI, RBP, -1, 0, JIT_DIRTY_OFFSET);   // mov rdi, [rbp + dirty]
+
+    emit_mem(jit, 0x8B, RSI, RDX, -1, 0, offsetof(Flags, result));         // mov esi, [rdx+result]
+
+    for (int r = 0; r < NUM_REGISTERS; r++) emit_mem(jit, 0x8B, GUEST_REG(r), RBP, -1, 0, r * (int)sizeof(int));
+    emit8(jit, 0xFF); emit8(jit, 0xE1);                             // jmp rcx
+
+    jit->exit = jit->cursor;
+    for (int r = 0; r < NUM_REGISTERS; r++) emit_mem(jit, 0x89, GUEST_REG(r), RBP, -1, 0, r * (int)sizeof(int));
+    emit8(jit, 0x5A);                                          // pop rdx (flags)
+    emit_mem(jit, 0x89, RSI, RDX, -1, 0, offsetof(Flags, result));         // mov [rdx+result], esi
+    emit8(jit, 0x41); emit8(jit, 0x5F); emit8(jit, 0x41); emit8(jit, 0x5E);   // pop r15; pop r14
+    emit8(jit, 0x41); emit8(jit, 0x5D); emit8(jit, 0x41); emit8(jit, 0x5C);   // pop r13; pop r12
+    emit8(jit, 0x5D); emit8(jit, 0x5B);                             // pop rbp; pop rbx
+    emit8(jit, 0xC3);                                          // ret
+    jit->blocks = jit->cursor;
+    if (!jit_reset(ctx)) {
+        jit_destroy(ctx);
+        return 0;
+    }
+    return 1;
+}
+
+// Drops every translated block, e.g. after a new program has been loaded into the context.
+// Returns 0 if block_entry[] could not grow to the new program's size.
+static int jit_reset(CpuContext* ctx) {
+    JitState* jit = ctx->jit;
+    if (jit == NULL) return 1;
+    if (jit->block_capacity < ctx->program_instruction_count + 1) {
+        uint8_t** block_entry = realloc(jit->block_entry, (ctx->program_instruction_count + 1) * sizeof(uint8_t*));
+        if (block_entry == NULL) return 0;
+        jit->block_entry = block_entry;
+        jit->block_capacity = ctx->program_instruction_count + 1;
+    }
+    memset(jit->block_entry, 0, jit->block_capacity * sizeof(uint8_t*));
+    jit->patch_site_count = 0;
+    jit->cursor = jit->blocks;
+    return 1;
+}
+
+static void jit_destroy(CpuContext* ctx) {
+    if (ctx->jit == NULL) return;
+    munmap(ctx->jit->code, JIT_CODE_SIZE);
+    free(ctx->jit->block_entry);
+    free(ctx->jit);
+    ctx->jit = NULL;
+}
+
+// Whether a block may start at (or continue through) this PC.
+static int jit_translatable(const CpuContext* ctx, int pc) {
+    if (pc < 0 || pc >= ctx->program_instruction_count) return 0;
+    const DecodedInstruction* insn = &ctx->decoded_program[pc];
+    switch (insn->opcode) {
+        case 0b00000: case 0b00100: case 0b00101: return 0; // HLT, INP and OUT always run in their handlers.
+        case OP_MEMCPY: case OP_MEMSET: case OP_MEMCMP: return 0; // So do the block instructions.
+        case 0b00111: case 0b01000: // Absolute accesses that always fault, or lie beyond a 32-bit displacement.
+            return (unsigned)insn->operand < (unsigned)ctx->memory_size && insn->operand <= INT32_MAX / 4;
+        case 0b01101: return insn->handler != id_op_call_memo && insn->handler != id_op_call_memo_watched;
+        default: return 1;
+    }
+}
+
+// Translates the block starting at start_pc and returns its entry, or NULL if the buffer is full.
+static uint8_t* jit_translate_block(CpuContext* ctx, int start_pc) {
+    JitState* jit = ctx->jit;
+    struct { uint8_t* jump_end; int pc; } faults[2 * JIT_MAX_BLOCK_LENGTH]; // DIV has two side exits.
+    int fault_count = 0;
 
-    // Decode the instruction's operands.
-    uint16_t reg1 = (instruction >> 8) & 0x07;
-    uint16_t reg2 = (instruction >> 5) & 0x07;
-    uint16_t value = instruction & 0xFF;
-    uint16_t addr = instruction & 0xFF;
-
-    // Dispatch the instruction based on its opcode.
-    switch (opcode) {
-        // System & Memory
-        case 0b00000: printf("--- HLT instruction at PC %d ---\n", pc); return -1;
-        case 0b00001: set_register_value(reg1, get_register_value(reg1) * get_register_value(reg2)); break;
-        case 0b00010: {
-            int divisor = get_register_value(reg2);
-            if (divisor == 0) {
-                fprintf(stderr, "[Runtime Error] Division by zero at PC %d.\n", pc);
-                return -1; // Halt on error.
-            }
-            set_register_value(reg1, get_register_value(reg1) / divisor);
+    if (jit->cursor + JIT_MAX_BLOCK_BYTES > jit->code + JIT_CODE_SIZE) return NULL;
+    uint8_t* entry = jit->cursor;
+
+// Branches to a side exit for `pc` unless eax holds a valid memory address (or, with
+// --mask-addresses, wraps eax into memory).
+#define EMIT_BOUNDS_CHECK(pc)                                            \
+    do {                                                                 \
+        if (ctx->masked_addresses) {                                     \
+            emit_rr(jit, 0x81, 4, RAX); emit32(jit, ctx->memory_mask); /* and eax, mask */\
+            break;                                                       \
+        }                                                                \
+        emit_rr(jit, 0x81, 7, RAX); emit32(jit, ctx->memory_size); /* cmp eax, size */\
+        faults[fault_count].jump_end = emit_jcc(jit, 0x3); /* jae */          \
+        faults[fault_count].pc = (pc);                                   \
+        fault_count++;                                                   \
+    } while (0)
+
+    int pc = start_pc;
+    for (int length = 0; ; length++, pc++) {
+        if (length == JIT_MAX_BLOCK_LENGTH || !jit_translatable(ctx, pc)) {
+            emit_chain(ctx, pc);
             break;
         }
-        case 0b00011: set_register_value(reg1, get_register_value(reg1) ^ get_register_value(reg2)); break;
-        case 0b00100: {
-            int input_val;
-            printf("INPUT required for register %s: ", register_names[reg1]);
-            if (scanf("%d", &input_val) != 1) {
-                fprintf(stderr, "[Runtime Error] Invalid integer input.\n");
-                while (getchar() != '\n'); set_register_value(reg1, 0);
-            } else {
-                set_register_value(reg1, input_val);
-                while (getchar() != '\n');
+
+        const DecodedInstruction* insn = &ctx->decoded_program[pc];
+        int r1 = GUEST_REG(insn->reg1), r2 = GUEST_REG(insn->reg2);
+        int esp = GUEST_REG(7);
+        int ends_block = 0;
+
+        switch (insn->opcode) {
+            case 0b00001: emit_rr(jit, 0x0FAF, r1, r2); break;                     // imul r1, r2
+            case 0b00010:                                                       // DIV
+                emit_rr(jit, 0x89, r2, RCX);                                         // mov ecx, r2
+                emit_rr(jit, 0x85, RCX, RCX);                                        // test ecx, ecx
+                faults[fault_count].jump_end = emit_jcc(jit, 0x4);                   // jz: division by zero
+                faults[fault_count++].pc = pc;
+                emit_rr(jit, 0x81, 7, RCX); emit32(jit, -1);                              // cmp ecx, -1
+                faults[fault_count].jump_end = emit_jcc(jit, 0x4);                   // je: leave INT_MIN / -1 to C
+                faults[fault_count++].pc = pc;
+                emit_rr(jit, 0x89, r1, RAX);                                         // mov eax, r1
+                emit8(jit, 0x99);                                                    // cdq
+                emit_rr(jit, 0xF7, 7, RCX);                                          // idiv ecx
+                emit_rr(jit, 0x89, RAX, r1);                                         // mov r1, eax
+                break;
+            case 0b00011: emit_rr(jit, 0x31, r2, r1); break;                         // xor r1, r2
+            case 0b00110: emit_mov_imm(jit, r1, insn->operand); break;
+            case 0b00111: emit_mem(jit, 0x8B, r1, RBX, -1, 0, insn->operand * 4); break;
+            case 0b01000:
+                emit_mem(jit, 0x89, r1, RBX, -1, 0, insn->operand * 4);
+                emit_mark_dirty(jit, insn->operand >> DIRTY_PAGE_SHIFT);
+                break;
+            case 0b01001: emit_rr(jit, 0xFF, 0, r1); break;                          // inc r1
+            case 0b01010: emit_rr(jit, 0xFF, 1, r1); break;                          // dec r1
+            case 0b01011:                                                       // PUSH
+                // ESP moves before a masked access, but only once a checked one can't fault.
+                emit_mem(jit, 0x8D, RAX, esp, -1, 0, -1);                            // lea eax, [esp - 1]
+                if (ctx->masked_addresses) emit_rr(jit, 0x89, RAX, esp);
+                EMIT_BOUNDS_CHECK(pc);
+                if (!ctx->masked_addresses) emit_rr(jit, 0x89, RAX, esp);
+                emit_mem(jit, 0x89, r1, RBX, RAX, 2, 0);
+                emit_mark_dirty(jit, -1);
+                break;
+            case 0b01100:                                                       // POP
+                emit_rr(jit, 0x89, esp, RAX);
+                EMIT_BOUNDS_CHECK(pc);
+                emit_mem(jit, 0x8B, r1, RBX, RAX, 2, 0);
+                emit_rr(jit, 0xFF, 0, esp);
+                break;
+            case 0b01101:                                                       // CALL
+                emit_mem(jit, 0x8D, RAX, esp, -1, 0, -1);
+                if (ctx->masked_addresses) emit_rr(jit, 0x89, RAX, esp);
+                EMIT_BOUNDS_CHECK(pc);
+                if (!ctx->masked_addresses) emit_rr(jit, 0x89, RAX, esp);
+                emit_mem(jit, 0xC7, 0, RBX, RAX, 2, 0); emit32(jit, pc + 1);              // mov dword [mem + eax*4], pc + 1
+                emit_mark_dirty(jit, -1);
+                emit_branch(ctx, pc, insn->operand);
+                ends_block = 1;
+                break;
+            case 0b01110: {                                                     // RET
+                emit_rr(jit, 0x89, esp, RAX);
+                EMIT_BOUNDS_CHECK(pc);
+                emit_mem(jit, 0x8B, RCX, RBX, RAX, 2, 0);                            // mov ecx, [mem + eax*4]
+                emit_rr(jit, 0xFF, 0, esp);
+                // Jump through block_entry[] when the return address has been translated.
+                emit_rr(jit, 0x81, 7, RCX); emit32(jit, ctx->program_instruction_count);
+                uint8_t* out_of_range = emit_jcc(jit, 0x3);                          // jae
+                if (ctx->watchdog.enabled) {
+                    // Charge fuel for a return to or before this PC, as branch_to() does.
+                    emit_mov_imm(jit, RAX, pc + 1);
+                    emit_rr(jit, 0x29, RCX, RAX);                                    // sub eax, ecx
+                    uint8_t* forward = emit_jcc(jit, 0xE);                           // jle
+                    emit_mem(jit, 0x29, RAX, RBP, -1, 0, JIT_FUEL_OFFSET);           // sub [rbp + fuel], eax
+                    uint8_t* fueled = emit_jcc(jit, 0xD);                            // jge
+                    emit_rr(jit, 0x89, RCX, RAX);                                    // mov eax, ecx
+                    emit_rr(jit, 0x81, 1, RAX); emit32(jit, JIT_WATCHDOG);           // or eax, JIT_WATCHDOG
+                    emit_jmp(jit, jit->exit);
+                    patch_rel32(forward, jit->cursor);
+                    patch_rel32(fueled, jit->cursor);
+                }
+                emit8(jit, 0x48); emit8(jit, 0xB8);                                       // movabs rax, block_entry
+                uintptr_t table = (uintptr_t)jit->block_entry;
+                memcpy(jit->cursor, &table, 8); jit->cursor += 8;
+                emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x04); emit8(jit, 0xC8);             // mov rax, [rax + rcx*8]
+                emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC0);                          // test rax, rax
+                uint8_t* untranslated = emit_jcc(jit, 0x4);                          // jz
+                emit8(jit, 0xFF); emit8(jit, 0xE0);                                       // jmp rax
+                patch_rel32(untranslated, jit->cursor);
+                emit_rr(jit, 0x89, RCX, RAX);                                        // mov eax, ecx
+                emit_jmp(jit, jit->exit);
+                patch_rel32(out_of_range, jit->cursor);
+                emit_exit(jit, ctx->program_instruction_count);
+                ends_block = 1;
+                break;
+            }
+            case 0b01111:                                                       // MOV reg, [reg+off]
+                emit_mem(jit, 0x8D, RAX, r2, -1, 0, insn->operand);
+                EMIT_BOUNDS_CHECK(pc);
+                emit_mem(jit, 0x8B, r1, RBX, RAX, 2, 0);
+                break;
+            case 0b11111:                                                       // MOV [reg+off], reg
+                emit_mem(jit, 0x8D, RAX, r2, -1, 0, insn->operand);
+                EMIT_BOUNDS_CHECK(pc);
+                emit_mem(jit, 0x89, r1, RBX, RAX, 2, 0);
+                emit_mark_dirty(jit, -1);
+                break;
+            case 0b10000: emit_rr(jit, 0x01, r2, r1); break;                         // add r1, r2
+            case 0b10001: emit_rr(jit, 0x29, r2, r1); break;                         // sub r1, r2
+            case 0b10010: emit_rr(jit, 0x89, r2, r1); break;                         // mov r1, r2
+            case 0b10011: emit_rr(jit, 0x81, 0, r1); emit32(jit, insn->operand); break;   // add r1, imm
+            case 0b10100: emit_rr(jit, 0x81, 5, r1); emit32(jit, insn->operand); break;   // sub r1, imm
+            case 0b10101:                                                       // CMP reg, imm
+                emit_rr(jit, 0x89, r1, RSI);
+                emit_rr(jit, 0x81, 5, RSI); emit32(jit, insn->operand);
+                break;
+            case 0b10110: emit_rr(jit, 0xF7, 2, r1); break;                          // not r1
+            case 0b10111:                                                       // CMP reg, reg
+                emit_rr(jit, 0x89, r1, RSI);
+                emit_rr(jit, 0x29, r2, RSI);
+                break;
+            case 0b11000: emit_branch(ctx, pc, insn->operand); ends_block = 1; break; // JMP
+            default: {                                                          // Conditional jumps
+                // After `test esi, esi`, each guest condition is one signed x86 condition code;
+                // this table holds the inverse, which skips over the taken path.
+                static const int skip_cc[] = { 0x5, 0x4, 0xE, 0xD, 0xC, 0xF }; // JE JNE JG JL JGE JLE
+                emit_rr(jit, 0x85, RSI, RSI);
+                uint8_t* not_taken = emit_jcc(jit, skip_cc[insn->opcode - 0b11001]);
+                emit_branch(ctx, pc, insn->operand);
+                patch_rel32(not_taken, jit->cursor);
+                emit_chain(ctx, pc + 1);
+                ends_block = 1;
+                break;
             }
-            break;
-        }
-        case 0b00101: printf("OUTPUT from register %s: %d\n", register_names[reg1], get_register_value(reg1)); break;
-        case 0b00110: set_register_value(reg1, value); break;
-        case 0b00111: set_register_value(reg1, read_memory(addr)); break;
-        case 0b01000: write_memory(addr, get_register_value(reg1)); break;
-
-        // Arithmetic
-        case 0b01001: set_register_value(reg1, get_register_value(reg1) + 1); break;
-        case 0b01010: set_register_value(reg1, get_register_value(reg1) - 1); break;
-        case 0b10000: set_register_value(reg1, get_register_value(reg1) + get_register_value(reg2)); break;
-        case 0b10001: set_register_value(reg1, get_register_value(reg1) - get_register_value(reg2)); break;
-        case 0b10010: set_register_value(reg1, get_register_value(reg2)); break;
-
-        // Logical & Immediate Arithmetic
-        case 0b10011: set_register_value(reg1, get_register_value(reg1) + value); break;
-        case 0b10100: set_register_value(reg1, get_register_value(reg1) - value); break;
-        case 0b10101: {
-            int result = get_register_value(reg1) - value;
-            flags.ZF = (result == 0);
-            flags.SF = (result < 0);
-            break;
         }
-        case 0b10110: set_register_value(reg1, ~get_register_value(reg1)); break;
+        if (ends_block) break;
+    }
+#undef EMIT_BOUNDS_CHECK
 
-        // Comparison & Jumps
-        case 0b10111: {
-            int result = get_register_value(reg1) - get_register_value(reg2);
-            flags.ZF = (result == 0);
-            flags.SF = (result < 0);
-            break;
+    // Side exits hand the instruction to its handler with all guest state spilled.
+    for (int i = 0; i < fault_count; i++) {
+        patch_rel32(faults[i].jump_end, jit->cursor);
+        emit_exit(jit, faults[i].pc | JIT_INTERPRET);
+    }
+
+    jit->block_entry[start_pc] = entry;
+
+    // Chain every exit that was waiting for this block.
+    for (int i = 0; i < jit->patch_site_count; ) {
+        if (jit->patch_sites[i].target == start_pc) {
+            uint8_t* site = jit->patch_sites[i].site;
+            site[0] = 0xE9;
+            patch_rel32(site + 5, entry);
+            jit->patch_sites[i] = jit->patch_sites[--jit->patch_site_count];
+        } else {
+            i++;
         }
-        case 0b11000: return addr;
-        case 0b11001: if (flags.ZF) return addr; break;
-        case 0b11010: if (!flags.ZF) return addr; break;
-        case 0b11011: if (!flags.ZF && !flags.SF) return addr; break;
-        case 0b11100: if (flags.SF) return addr; break;
-        case 0b11101: if (!flags.SF) return addr; break;
-        case 0b11110: if (flags.ZF || flags.SF) return addr; break;
+    }
+    return entry;
+}
 
-        // Stack & Functions
-        case 0b01011: registers.ESP--; write_memory(registers.ESP, get_register_value(reg1)); break;
-        case 0b01100: set_register_value(reg1, read_memory(registers.ESP)); registers.ESP++; break;
-        case 0b01101: registers.ESP--; write_memory(registers.ESP, pc + 1); return addr;
-        case 0b01110: {
-            int ret_addr = read_memory(registers.ESP);
-            registers.ESP++;
-            return ret_addr;
+// Runs with translated blocks, interpreting whatever the JIT leaves to the handlers.
+static void run_jit_engine(CpuContext* ctx, int pc) {
+    JitState* jit = ctx->jit;
+    while (pc >= 0 && pc < ctx->program_instruction_count) {
+        uint8_t* block = jit->block_entry[pc];
+        if (block == NULL && jit_translatable(ctx, pc)) block = jit_translate_block(ctx, pc);
+        if (block == NULL) {
+            pc = execute_instruction(ctx, &ctx->decoded_program[pc], pc);
+            continue;
         }
 
-        default:
-            fprintf(stderr, "[Runtime Error] Unknown opcode 0x%X at PC %d.\n", opcode, pc);
-            return -1; // Halt on unknown instruction.
+        int result = jit->enter(&ctx->registers, ctx->memory, &ctx->flags, block);
+        if (result >= 0 && (result & JIT_WATCHDOG)) {
+            pc = watchdog_expired(ctx, result & ~JIT_WATCHDOG);
+        } else if (result >= 0 && (result & JIT_INTERPRET)) {
+            pc = result & ~JIT_INTERPRET;
+            pc = execute_instruction(ctx, &ctx->decoded_program[pc], pc);
+        } else {
+            pc = result;
+        }
     }
+}
+#endif
 
-    return pc + 1; // Advance to the next instruction.
+// --- Performance Counters ---
+// With --stats, programs run on this counting loop instead of the selected engine, so the other
+// engines carry no counting code at all. Memory traffic follows from the opcode histogram, and
+// from the words each block instruction covered.
+static const char* const opcode_names[DECODED_OPCODE_COUNT] = {
+    "HLT", "MUL", "DIV", "XOR", "INP", "OUT", "MOV_IMM", "LOAD",
+    "STORE", "INC", "DEC", "PUSH", "POP", "CALL", "RET", "LOAD_INDEXED",
+    "ADD", "SUB", "MOV_REG", "ADD_IMM", "SUB_IMM", "CMP_IMM", "NOT", "CMP",
+    "JMP", "JE", "JNE", "JG", "JL", "JGE", "JLE", "STORE_INDEXED",
+    "MEMCPY", "MEMSET", "MEMCMP",
+};
+// The block instructions' entries only mark their trace records; their traffic is block_words.
+static const uint8_t opcode_reads[DECODED_OPCODE_COUNT] = { [0b00111] = 1, [0b01100] = 1, [0b01110] = 1, [0b01111] = 1, [OP_MEMCMP] = 1 };
+static const uint8_t opcode_writes[DECODED_OPCODE_COUNT] = { [0b01000] = 1, [0b01011] = 1, [0b01101] = 1, [0b11111] = 1, [OP_MEMCPY] = 1, [OP_MEMSET] = 1 };
+
+static double wall_seconds() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
+static void run_counted(CpuContext* ctx, int pc) {
+    PerfCounters* c = &ctx->counters;
+    memset(c, 0, sizeof(*c));
+    c->lowest_esp = ctx->registers.ESP;
+    double start = wall_seconds();
 
-// --- Utility Functions ---
-int get_register_value(int reg_code) {
-    switch (reg_code) {
-        case 0: return registers.EAX;
-        case 1: return registers.EBX;
-        case 2: return registers.ECX;
-        case 3: return registers.EDX;
-        case 4: return registers.ESI;
-        case 5: return registers.EDI;
-        case 6: return registers.EBP;
-        case 7: return registers.ESP;
-        default: return 0;
-    }
-}
-
-void set_register_value(int reg_code, int value) {
-    switch (reg_code) {
-        case 0: registers.EAX = value; break;
-        case 1: registers.EBX = value; break;
-        case 2: registers.ECX = value; break;
-        case 3: registers.EDX = value; break;
-        case 4: registers.ESI = value; break;
-        case 5: registers.EDI = value; break;
-        case 6: registers.EBP = value; break;
-        case 7: registers.ESP = value; break;
-    }
-}
-
-void write_memory(int address, int data) {
-    if (address >= 0 && address < MEMORY_SIZE) {
-        memory[address] = data;
-    } else {
-        fprintf(stderr, "[Memory Error] Attempted to write to invalid memory address %d.\n", address);
+    while (pc >= 0 && pc < ctx->program_instruction_count) {
+        const DecodedInstruction* insn = &ctx->decoded_program[pc];
+        if (insn->opcode >= OPCODE_COUNT) c->block_words[insn->opcode - OP_MEMCPY] += block_length(ctx, insn);
+        int next_pc = handler_table[unfused_handler(insn)](ctx, insn, pc);
+        c->retired++;
+        c->opcode_count[insn->opcode]++;
+        if (insn->opcode >= 0b11000 && insn->opcode <= 0b11110 && next_pc != pc + 1) c->taken[insn->opcode]++;
+        if (ctx->registers.ESP < c->lowest_esp) c->lowest_esp = ctx->registers.ESP;
+        pc = next_pc;
     }
+    c->seconds = wall_seconds() - start;
 }
 
-int read_memory(int address) {
-    if (address >= 0 && address < MEMORY_SIZE) return memory[address];
-    fprintf(stderr, "[Memory Error] Attempted to read invalid memory address %d.\n", address);
-    return 0;
+// Prints the counters of the last run to the context's error stream.
+static void report_counters(CpuContext* ctx) {
+    const PerfCounters* c = &ctx->counters;
+    FILE* out = ctx->err;
+    const uint64_t* block = c->block_words; // MEMCPY, MEMSET, MEMCMP: each block word is a read or a write.
+    uint64_t reads = block[0] + 2 * block[2], writes = block[0] + block[1];
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        reads += c->opcode_count[op] * opcode_reads[op];
+        writes += c->opcode_count[op] * opcode_writes[op];
+    }
+    double mips = c->seconds > 0 ? c->retired / c->seconds / 1e6 : 0.0;
+    int stack_words = ctx->memory_size - c->lowest_esp;
+
+    if (stats_format == STATS_JSON) {
+        fprintf(out, "{\"retired\": %llu, \"seconds\": %.6f, \"mips\": %.2f, \"memory_reads\": %llu, \"memory_writes\": %llu, \"stack_high_water\": %d",
+            (unsigned long long)c->retired, c->seconds, mips, (unsigned long long)reads, (unsigned long long)writes, stack_words);
+        fprintf(out, ", \"opcodes\": {");
+        for (int op = 0, first = 1; op < DECODED_OPCODE_COUNT; op++) {
+            if (c->opcode_count[op] == 0) continue;
+            fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", opcode_names[op], (unsigned long long)c->opcode_count[op]);
+            first = 0;
+        }
+        fprintf(out, "}, \"branches\": {");
+        for (int op = 0b11000, first = 1; op <= 0b11110; op++) {
+            if (c->opcode_count[op] == 0) continue;
+            fprintf(out, "%s\"%s\": {\"taken\": %llu, \"not_taken\": %llu}", first ? "" : ", ", opcode_names[op],
+                (unsigned long long)c->taken[op], (unsigned long long)(c->opcode_count[op] - c->taken[op]));
+            first = 0;
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "--- Performance Counters ---\n");
+    fprintf(out, "Retired instructions: %llu in %.6f s (%.2f MIPS)\n", (unsigned long long)c->retired, c->seconds, mips);
+    fprintf(out, "Memory traffic:       %llu reads, %llu writes\n", (unsigned long long)reads, (unsigned long long)writes);
+    fprintf(out, "Stack high-water:     %d words\n", stack_words);
+    fprintf(out, "Opcode histogram:\n");
+    for (int op = 0; op < DECODED_OPCODE_COUNT; op++) {
+        if (c->opcode_count[op] == 0) continue;
+        fprintf(out, "  %-14s %12llu  %5.1f%%\n", opcode_names[op], (unsigned long long)c->opcode_count[op],
+            100.0 * c->opcode_count[op] / c->retired);
+    }
+    fprintf(out, "Branches:\n");
+    for (int op = 0b11000; op <= 0b11110; op++) {
+        if (c->opcode_count[op] == 0) continue;
+        fprintf(out, "  %-14s %12llu taken, %llu not taken\n", opcode_names[op],
+            (unsigned long long)c->taken[op], (unsigned long long)(c->opcode_count[op] - c->taken[op]));
+    }
+    fprintf(out, "----------------------------\n");
 }
 
-void dump_contents() {
-    printf("\n--- CPU State Dump ---\n");
-    printf("Registers: EAX=%-5d EBX=%-5d ECX=%-5d EDX=%-5d\n", registers.EAX, registers.EBX, registers.ECX, registers.EDX);
-    printf("           ESI=%-5d EDI=%-5d EBP=%-5d ESP=%-5d\n", registers.ESI, registers.EDI, registers.EBP, registers.ESP);
-    printf("Flags:     ZF=%d SF=%d\n", flags.ZF, flags.SF);
-    printf("Memory Contents (%d words):\n", MEMORY_SIZE);
-    for (int i = 0; i < MEMORY_SIZE; ++i) {
-        if (i % 8 == 0) printf("  [%02d]:", i);
-        printf(" %5d", memory[i]);
-        if ((i + 1) % 8 == 0 || i == MEMORY_SIZE - 1) printf("\n");
+// --- Watchdog ---
+// Gives the run an instruction budget and a deadline in seconds, 0 for none. Only a context
+// decoded with watched branches charges fuel (see watch_branches).
+static void arm_watchdog(CpuContext* ctx, long long budget, double deadline) {
+    Watchdog* w = &ctx->watchdog;
+    w->enabled = ctx->watched;
+    w->budget = budget > 0 ? budget : -1;
+    w->deadline = deadline > 0 ? wall_seconds() + deadline : 0.0;
+    w->fuel = 0; // The first backward branch fetches the first slice.
+    w->expired = 0;
+    w->stop_pc = -1;
+    w->granted = 0;
+}
+
+// Called by branch_to() when fuel runs out on the way to `target`. Returns target to carry on,
+// or the terminal PC to stop the run, which every engine treats as the end of the program.
+static int watchdog_expired(CpuContext* ctx, int target) {
+    Watchdog* w = &ctx->watchdog;
+    if (w->deadline > 0 && wall_seconds() >= w->deadline) {
+        w->expired = EXIT_DEADLINE;
+        w->stop_pc = target;
+        return ctx->program_instruction_count;
+    }
+    while (w->fuel < 0 && w->budget != 0) {
+        int grant = (w->budget < 0 || w->budget > WATCHDOG_SLICE) ? WATCHDOG_SLICE : (int)w->budget;
+        if (w->budget > 0) w->budget -= grant;
+        w->fuel += grant;
+        w->granted += grant;
+    }
+    if (w->fuel < 0) {
+        w->expired = EXIT_BUDGET;
+        w->stop_pc = target;
+        return ctx->program_instruction_count;
+    }
+    return target;
+}
+
+// Says why the watchdog stopped the run, if it did.
+static void report_watchdog(CpuContext* ctx) {
+    const Watchdog* w = &ctx->watchdog;
+    if (w->expired == EXIT_DEADLINE) {
+        fprintf(ctx->err, "[Watchdog] Deadline of %g s passed; stopped before PC %d.\n", run_deadline, w->stop_pc);
+    } else if (w->expired == EXIT_BUDGET) {
+        fprintf(ctx->err, "[Watchdog] Instruction budget of %lld exhausted; stopped before PC %d.\n", run_budget, w->stop_pc);
+    }
+}
+
+// --- Execution Trace ---
+// With --trace, programs run on this loop, which appends one fixed-size TraceRecord per
+// instruction to a preallocated ring. The engine thread is the ring's only writer, so it takes
+// no locks. Normally the ring is written to the trace file each time it fills, in blocks of
+// TRACE_RING_RECORDS. With --trace-ring=N it is a flight recorder instead: it wraps around, and
+// only the last N records are written when the program ends. tracedump turns the file back
+// into disassembly.
+#define TRACE_RING_RECORDS 65536    // Records per block written while streaming (1.25 MB).
+
+typedef struct {
+    TraceRecord* records;
+    size_t capacity;
+    size_t head;                    // The next slot to fill.
+    uint64_t total;                 // Records produced so far.
+    int wraps;                      // Flight recorder: overwrite old records instead of writing them.
+    int failed;                     // A write failed; the rest of the trace is dropped.
+    FILE* file;
+} TraceRing;
+
+static void trace_write(TraceRing* ring, const void* data, size_t size, size_t count) {
+    if (!ring->failed && fwrite(data, size, count, ring->file) != count) ring->failed = 1;
+}
+
+static void trace_write_header(TraceRing* ring, uint64_t first_record) {
+    TraceFileHeader header = { 0 };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.byte_order = TRACE_BYTE_ORDER;
+    header.first_record = first_record;
+    trace_write(ring, &header, sizeof(header), 1);
+}
+
+// The memory word an instruction is about to access, or -1 if it accesses none.
+static int trace_memory_address(const CpuContext* ctx, const DecodedInstruction* insn) {
+    int address;
+    switch (insn->opcode) {
+        case 0b00111: case 0b01000: return insn->operand;                                   // [addr]
+        case 0b01111: case 0b11111: address = ctx->registers.regs[insn->reg2] + insn->operand; break; // [reg+off]
+        case 0b01100: case 0b01110: address = ctx->registers.ESP; break;                    // POP, RET
+        case 0b01011: case 0b01101: address = ctx->registers.ESP - 1; break;                // PUSH, CALL
+        case OP_MEMCPY: case OP_MEMSET: case OP_MEMCMP:                                     // The first word of block reg1
+            if (block_length(ctx, insn) == 0) return -1;
+            address = ctx->registers.regs[insn->reg1];
+            break;
+        default: return -1;
+    }
+    return ctx->masked_addresses ? address & ctx->memory_mask : address;
+}
+
+static void run_traced(CpuContext* ctx, int pc) {
+    TraceRing ring = { 0 };
+    ring.wraps = trace_ring_records > 0;
+    ring.capacity = ring.wraps ? (size_t)trace_ring_records : TRACE_RING_RECORDS;
+    ring.records = malloc(ring.capacity * sizeof(TraceRecord));
+    ring.file = ring.records != NULL ? fopen(trace_filename, "wb") : NULL;
+    if (ring.file == NULL) {
+        fprintf(ctx->err, "[Trace Error] Failed to open trace file: %s\n", ring.records != NULL ? strerror(errno) : "out of memory");
+        free(ring.records);
+        return;
+    }
+    if (!ring.wraps) trace_write_header(&ring, 0);
+
+    while (pc >= 0 && pc < ctx->program_instruction_count) {
+        const DecodedInstruction* insn = &ctx->decoded_program[pc];
+        Registers before = ctx->registers;
+        int address = trace_memory_address(ctx, insn);
+        int next_pc = handler_table[unfused_handler(insn)](ctx, insn, pc);
+
+        TraceRecord* r = &ring.records[ring.head];
+        memset(r, 0, sizeof(*r));
+        r->pc = pc;
+        r->word = ctx->machine_code[pc];
+        r->reg = TRACE_NO_REGISTER;
+        for (int i = 0; i < NUM_REGISTERS; i++) {
+            if (ctx->registers.regs[i] != before.regs[i]) {
+                r->reg = (uint8_t)i;
+                r->reg_value = ctx->registers.regs[i];
+                break;
+            }
+        }
+        if (address >= 0 && address < ctx->memory_size) { // Out-of-range accesses faulted instead.
+            r->flags = opcode_writes[insn->opcode] ? TRACE_MEMORY_WRITE : TRACE_MEMORY_READ;
+            r->address = address;
+            r->value = ctx->memory[address];
+        }
+        ring.total++;
+        if (++ring.head == ring.capacity) {
+            ring.head = 0;
+            if (!ring.wraps) trace_write(&ring, ring.records, sizeof(TraceRecord), ring.capacity);
+        }
+        pc = next_pc;
+    }
+
+    if (!ring.wraps) {
+        trace_write(&ring, ring.records, sizeof(TraceRecord), ring.head);
+    } else if (ring.total <= ring.capacity) {
+        trace_write_header(&ring, 0);
+        trace_write(&ring, ring.records, sizeof(TraceRecord), ring.head);
+    } else {
+        // Oldest first: the records after head, then the ones before it.
+        trace_write_header(&ring, ring.total - ring.capacity);
+        trace_write(&ring, ring.records + ring.head, sizeof(TraceRecord), ring.capacity - ring.head);
+        trace_write(&ring, ring.records, sizeof(TraceRecord), ring.head);
+    }
+    if (fclose(ring.file) != 0) ring.failed = 1;
+    if (ring.failed) fprintf(ctx->err, "[Trace Error] Could not write the trace file.\n");
+    free(ring.records);
+}
+
+// --- Context Management ---
+// Prepares a context that talks to the process's standard streams.
+void init_context(CpuContext* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->in = stdin;
+    ctx->out = stdout;
+    ctx->err = stderr;
+    ctx->io.headless = headless_io;
+    ctx->io.binary = binary_output;
+    ctx->masked_addresses = mask_addresses;
+    ctx->watched = run_budget > 0 || run_deadline > 0;
+    ctx->memoized = memoize_calls && !mask_addresses; // Memoized calls replay their frame unwrapped.
+    ctx->engine = selected_engine;
+}
+
+// Releases what a context allocated while running; the context itself belongs to the caller.
+void destroy_context(CpuContext* ctx) {
+#ifdef HAVE_JIT
+    jit_destroy(ctx);
+#endif
+    release_memo(ctx);
+    release_image(ctx);
+    free_guest_memory(ctx->memory, ctx->memory_size);
+    free_guest_memory(ctx->dump_base, ctx->memory_size);
+    free(ctx->dirty);
+    free(ctx->machine_code);
+    free(ctx->decoded_program);
+    free(ctx->wide_operands);
+    ctx->memory = NULL;
+    ctx->dirty = NULL;
+    ctx->dump_base = NULL;
+    ctx->machine_code = NULL;
+    ctx->wide_operands = NULL;
+    ctx->decoded_program = NULL;
+}
+
+// Runs the loaded program from `pc` on the context's engine, falling back as each one requires.
+static void run_engine(CpuContext* ctx, int pc) {
+#ifdef HAVE_JIT
+    if (ctx->engine == ENGINE_JIT && jit_init(ctx)) {
+        run_jit_engine(ctx, pc);
+        return;
+    }
+#endif
+#ifdef HAVE_COMPUTED_GOTO
+    if (ctx->engine == ENGINE_THREADED || ctx->engine == ENGINE_JIT) {
+        run_threaded_engine(ctx, pc);
+        return;
+    }
+#endif
+    run_call_engine(ctx, pc);
+}
+
+// Puts the CPU in its power-on state: registers and memory cleared, apart from an image's data
+// segment, and the stack at the top of memory.
+void reset_cpu(CpuContext* ctx) {
+    memset(&ctx->registers, 0, sizeof(ctx->registers)); // A context may be reused across programs.
+    ctx->flags.result = 1; // ZF = SF = 0.
+    clear_dirty_memory(ctx); // Clear main memory before execution.
+    if (ctx->image.data != NULL) {
+        memcpy(ctx->memory + ctx->image.header->data_address, ctx->image.data, ctx->image.header->data_length * sizeof(int32_t));
+        mark_dirty_block(ctx, ctx->image.header->data_address, ctx->image.header->data_length);
+    }
+    ctx->registers.ESP = ctx->memory_size; // ESP starts just above the highest memory address.
+    ctx->registers.EBP = ctx->registers.ESP;
+    ctx->io.input_pos = 0;
+}
+
+void run_program(CpuContext* ctx) {
+    reset_cpu(ctx);
+    resume_program(ctx, ctx->entry_pc); // 0, unless an image says otherwise.
+}
+
+static void run_profiled(CpuContext* ctx, int pc); // Needs the fusion table, so it follows the decoder.
+
+// Runs the loaded program from `pc` with the CPU state as it is, e.g. after restore_snapshot().
+void resume_program(CpuContext* ctx, int pc) {
+    arm_watchdog(ctx, run_budget, run_deadline);
+    double start = report_run_time ? wall_seconds() : 0.0;
+    if (profile_filename != NULL) {
+        run_profiled(ctx, pc);
+    } else if (trace_filename != NULL) {
+        run_traced(ctx, pc);
+    } else if (stats_format != STATS_OFF) {
+        run_counted(ctx, pc);
+    } else {
+        run_engine(ctx, pc);
+    }
+    report_watchdog(ctx);
+    if (report_run_time) fprintf(ctx->err, "Run time: %.9f s\n", wall_seconds() - start);
+    flush_output(ctx);
+    if (stats_format != STATS_OFF) report_counters(ctx);
+}
+
+int execute_instruction(CpuContext* ctx, const DecodedInstruction* insn, int pc) {
+    return handler_table[insn->handler](ctx, insn, pc);
+}
+
+// --- Instruction Decoder ---
+// Load-time memory verifier. Absolute addresses are fixed when the program is assembled, so every
+// one that lies inside memory runs on an unchecked handler. Stack and base+offset addresses depend
+// on run-time register values and keep their checked handlers, or with --mask-addresses switch to
+// handlers that wrap the address into memory instead.
+static void verify_memory_accesses(CpuContext* ctx) {
+    for (int pc = 0; pc < ctx->program_instruction_count; pc++) {
+        DecodedInstruction* insn = &ctx->decoded_program[pc];
+        switch (insn->opcode) {
+            case 0b00111: if ((unsigned)insn->operand < (unsigned)ctx->memory_size) insn->handler = id_op_load_unchecked; break;
+            case 0b01000: if ((unsigned)insn->operand < (unsigned)ctx->memory_size) insn->handler = id_op_store_unchecked; break;
+            default: break;
+        }
+        if (!ctx->masked_addresses) continue;
+        switch (insn->opcode) {
+            case 0b01011: insn->handler = id_op_push_masked; break;
+            case 0b01100: insn->handler = id_op_pop_masked; break;
+            case 0b01101: insn->handler = id_op_call_masked; break;
+            case 0b01110: insn->handler = id_op_ret_masked; break;
+            case 0b01111: insn->handler = id_op_load_indexed_masked; break;
+            case 0b11111: insn->handler = id_op_store_indexed_masked; break;
+            default: break;
+        }
+    }
+}
+
+// With --budget or --deadline, or in the library, control transfers switch to handlers that
+// charge the watchdog. Runs before fusion, which then leaves the watched jumps alone.
+static void watch_branches(CpuContext* ctx) {
+    if (!ctx->watched) return;
+    for (int pc = 0; pc < ctx->program_instruction_count; pc++) {
+        DecodedInstruction* insn = &ctx->decoded_program[pc];
+        switch (insn->handler) {
+            case id_op_jmp: insn->handler = id_op_jmp_watched; break;
+            case id_op_je: insn->handler = id_op_je_watched; break;
+            case id_op_jne: insn->handler = id_op_jne_watched; break;
+            case id_op_jg: insn->handler = id_op_jg_watched; break;
+            case id_op_jl: insn->handler = id_op_jl_watched; break;
+            case id_op_jge: insn->handler = id_op_jge_watched; break;
+            case id_op_jle: insn->handler = id_op_jle_watched; break;
+            case id_op_call: insn->handler = id_op_call_watched; break;
+            case id_op_ret: insn->handler = id_op_ret_watched; break;
+            case id_op_call_masked: insn->handler = id_op_call_masked_watched; break;
+            case id_op_ret_masked: insn->handler = id_op_ret_masked_watched; break;
+            default: break;
+        }
+    }
+}
+
+// Sequences fused into superinstructions, longest first. Each part must still run on its plain
+// opcode handler, and register operands can be pinned with REG() (ANY_REG matches anything).
+// New patterns, e.g. hot pairs from a profile, only need a FUSE handler and a row here.
+#define ANY_REG 0
+#define REG(code) ((code) + 1)
+typedef struct {
+    uint8_t length;
+    uint8_t opcode[3];
+    uint8_t reg1[3], reg2[3];  // Required register operands, as REG(code) or ANY_REG.
+    uint8_t same_reg1;         // Every part must use the same first register (DEC r; CMP r, #n).
+    uint8_t handler;
+} FusionPattern;
+
+static const FusionPattern fusion_table[] = {
+    { 3, { 0b01010, 0b10101, 0b11010 }, { 0 }, { 0 }, 1, id_op_dec_cmp_imm_jne },  // DEC r; CMP r, #n; JNE
+    { 3, { 0b01001, 0b10101, 0b11010 }, { 0 }, { 0 }, 1, id_op_inc_cmp_imm_jne },  // INC r; CMP r, #n; JNE
+    { 2, { 0b10101, 0b11001 }, { 0 }, { 0 }, 0, id_op_cmp_imm_je },                // CMP r, #n; Jcc
+    { 2, { 0b10101, 0b11010 }, { 0 }, { 0 }, 0, id_op_cmp_imm_jne },
+    { 2, { 0b10101, 0b11011 }, { 0 }, { 0 }, 0, id_op_cmp_imm_jg },
+    { 2, { 0b10101, 0b11100 }, { 0 }, { 0 }, 0, id_op_cmp_imm_jl },
+    { 2, { 0b10101, 0b11101 }, { 0 }, { 0 }, 0, id_op_cmp_imm_jge },
+    { 2, { 0b10101, 0b11110 }, { 0 }, { 0 }, 0, id_op_cmp_imm_jle },
+    { 2, { 0b10111, 0b11001 }, { 0 }, { 0 }, 0, id_op_cmp_je },                    // CMP r, r; Jcc
+    { 2, { 0b10111, 0b11010 }, { 0 }, { 0 }, 0, id_op_cmp_jne },
+    { 2, { 0b10111, 0b11011 }, { 0 }, { 0 }, 0, id_op_cmp_jg },
+    { 2, { 0b10111, 0b11100 }, { 0 }, { 0 }, 0, id_op_cmp_jl },
+    { 2, { 0b10111, 0b11101 }, { 0 }, { 0 }, 0, id_op_cmp_jge },
+    { 2, { 0b10111, 0b11110 }, { 0 }, { 0 }, 0, id_op_cmp_jle },
+    { 2, { 0b01011, 0b10010 }, { REG(6), REG(6) }, { ANY_REG, REG(7) }, 0, id_op_push_mov_reg }, // PUSH EBP; MOV EBP, ESP
+};
+
+static int fusion_matches(const CpuContext* ctx, const FusionPattern* pattern, int pc, const uint8_t* is_target) {
+    if (pc + pattern->length > ctx->program_instruction_count) return 0;
+    for (int i = 0; i < pattern->length; i++) {
+        const DecodedInstruction* insn = &ctx->decoded_program[pc + i];
+        if (insn->opcode != pattern->opcode[i] || insn->handler != insn->opcode) return 0;
+        if (i > 0 && is_target[pc + i]) return 0; // Something jumps into the middle.
+        if (pattern->reg1[i] != ANY_REG && insn->reg1 != pattern->reg1[i] - 1) return 0;
+        if (pattern->reg2[i] != ANY_REG && insn->reg2 != pattern->reg2[i] - 1) return 0;
+        if (pattern->same_reg1 && insn->reg1 != ctx->decoded_program[pc].reg1) return 0;
+    }
+    return 1;
+}
+
+// Rewrites the first slot of every sequence in fusion_table to its superinstruction. The other
+// slots keep their own handlers but are only reached through the first, since nothing jumps or
+// returns into them.
+static void fuse_superinstructions(CpuContext* ctx) {
+    int count = ctx->program_instruction_count;
+    uint8_t* is_target = calloc(count + 1, 1);
+    if (is_target == NULL) return; // Fusion is only an optimization.
+
+    if (ctx->image.blocks != NULL) {
+        // An image's basic-block index already lists every target and return address.
+        for (int i = 0; i < ctx->image.block_count; i++) {
+            if (ctx->image.blocks[i] <= (uint32_t)count) is_target[ctx->image.blocks[i]] = 1;
+        }
+    } else {
+        for (int pc = 0; pc < count; pc++) {
+            const DecodedInstruction* insn = &ctx->decoded_program[pc];
+            if ((insn->opcode >= 0b11000 && insn->opcode <= 0b11110) || insn->opcode == 0b01101) is_target[insn->operand] = 1;
+            if (insn->opcode == 0b01101) is_target[pc + 1] = 1; // The return address.
+        }
+    }
+    for (int pc = 0; pc < count; pc++) {
+        for (size_t p = 0; p < sizeof(fusion_table) / sizeof(fusion_table[0]); p++) {
+            if (fusion_matches(ctx, &fusion_table[p], pc, is_target)) {
+                ctx->decoded_program[pc].handler = fusion_table[p].handler;
+                pc += fusion_table[p].length - 1;
+                break;
+            }
+        }
+    }
+    free(is_target);
+}
+#undef REG
+#undef ANY_REG
+
+// The fusion_table row a superinstruction handler runs, or NULL for any other handler.
+static const FusionPattern* fused_pattern(int handler) {
+    if (handler < FIRST_FUSED_HANDLER) return NULL;
+    for (size_t p = 0; p < sizeof(fusion_table) / sizeof(fusion_table[0]); p++) {
+        if (fusion_table[p].handler == handler) return &fusion_table[p];
+    }
+    return NULL;
+}
+
+// The opcode a handler implements (the first one, for a superinstruction), or -1.
+static int handler_opcode(int handler) {
+    if (handler < DECODED_OPCODE_COUNT) return handler;
+    if (handler >= id_op_jmp_watched && handler <= id_op_jle_watched) return 0b11000 + handler - id_op_jmp_watched;
+    switch (handler) {
+        case id_op_load_unchecked: return 0b00111;
+        case id_op_store_unchecked: return 0b01000;
+        case id_op_push_masked: return 0b01011;
+        case id_op_pop_masked: return 0b01100;
+        case id_op_call_masked: case id_op_call_watched: case id_op_call_masked_watched: return 0b01101;
+        case id_op_call_memo: case id_op_call_memo_watched: return 0b01101;
+        case id_op_ret_masked: case id_op_ret_watched: case id_op_ret_masked_watched: return 0b01110;
+        case id_op_load_indexed_masked: return 0b01111;
+        case id_op_store_indexed_masked: return 0b11111;
+        default: break;
+    }
+    const FusionPattern* pattern = fused_pattern(handler);
+    return pattern != NULL ? pattern->opcode[0] : -1;
+}
+
+// Splits every loaded word into its fields once, so execution only reads the decoded slots.
+void decode_program(CpuContext* ctx) {
+    const WideOperand* wide = ctx->wide_operands;
+    const WideOperand* wide_end = wide + ctx->wide_count;
+    for (int pc = 0; pc < ctx->program_instruction_count; pc++) {
+        uint16_t instruction = ctx->machine_code[pc];
+        DecodedInstruction* insn = &ctx->decoded_program[pc];
+
+        insn->opcode = instruction >> 11;
+        if (insn->opcode == 0 && BLOCK_OP(instruction) != 0) insn->opcode = OP_MEMCPY + BLOCK_OP(instruction) - 1;
+        insn->handler = insn->opcode; // Handler ids line up with the opcodes.
+        insn->reg1 = (instruction >> 8) & 0x07;
+        insn->reg2 = (instruction >> 5) & 0x07;
+
+        // Base+offset MOVs carry a 5-bit offset, block instructions a count register and
+        // everything else an 8-bit value/address.
+        if (wide < wide_end && wide->pc == pc) {
+            insn->operand = (wide++)->operand;
+        } else if (insn->opcode >= OPCODE_COUNT) {
+            insn->operand = instruction & 0x07;
+        } else if (insn->opcode == 0b01111 || insn->opcode == 0b11111) {
+            insn->operand = instruction & 0x1F;
+        } else {
+            insn->operand = instruction & 0xFF;
+        }
+
+        // Jumping past the last instruction ends the program, so point such targets at the terminal slot.
+        if ((insn->opcode >= 0b11000 && insn->opcode <= 0b11110) || insn->opcode == 0b01101) {
+            if ((unsigned)insn->operand > (unsigned)ctx->program_instruction_count) insn->operand = ctx->program_instruction_count;
+        }
+    }
+
+    verify_memory_accesses(ctx);
+    watch_branches(ctx);
+    fuse_superinstructions(ctx);
+    memoize_pure_calls(ctx);
+
+#ifdef HAVE_JIT
+    if (!jit_reset(ctx)) jit_destroy(ctx); // Blocks translated for a previous program are stale now.
+#endif
+}
+
+// Decoder options that change the handlers decode_program() picks, as saved with a decoded section.
+#define DECODED_MASKED  0x1         // --mask-addresses
+#define DECODED_WATCHED 0x2         // --budget or --deadline
+#define DECODED_MEMOIZED 0x4        // --memoize
+
+static uint32_t decode_options(const CpuContext* ctx) {
+    return (ctx->masked_addresses ? DECODED_MASKED : 0) | (ctx->watched ? DECODED_WATCHED : 0) |
+           (ctx->memoized ? DECODED_MEMOIZED : 0);
+}
+
+// Identifies this build's decoder in saved images: its handler ids, its fusion table and the size
+// of a decoded instruction. Any change to them retires the decoded sections written before.
+static uint32_t decoder_fingerprint() {
+#define AS_NAME(fn, exits) #fn " "
+    static const char names[] = HANDLER_LIST(AS_NAME);
+#undef AS_NAME
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(names); i++) hash = (hash ^ (uint8_t)names[i]) * 16777619u;
+    const uint8_t* table = (const uint8_t*)fusion_table;
+    for (size_t i = 0; i < sizeof(fusion_table); i++) hash = (hash ^ table[i]) * 16777619u;
+    return (hash ^ (uint32_t)sizeof(DecodedInstruction)) * 16777619u;
+}
+
+// Checks decoded instructions read from a file before anything runs them. Each handler must
+// implement its slot's opcode, and every operand a handler trusts without a check (register
+// numbers, branch targets, verified absolute addresses, the rest of a superinstruction) must be in
+// range, so a damaged image can fail to load but not reach outside the program or memory.
+static int decoded_program_valid(const CpuContext* ctx, const DecodedInstruction* decoded) {
+    int count = ctx->program_instruction_count;
+    for (int pc = 0; pc < count; pc++) {
+        const DecodedInstruction* insn = &decoded[pc];
+        if (insn->handler >= HANDLER_COUNT || handler_opcode(insn->handler) != insn->opcode) return 0;
+        if (insn->reg1 >= NUM_REGISTERS || insn->reg2 >= NUM_REGISTERS) return 0;
+        if (insn->opcode >= OPCODE_COUNT && (unsigned)insn->operand >= NUM_REGISTERS) return 0;
+        if (((insn->opcode >= 0b11000 && insn->opcode <= 0b11110) || insn->opcode == 0b01101) && (unsigned)insn->operand > (unsigned)count) return 0;
+        if ((insn->handler == id_op_load_unchecked || insn->handler == id_op_store_unchecked) &&
+            (unsigned)insn->operand >= (unsigned)ctx->memory_size) return 0;
+        const FusionPattern* pattern = fused_pattern(insn->handler);
+        if (pattern != NULL) {
+            if (pc + pattern->length > count) return 0;
+            for (int i = 1; i < pattern->length; i++) {
+                if (decoded[pc + i].opcode != pattern->opcode[i]) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Runs the program from the loaded image's decoded section in place, when this decoder wrote it
+// for the same memory size and options and it passes decoded_program_valid(). Returns 1 if it did;
+// otherwise the caller decodes the code section as usual.
+int adopt_decoded_program(CpuContext* ctx) {
+    const ImageDecodedHeader* header = ctx->image.decoded;
+    size_t records = (size_t)ctx->program_instruction_count + 1; // With the terminal slot.
+    if (header == NULL || header->decoder != decoder_fingerprint() || header->record_size != sizeof(DecodedInstruction) ||
+        header->memory_size != (uint32_t)ctx->memory_size || header->options != decode_options(ctx) ||
+        ctx->image.decoded_size != sizeof(*header) + records * sizeof(DecodedInstruction)) {
+        return 0;
+    }
+    DecodedInstruction* decoded = (DecodedInstruction*)(header + 1);
+    if (!decoded_program_valid(ctx, decoded)) return 0;
+
+    free(ctx->decoded_program);
+    ctx->decoded_program = decoded;
+    memoize_pure_calls(ctx); // The records name the memo handlers, but the routine summaries are not saved.
+#ifdef HAVE_JIT
+    if (!jit_reset(ctx)) jit_destroy(ctx);
+#endif
+    return 1;
+}
+
+// --- Memoization ---
+// With --memoize, a CALL of a pure routine remembers what the call did, keyed by the values the
+// routine reads, and the next CALL with the same values replays it instead of running it again.
+// A routine is pure when the code reachable from its entry up to its RET only computes on
+// registers and its own stack frame: no I/O, HLT, DIV or addressed memory, no explicit ESP, the
+// same stack depth wherever paths meet, RET only at depth 0, and CALLs only of pure routines.
+// What such a call does then depends on nothing but its live-in values: the values it writes,
+// the stack words it leaves below its return address (which a final dump shows) and the
+// watchdog fuel it burns. All three are recorded, so a replayed call is indistinguishable from a
+// run one, and recursive guests like fib run each distinct call once.
+
+// The registers (and MEMO_FLAGS) an instruction reads and writes, or 0 for an instruction a pure
+// routine may not contain. A CALL reads its callee's live-in values, added by the caller.
+static int memo_effects(const DecodedInstruction* insn, uint16_t* uses, uint16_t* defs) {
+    uint16_t r1 = 1 << insn->reg1, r2 = 1 << insn->reg2;
+    *uses = *defs = 0;
+    switch (insn->opcode) {
+        case 0b00001: case 0b00011: case 0b10000: case 0b10001: *uses = r1 | r2; *defs = r1; break; // MUL XOR ADD SUB
+        case 0b00110: *defs = r1; break;                                                            // MOV r, #imm
+        case 0b01001: case 0b01010: case 0b10011: case 0b10100: case 0b10110: *uses = *defs = r1; break; // INC DEC ADD/SUB #imm NOT
+        case 0b01011: *uses = r1; break;                                                            // PUSH
+        case 0b01100: *defs = r1; break;                                                            // POP
+        case 0b01101: case 0b01110: case 0b11000: break;                                            // CALL RET JMP
+        case 0b10010: *uses = r2; *defs = r1; break;                                                // MOV r, r
+        case 0b10101: *uses = r1; *defs = MEMO_FLAGS; break;                                        // CMP r, #imm
+        case 0b10111: *uses = r1 | r2; *defs = MEMO_FLAGS; break;                                   // CMP r, r
+        case 0b11001: case 0b11010: case 0b11011: case 0b11100: case 0b11101: case 0b11110: *uses = MEMO_FLAGS; break; // Jcc
+        default: return 0;                                                                          // HLT DIV INP OUT and memory
+    }
+    return ((*uses | *defs) & (1 << 7)) == 0; // ESP only moves through PUSH, POP, CALL and RET.
+}
+
+// Follows the routine at `entry` with the stack depth of every PC, assuming the routines marked
+// in `impure` are the only impure ones. Visited PCs are added to `in_routine` when it is given.
+// `depth` must hold -1 for every PC and is left that way.
+static int routine_pure(const CpuContext* ctx, int entry, const uint8_t* impure, int* depth, int* work, uint8_t* in_routine) {
+    int count = ctx->program_instruction_count, visited = 0, pure = 1;
+    depth[entry] = 0;
+    work[visited++] = entry;
+    for (int i = 0; i < visited && pure; i++) {
+        int pc = work[i], d = depth[pc];
+        const DecodedInstruction* insn = &ctx->decoded_program[pc];
+        int next[2] = { pc + 1, -1 }, next_depth = d;
+        uint16_t uses, defs;
+        if (!memo_effects(insn, &uses, &defs) || visited > MEMO_MAX_ROUTINE) { pure = 0; break; }
+        switch (insn->opcode) {
+            case 0b01011: next_depth = d + 1; break;                                   // PUSH
+            case 0b01100: next_depth = d - 1; pure = d > 0; break;                     // POP
+            case 0b01101: pure = insn->operand < count && !impure[insn->operand]; break; // CALL
+            case 0b01110: next[0] = -1; pure = d == 0; break;                          // RET
+            case 0b11000: next[0] = insn->operand; break;                              // JMP
+            default:
+                if (insn->opcode >= 0b11001 && insn->opcode <= 0b11110) next[1] = insn->operand; // Jcc
+                break;
+        }
+        for (int n = 0; n < 2 && pure; n++) {
+            int target = next[n];
+            if (target < 0) continue;
+            if (target >= count) pure = 0; // Runs off the end of the program.
+            else if (depth[target] == -1) { depth[target] = next_depth; work[visited++] = target; }
+            else if (depth[target] != next_depth) pure = 0;
+        }
+    }
+    for (int i = 0; i < visited; i++) {
+        depth[work[i]] = -1;
+        if (in_routine != NULL) in_routine[work[i]] = 1;
+    }
+    return pure;
+}
+
+// Finds the pure CALL targets and points their CALLs at the memoizing handlers, with the live-in
+// values of every pure PC (by backward liveness over the pure code) and the values each slot's
+// handler writes. Every other CALL keeps, or gets back, its plain handler.
+static void memoize_pure_calls(CpuContext* ctx) {
+    release_memo(ctx);
+    if (!ctx->memoized) return;
+    int count = ctx->program_instruction_count;
+    uint8_t* impure = calloc(count + 1, 1);
+    uint8_t* is_target = calloc(count + 1, 1);
+    uint8_t* in_routine = calloc(count + 1, 1);
+    int* depth = malloc((count + 1) * sizeof(int));
+    int* work = malloc((count + MEMO_MAX_ROUTINE + 2) * sizeof(int));
+    MemoTable* memo = calloc(1, sizeof(MemoTable));
+    if (memo != NULL) {
+        memo->live = calloc(count + 1, sizeof(uint16_t));
+        memo->writes = calloc(count + 1, sizeof(uint16_t));
+    }
+    int ready = impure != NULL && is_target != NULL && in_routine != NULL && depth != NULL && work != NULL &&
+                memo != NULL && memo->live != NULL && memo->writes != NULL;
+
+    int pure_count = 0;
+    if (ready) {
+        for (int pc = 0; pc < count; pc++) {
+            depth[pc] = -1;
+            const DecodedInstruction* insn = &ctx->decoded_program[pc];
+            if (insn->opcode == 0b01101 && insn->operand < count) is_target[insn->operand] = 1;
+        }
+        // Start from every target being pure and drop those that are not, until none drops.
+        for (int changed = 1; changed; ) {
+            changed = 0;
+            for (int pc = 0; pc < count; pc++) {
+                if (is_target[pc] && !impure[pc] && !routine_pure(ctx, pc, impure, depth, work, NULL)) impure[pc] = changed = 1;
+            }
+        }
+        for (int pc = 0; pc < count; pc++) {
+            if (is_target[pc] && !impure[pc]) { routine_pure(ctx, pc, impure, depth, work, in_routine); pure_count++; }
+        }
+    }
+
+    if (pure_count > 0) {
+        for (int pc = 0; pc < count; pc++) {
+            const DecodedInstruction* insn = &ctx->decoded_program[pc];
+            const FusionPattern* pattern = fused_pattern(insn->handler);
+            for (int i = 0; i < (pattern != NULL ? pattern->length : 1); i++) {
+                uint16_t uses, defs;
+                memo_effects(&ctx->decoded_program[pc + i], &uses, &defs);
+                memo->writes[pc] |= defs;
+            }
+        }
+        for (int changed = 1; changed; ) {
+            changed = 0;
+            for (int pc = count - 1; pc >= 0; pc--) {
+                if (!in_routine[pc]) continue;
+                const DecodedInstruction* insn = &ctx->decoded_program[pc];
+                uint16_t uses, defs, out;
+                memo_effects(insn, &uses, &defs);
+                switch (insn->opcode) {
+                    case 0b01101: uses |= memo->live[insn->operand]; out = memo->live[pc + 1]; break; // CALL
+                    case 0b01110: out = 0; break;                                                   // RET
+                    case 0b11000: out = memo->live[insn->operand]; break;                           // JMP
+                    default:
+                        out = memo->live[pc + 1];
+                        if (insn->opcode >= 0b11001 && insn->opcode <= 0b11110) out |= memo->live[insn->operand];
+                        break;
+                }
+                uint16_t live = uses | (out & ~defs);
+                if (live != memo->live[pc]) { memo->live[pc] = live; changed = 1; }
+            }
+        }
+        ctx->memo = memo;
+        memo = NULL;
+    }
+
+    for (int pc = 0; pc < count; pc++) {
+        DecodedInstruction* insn = &ctx->decoded_program[pc];
+        if (insn->opcode != 0b01101 || (insn->handler != id_op_call && insn->handler != id_op_call_watched &&
+                                        insn->handler != id_op_call_memo && insn->handler != id_op_call_memo_watched)) continue;
+        int memoized = ctx->memo != NULL && insn->operand < count && is_target[insn->operand] && !impure[insn->operand];
+        insn->handler = memoized ? (ctx->watched ? id_op_call_memo_watched : id_op_call_memo)
+                                 : (ctx->watched ? id_op_call_watched : id_op_call);
+    }
+    if (memo != NULL) {
+        free(memo->live);
+        free(memo->writes);
+        free(memo);
+    }
+    free(impure);
+    free(is_target);
+    free(in_routine);
+    free(depth);
+    free(work);
+}
+
+static void release_memo(CpuContext* ctx) {
+    MemoTable* memo = ctx->memo;
+    if (memo == NULL) return;
+    for (int i = 0; i < MEMO_ENTRIES; i++) free(memo->entries[i].frame);
+    free(memo->live);
+    free(memo->writes);
+    free(memo);
+    ctx->memo = NULL;
+}
+
+// Runs a CALL of a pure routine: replays the remembered call with the same inputs, or runs the
+// routine to its return on a nested loop and remembers what it did. A replay that would run the
+// watchdog out of fuel runs the call instead, so the watchdog stops it where it always would.
+static int call_memoized(CpuContext* ctx, const DecodedInstruction* insn, int pc, int watched) {
+    MemoTable* memo = ctx->memo;
+    int esp = ctx->registers.ESP;
+    int target = watched ? op_call_watched(ctx, insn, pc) : op_call(ctx, insn, pc);
+    if (target != insn->operand || esp < 1 || esp > ctx->memory_size || memo->nesting == MEMO_MAX_NESTING) return target;
+    int return_slot = esp - 1;
+
+    int inputs[MEMO_VALUES] = { 0 };
+    uint16_t live = memo->live[target];
+    uint32_t hash = (2166136261u ^ (uint32_t)target) * 16777619u;
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        if (live & (1 << r)) inputs[r] = ctx->registers.regs[r];
+        hash = (hash ^ (uint32_t)inputs[r]) * 16777619u;
+    }
+    if (live & MEMO_FLAGS) inputs[NUM_REGISTERS] = ctx->flags.result;
+    hash = (hash ^ (uint32_t)inputs[NUM_REGISTERS]) * 16777619u;
+    MemoEntry* entry = &memo->entries[(hash ^ (hash >> 16)) & (MEMO_ENTRIES - 1)];
+
+    if (entry->valid && entry->target == target && memcmp(entry->inputs, inputs, sizeof(inputs)) == 0 &&
+        return_slot - entry->frame_words >= 0 && (!watched || ctx->watchdog.fuel >= entry->charge)) {
+        for (int r = 0; r < NUM_REGISTERS; r++) {
+            if (entry->written & (1 << r)) ctx->registers.regs[r] = entry->outputs[r];
+        }
+        if (entry->written & MEMO_FLAGS) ctx->flags.result = entry->outputs[NUM_REGISTERS];
+        int bottom = return_slot - entry->frame_words;
+        if (entry->frame_words > 0) memcpy(ctx->memory + bottom, entry->frame, entry->frame_words * sizeof(int));
+        mark_dirty_block(ctx, bottom, entry->frame_words);
+        if (watched) ctx->watchdog.fuel -= (int)entry->charge;
+        ctx->registers.ESP = esp;
+        memo->written |= entry->written; // For the miss this call may be part of.
+        if (bottom < memo->low_esp) memo->low_esp = bottom;
+        return pc + 1;
+    }
+
+    int outer_low = memo->low_esp;
+    uint16_t outer_written = memo->written;
+    int64_t charged = ctx->watchdog.granted - ctx->watchdog.fuel;
+    memo->low_esp = return_slot;
+    memo->written = 0;
+    memo->nesting++;
+    int next = target;
+    while (next >= 0 && next < ctx->program_instruction_count && (next != pc + 1 || ctx->registers.ESP != esp)) {
+        memo->written |= memo->writes[next];
+        next = execute_instruction(ctx, &ctx->decoded_program[next], next);
+        if (ctx->registers.ESP < memo->low_esp) memo->low_esp = ctx->registers.ESP;
+    }
+    memo->nesting--;
+    int low = memo->low_esp;
+    uint16_t written = memo->written;
+    memo->low_esp = low < outer_low ? low : outer_low;
+    memo->written = outer_written | written;
+
+    // A call that hit the end of memory printed errors, which a replay would not.
+    int frame_words = return_slot - low;
+    if (next != pc + 1 || low < 0 || frame_words > MEMO_MAX_FRAME) return next;
+    if (frame_words > entry->frame_capacity) {
+        int* frame = realloc(entry->frame, frame_words * sizeof(int));
+        if (frame == NULL) { entry->valid = 0; return next; }
+        entry->frame = frame;
+        entry->frame_capacity = frame_words;
+    }
+    entry->valid = 1;
+    entry->target = target;
+    memcpy(entry->inputs, inputs, sizeof(inputs));
+    memcpy(entry->outputs, ctx->registers.regs, NUM_REGISTERS * sizeof(int));
+    entry->outputs[NUM_REGISTERS] = ctx->flags.result;
+    entry->written = written;
+    entry->frame_words = frame_words;
+    if (frame_words > 0) memcpy(entry->frame, ctx->memory + low, frame_words * sizeof(int));
+    entry->charge = (ctx->watchdog.granted - ctx->watchdog.fuel) - charged;
+    return next;
+}
+
+// --- Program Images ---
+// Images are mapped copy-on-write rather than read, so loading touches only the header and section
+// table until the program runs; the code and a usable decoded section are used where they lie.
+// Writes (re-verifying after a snapshot resizes memory, say) stay private to the process.
+
+static const char* parse_image(ProgramImage* image) {
+    const ImageHeader* header = (const ImageHeader*)image->base;
+    if (image->size < sizeof(*header)) return "is truncated";
+    if (header->version != IMAGE_VERSION || header->byte_order != IMAGE_BYTE_ORDER) return "was written by an incompatible version or host";
+    uint64_t table = header->section_table;
+    if (table % IMAGE_ALIGNMENT != 0 || table > image->size || header->section_count > (image->size - table) / sizeof(ImageSection)) {
+        return "is corrupt";
+    }
+    image->header = header;
+
+    const ImageSection* sections = (const ImageSection*)(image->base + table);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        const ImageSection* section = &sections[i];
+        if (section->offset % IMAGE_ALIGNMENT != 0 || section->offset > image->size || section->size > image->size - section->offset) {
+            return "is corrupt";
+        }
+        uint8_t* data = image->base + section->offset;
+        switch (section->type) {
+            case IMAGE_CODE:
+                if (section->size != (uint64_t)header->code_length * sizeof(uint16_t)) return "is corrupt";
+                image->code = (uint16_t*)data;
+                break;
+            case IMAGE_DATA:
+                if (section->size != (uint64_t)header->data_length * sizeof(int32_t)) return "is corrupt";
+                image->data = (const int32_t*)data;
+                break;
+            case IMAGE_SYMBOLS:
+                if (section->size % sizeof(ImageSymbol) != 0) return "is corrupt";
+                image->symbols = (const ImageSymbol*)data;
+                image->symbol_count = (int)(section->size / sizeof(ImageSymbol));
+                break;
+            case IMAGE_BLOCKS:
+                if (section->size % sizeof(uint32_t) != 0) return "is corrupt";
+                image->blocks = (const uint32_t*)data;
+                image->block_count = (int)(section->size / sizeof(uint32_t));
+                break;
+            case IMAGE_DECODED:
+                if (section->size < sizeof(ImageDecodedHeader)) return "is corrupt";
+                image->decoded = (const ImageDecodedHeader*)data;
+                image->decoded_size = (size_t)section->size;
+                break;
+            default:
+                break; // Written by a newer version; not needed to run.
+        }
+    }
+    if (image->code == NULL) return "has no code section";
+    if (header->code_length >= INT32_MAX || header->entry_pc > header->code_length || (header->data_length > 0 && image->data == NULL) ||
+        (header->memory_size != 0 && (header->memory_size < MEMORY_SIZE || header->memory_size > MAX_MEMORY_SIZE))) {
+        return "is corrupt";
+    }
+    return NULL;
+}
+
+static void unmap_image(ProgramImage* image) {
+#ifdef HAVE_POSIX
+    if (image->mapped) munmap(image->base, image->size);
+    else
+#endif
+    free(image->base);
+    memset(image, 0, sizeof(*image));
+}
+
+// Maps the image `f` was opened on and makes its code section the context's machine code.
+// finish_loading() then sizes memory and tries the decoded section. Returns the instruction
+// count, or -1 after printing an error.
+int load_image(CpuContext* ctx, FILE* f, const char* filename) {
+    ProgramImage image = { 0 };
+    long end = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (end < 0) {
+        fprintf(ctx->err, "[Loader Error] An error occurred while reading the file.\n");
+        return -1;
+    }
+    image.size = (size_t)end;
+#ifdef HAVE_POSIX
+    void* base = mmap(NULL, image.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (base != MAP_FAILED) {
+        image.base = base;
+        image.mapped = 1;
+    }
+#endif
+    if (image.base == NULL) {
+        image.base = malloc(image.size);
+        if (image.base == NULL || fseek(f, 0, SEEK_SET) != 0 || fread(image.base, 1, image.size, f) != image.size) {
+            fprintf(ctx->err, "[Loader Error] An error occurred while reading the file.\n");
+            free(image.base);
+            return -1;
+        }
+    }
+
+    return install_image(ctx, &image, filename);
+}
+
+// Checks a mapped or copied image and takes it over as the loaded program, entry point included.
+// The image is released on failure.
+static int install_image(CpuContext* ctx, ProgramImage* image, const char* name) {
+    const char* problem = parse_image(image);
+    if (problem != NULL) {
+        fprintf(ctx->err, "[Loader Error] '%s' %s.\n", name, problem);
+        unmap_image(image);
+        return -1;
+    }
+
+    // The buffers of a bare binary loaded before are not needed while the image is.
+    free(ctx->machine_code);
+    free(ctx->decoded_program);
+    ctx->machine_code = image->code;
+    ctx->decoded_program = NULL;
+    ctx->program_capacity = 0;
+    ctx->image = *image;
+    ctx->program_instruction_count = (int)image->header->code_length;
+    ctx->entry_pc = (int)image->header->entry_pc;
+    return ctx->program_instruction_count;
+}
+
+// Drops the loaded image, along with a decoded program allocated for it.
+void release_image(CpuContext* ctx) {
+    ProgramImage* image = &ctx->image;
+    if (image->base == NULL) return;
+    uint8_t* decoded = (uint8_t*)ctx->decoded_program;
+    if (decoded < image->base || decoded >= image->base + image->size) free(ctx->decoded_program);
+    ctx->machine_code = NULL;
+    ctx->decoded_program = NULL;
+    ctx->program_capacity = 0;
+    unmap_image(image);
+}
+
+#define ALIGN_IMAGE(offset) (((offset) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT)
+
+// Lays the loaded program out as an image with its decoded instructions, in one malloc()ed buffer
+// of *size bytes. The entry point, data segment, symbols and block index of an image it was
+// loaded from are kept. Returns NULL when out of memory.
+static uint8_t* build_image(CpuContext* ctx, size_t* size) {
+    const ProgramImage* image = &ctx->image;
+    int count = ctx->program_instruction_count;
+
+    // Wide instructions are written back as the WIDE_WORDS words they were loaded from.
+    int words = count + ctx->wide_count * (WIDE_WORDS - 1);
+    uint16_t* code = ctx->machine_code;
+    if (ctx->wide_count > 0) {
+        code = malloc(words * sizeof(uint16_t));
+        if (code == NULL) return NULL;
+        for (int pc = 0, w = 0, i = 0; pc < count; pc++) {
+            if (w < ctx->wide_count && ctx->wide_operands[w].pc == pc) {
+                uint32_t operand = (uint32_t)ctx->wide_operands[w++].operand;
+                code[i++] = WIDE_PREFIX;
+                code[i++] = ctx->machine_code[pc];
+                code[i++] = (uint16_t)(operand & 0xFFFF);
+                code[i++] = (uint16_t)(operand >> 16);
+            } else {
+                code[i++] = ctx->machine_code[pc];
+            }
+        }
+    }
+
+    ImageHeader header = { 0 };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.entry_pc = (uint32_t)ctx->entry_pc;
+    header.code_length = (uint32_t)words;
+    header.memory_size = (uint32_t)ctx->memory_size;
+    if (image->data != NULL) {
+        header.data_address = image->header->data_address;
+        header.data_length = image->header->data_length;
+    }
+
+    // The decoded instructions follow their header directly, terminal slot included.
+    ImageDecodedHeader decoded = { decoder_fingerprint(), sizeof(DecodedInstruction), (uint32_t)ctx->memory_size, decode_options(ctx) };
+    struct { uint32_t type; const void* data; size_t size; } parts[5] = {
+        { IMAGE_CODE, code, words * sizeof(uint16_t) },
+        { IMAGE_DATA, image->data, header.data_length * sizeof(int32_t) },
+        { IMAGE_SYMBOLS, image->symbols, image->symbol_count * sizeof(ImageSymbol) },
+        { IMAGE_BLOCKS, image->blocks, image->block_count * sizeof(uint32_t) },
+        { IMAGE_DECODED, ctx->decoded_program, sizeof(decoded) + ((size_t)count + 1) * sizeof(DecodedInstruction) },
+    };
+    ImageSection sections[5];
+    size_t end = IMAGE_ALIGNMENT; // The header's block.
+    for (int i = 0; i < 5; i++) {
+        if (parts[i].data == NULL) continue;
+        sections[header.section_count++] = (ImageSection){ parts[i].type, 0, ALIGN_IMAGE(end), parts[i].size };
+        end = ALIGN_IMAGE(end) + parts[i].size;
+    }
+    header.section_table = ALIGN_IMAGE(end);
+    *size = (size_t)header.section_table + header.section_count * sizeof(ImageSection);
+
+    uint8_t* buffer = calloc(1, *size);
+    if (buffer == NULL) {
+        if (code != ctx->machine_code) free(code);
+        return NULL;
+    }
+    memcpy(buffer, &header, sizeof(header));
+    for (uint32_t i = 0, part = 0; i < header.section_count; i++, part++) {
+        while (parts[part].data == NULL) part++;
+        uint8_t* data = buffer + sections[i].offset;
+        if (parts[part].type == IMAGE_DECODED) {
+            memcpy(data, &decoded, sizeof(decoded));
+            memcpy(data + sizeof(decoded), ctx->decoded_program, count * sizeof(DecodedInstruction)); // The terminal slot stays zero.
+        } else {
+            memcpy(data, parts[part].data, parts[part].size);
+        }
+    }
+    memcpy(buffer + header.section_table, sections, header.section_count * sizeof(ImageSection));
+    if (code != ctx->machine_code) free(code);
+    return buffer;
+}
+
+// Creates a new temporary file beside `to` for writing, and a malloc()ed copy of its name in
+// *temporary. The name is unique, so concurrent saves of the same file never share one. Returns
+// NULL on failure.
+static FILE* open_temporary(const char* to, char** temporary) {
+    size_t size = strlen(to) + 32;
+    char* name = malloc(size);
+    *temporary = name;
+    if (name == NULL) return NULL;
+#ifdef HAVE_POSIX
+    snprintf(name, size, "%s.XXXXXX", to);
+    int fd = mkstemp(name);
+    FILE* f = NULL;
+    if (fd >= 0) {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask); // mkstemp() creates the file 0600; give it the usual mode.
+        if ((f = fdopen(fd, "wb")) == NULL) {
+            close(fd);
+            remove(name);
+        }
+    }
+#else
+    static unsigned counter = 0;
+#ifdef _WIN32
+    snprintf(name, size, "%s.%d.%u.tmp", to, _getpid(), counter++);
+#else
+    snprintf(name, size, "%s.%u.tmp", to, counter++);
+#endif
+    FILE* f = fopen(name, "wb");
+#endif
+    if (f == NULL) {
+        free(name);
+        *temporary = NULL;
+    }
+    return f;
+}
+
+// --save-image: writes the loaded program as an image with its decoded instructions, so later runs
+// with the same memory size and options skip decoding. The file is written under a temporary name
+// first, since the program may be mapped from the file being replaced.
+int save_image(CpuContext* ctx, const char* filename) {
+    size_t size;
+    uint8_t* buffer = build_image(ctx, &size);
+    if (buffer == NULL) {
+        fprintf(ctx->err, "[Image Error] Out of memory.\n");
+        return -1;
+    }
+    char* temporary;
+    FILE* f = open_temporary(filename, &temporary);
+    if (f == NULL) {
+        fprintf(ctx->err, "[Image Error] Failed to create image file: %s\n", strerror(errno));
+        free(buffer);
+        return -1;
+    }
+    int status = fwrite(buffer, 1, size, f) == size ? 0 : -1;
+    free(buffer);
+    if (fclose(f) != 0) status = -1;
+
+    if (status == 0) {
+#ifdef _WIN32
+        remove(filename); // rename() only replaces an existing file on POSIX.
+#endif
+        status = rename(temporary, filename) == 0 ? 0 : -1;
+    }
+    if (status != 0) {
+        fprintf(ctx->err, "[Image Error] Could not write the image: %s\n", strerror(errno));
+        remove(temporary);
+        free(temporary);
+        return -1;
+    }
+    free(temporary);
+    fprintf(ctx->out, "Saved an image of %d decoded instructions to '%s'.\n", ctx->program_instruction_count, filename);
+    return 0;
+}
+
+// --- Profiler ---
+// With --profile, programs run on this loop, which counts every instruction by PC and keeps a
+// shadow call stack from CALL and RET. Each distinct stack is a node in a call tree, and the
+// instructions retired between two stack changes are charged to the node that was on top then.
+// Superinstructions stay fused and are counted once at their first PC; the rest of the group ran
+// exactly as often, so its counts are filled in afterwards. At the end the call tree
+// is written as collapsed stacks ("main;fib;fib 1234" per line, the input of flamegraph.pl),
+// and the hottest PCs are listed on the error stream. Frames are named by the labels of a
+// symbol file from the assembler (--symbols), or by PC without one.
+#define PROFILE_MAX_DEPTH 4096      // Deeper calls are charged to the frame at this depth.
+#define PROFILE_HOT_SPOTS 10        // PCs listed in the hot-spot report.
+
+typedef struct {
+    int function_pc;                // Entry PC of the frame's function (the CALL target).
+    int parent;                     // Index of the caller's node; -1 for the root.
+    int first_child;
+    int next_sibling;
+    uint64_t self;                  // Instructions retired while this was the innermost frame.
+} ProfileNode;
+
+typedef struct {
+    int address;
+    char name[64];
+} ProfileSymbol;
+
+typedef struct {
+    ProfileNode* nodes;
+    int node_count;
+    int node_capacity;
+    uint64_t* pc_count;             // Instructions retired at each PC.
+    ProfileSymbol* symbols;         // Sorted by address.
+    int symbol_count;
+} Profile;
+
+// Returns the call-tree node for calling `function_pc` from `parent`, creating it on first use.
+static int profile_child(Profile* p, int parent, int function_pc) {
+    for (int i = p->nodes[parent].first_child; i >= 0; i = p->nodes[i].next_sibling) {
+        if (p->nodes[i].function_pc == function_pc) return i;
+    }
+    if (p->node_count == p->node_capacity) {
+        int capacity = p->node_capacity * 2;
+        ProfileNode* nodes = realloc(p->nodes, capacity * sizeof(ProfileNode));
+        if (nodes == NULL) return parent; // Out of memory: charge the callee to its caller.
+        p->nodes = nodes;
+        p->node_capacity = capacity;
+    }
+    int i = p->node_count++;
+    p->nodes[i] = (ProfileNode){ function_pc, parent, -1, p->nodes[parent].first_child, 0 };
+    p->nodes[parent].first_child = i;
+    return i;
+}
+
+// Reads the "ADDRESS NAME" lines of an assembler symbol file.
+static int load_profile_symbols(Profile* p, const char* filename, FILE* err) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(err, "[Profile Error] Failed to open symbol file: %s\n", strerror(errno));
+        return -1;
+    }
+    int capacity = 0;
+    ProfileSymbol symbol;
+    while (fscanf(f, "%d %63s", &symbol.address, symbol.name) == 2) {
+        if (p->symbol_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ProfileSymbol* symbols = realloc(p->symbols, capacity * sizeof(ProfileSymbol));
+            if (symbols == NULL) break;
+            p->symbols = symbols;
+        }
+        // Insertion keeps the table sorted; the assembler already writes it in address order.
+        int i = p->symbol_count++;
+        while (i > 0 && p->symbols[i - 1].address > symbol.address) {
+            p->symbols[i] = p->symbols[i - 1];
+            i--;
+        }
+        p->symbols[i] = symbol;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Takes the labels from the symbol section of the image the program came from, if it has one.
+static void load_image_symbols(Profile* p, const ProgramImage* image) {
+    if (image->symbol_count == 0 || (p->symbols = malloc(image->symbol_count * sizeof(ProfileSymbol))) == NULL) return;
+    for (int i = 0; i < image->symbol_count; i++) {
+        ProfileSymbol symbol;
+        symbol.address = (int)image->symbols[i].address;
+        snprintf(symbol.name, sizeof(symbol.name), "%.*s", (int)sizeof(image->symbols[i].name), image->symbols[i].name);
+        int j = p->symbol_count++;
+        while (j > 0 && p->symbols[j - 1].address > symbol.address) {
+            p->symbols[j] = p->symbols[j - 1];
+            j--;
+        }
+        p->symbols[j] = symbol;
+    }
+}
+
+// Names `pc` as "label" or "label+offset" after the closest label at or below it.
+static void profile_symbol_name(const Profile* p, int pc, char* name, size_t size) {
+    int lo = 0, hi = p->symbol_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p->symbols[mid].address <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) snprintf(name, size, "pc_%d", pc);
+    else if (p->symbols[lo - 1].address == pc) snprintf(name, size, "%s", p->symbols[lo - 1].name);
+    else snprintf(name, size, "%s+%d", p->symbols[lo - 1].name, pc - p->symbols[lo - 1].address);
+}
+
+static void write_collapsed_stacks(const Profile* p, FILE* f) {
+    int* path = malloc((PROFILE_MAX_DEPTH + 1) * sizeof(int));
+    if (path == NULL) return;
+    char name[96];
+    for (int i = 0; i < p->node_count; i++) {
+        if (p->nodes[i].self == 0) continue;
+        int depth = 0;
+        for (int n = i; n >= 0; n = p->nodes[n].parent) path[depth++] = n;
+        while (depth-- > 0) {
+            profile_symbol_name(p, p->nodes[path[depth]].function_pc, name, sizeof(name));
+            fprintf(f, "%s%c", name, depth > 0 ? ';' : ' ');
+        }
+        fprintf(f, "%llu\n", (unsigned long long)p->nodes[i].self);
+    }
+    free(path);
+}
+
+static void report_hot_spots(const CpuContext* ctx, const Profile* p, uint64_t retired) {
+    FILE* out = ctx->err;
+    char name[96];
+    fprintf(out, "--- Profile ---\n");
+    fprintf(out, "Retired instructions: %llu in %d call stacks\n", (unsigned long long)retired, p->node_count);
+    fprintf(out, "Hot spots:\n");
+    // Selection of the top few; a full sort is not worth it for PROFILE_HOT_SPOTS entries.
+    uint64_t below = UINT64_MAX;
+    int last_pc = -1;
+    for (int rank = 0; rank < PROFILE_HOT_SPOTS; rank++) {
+        int best = -1;
+        for (int pc = 0; pc < ctx->program_instruction_count; pc++) {
+            uint64_t count = p->pc_count[pc];
+            if (count == 0 || count > below || (count == below && pc <= last_pc)) continue;
+            if (best < 0 || count > p->pc_count[best]) best = pc;
+        }
+        if (best < 0) break;
+        profile_symbol_name(p, best, name, sizeof(name));
+        fprintf(out, "  PC %-5d %-20s %-14s %12llu  %5.1f%%\n", best, name, opcode_names[ctx->decoded_program[best].opcode],
+            (unsigned long long)p->pc_count[best], 100.0 * p->pc_count[best] / retired);
+        below = p->pc_count[best];
+        last_pc = best;
+    }
+    fprintf(out, "---------------\n");
+}
+
+static void run_profiled(CpuContext* ctx, int pc) {
+    Profile p = { 0 };
+    p.node_capacity = 64;
+    p.nodes = malloc(p.node_capacity * sizeof(ProfileNode));
+    p.pc_count = calloc(ctx->program_instruction_count, sizeof(uint64_t));
+    int* stack = malloc(PROFILE_MAX_DEPTH * sizeof(int));
+    if (p.nodes == NULL || p.pc_count == NULL || stack == NULL) {
+        fprintf(ctx->err, "[Profile Error] Out of memory.\n");
+        free(p.nodes);
+        free(p.pc_count);
+        free(stack);
+        return;
+    }
+    p.nodes[0] = (ProfileNode){ pc, -1, -1, -1, 0 };
+    p.node_count = 1;
+    uint8_t length[HANDLER_COUNT]; // Instructions each handler retires.
+    memset(length, 1, sizeof(length));
+    for (size_t i = 0; i < sizeof(fusion_table) / sizeof(fusion_table[0]); i++) {
+        length[fusion_table[i].handler] = (uint8_t)fusion_table[i].length;
+    }
+
+    int top = 0;            // Node of the innermost frame.
+    int depth = 0;          // Frames on `stack`, plus calls past PROFILE_MAX_DEPTH.
+    uint64_t retired = 0, charged = 0;
+    const DecodedInstruction* insn = NULL;
+    while (pc >= 0 && pc < ctx->program_instruction_count) {
+        insn = &ctx->decoded_program[pc];
+        int next_pc = handler_table[unmemoized_handler(insn->handler)](ctx, insn, pc);
+        p.pc_count[pc]++;
+        retired += length[insn->handler];
+        if (insn->opcode == 0b01101 && next_pc == insn->operand) {          // CALL
+            p.nodes[top].self += retired - charged;
+            charged = retired;
+            if (depth < PROFILE_MAX_DEPTH) {
+                stack[depth] = top;
+                top = profile_child(&p, top, insn->operand);
+            }
+            depth++;
+        } else if (insn->opcode == 0b01110 && next_pc >= 0 && depth > 0) {  // RET
+            p.nodes[top].self += retired - charged;
+            charged = retired;
+            depth--;
+            if (depth < PROFILE_MAX_DEPTH) top = stack[depth];
+        }
+        pc = next_pc;
+    }
+    if (pc < 0 && insn != NULL && length[insn->handler] > 1) {
+        retired -= length[insn->handler] - 1; // Only a fused PUSH can fault, and before the rest ran.
+        p.pc_count[insn - ctx->decoded_program + 1]--;
+    }
+    p.nodes[top].self += retired - charged;
+    for (pc = ctx->program_instruction_count - 1; pc >= 0; pc--) {
+        for (int i = 1; i < length[ctx->decoded_program[pc].handler]; i++) p.pc_count[pc + i] += p.pc_count[pc];
+    }
+
+    if (symbols_filename == NULL) load_image_symbols(&p, &ctx->image);
+    if (symbols_filename == NULL || load_profile_symbols(&p, symbols_filename, ctx->err) == 0) {
+        FILE* f = fopen(profile_filename, "w");
+        if (f == NULL) {
+            fprintf(ctx->err, "[Profile Error] Failed to open profile file: %s\n", strerror(errno));
+        } else {
+            write_collapsed_stacks(&p, f);
+            fclose(f);
+        }
+        if (retired > 0) report_hot_spots(ctx, &p, retired);
+    }
+    free(p.nodes);
+    free(p.pc_count);
+    free(p.symbols);
+    free(stack);
+}
+
+// --- Batch Mode ---
+// Runs many programs in one process on a pool of workers, each with its own context. Jobs are
+// dealt out to per-worker queues in contiguous runs; a worker whose queue is empty steals from the
+// back of another worker's queue. Every job prints into private capture streams, which are copied
+// to stdout/stderr in input order once all jobs are done. INP has no input in batch mode.
+typedef struct {
+    FILE* stream;
+    char* buffer; // Backing memory when the stream is an in-memory stream.
+    size_t size;
+} OutputCapture;
+
+typedef struct {
+    const char* filename;
+    OutputCapture out;
+    OutputCapture err;
+    OutputCapture dump; // With --dump, the job's final state.
+    int status; // 0 on success, 1 if the program could not be loaded.
+} BatchJob;
+
+typedef struct {
+#ifdef HAVE_THREADS
+    mtx_t lock;
+#endif
+    int head, tail; // Job indices [head, tail) still waiting in this queue.
+} WorkQueue;
+
+typedef struct {
+    BatchJob* jobs;
+    WorkQueue* queues;
+    int worker_count;
+} BatchPool;
+
+typedef struct {
+    BatchPool* pool;
+    int index;
+} BatchWorker;
+
+static int open_capture(OutputCapture* capture) {
+#ifdef HAVE_POSIX
+    capture->stream = open_memstream(&capture->buffer, &capture->size);
+#else
+    capture->stream = tmpfile();
+#endif
+    return capture->stream != NULL;
+}
+
+// Copies everything captured to `dest` and releases the capture.
+static void flush_capture(OutputCapture* capture, FILE* dest) {
+    if (capture->stream == NULL) return;
+#ifdef HAVE_POSIX
+    fclose(capture->stream);
+    fwrite(capture->buffer, 1, capture->size, dest);
+    free(capture->buffer);
+#else
+    char chunk[4096];
+    size_t n;
+    rewind(capture->stream);
+    while ((n = fread(chunk, 1, sizeof(chunk), capture->stream)) > 0) fwrite(chunk, 1, n, dest);
+    fclose(capture->stream);
+#endif
+    capture->stream = NULL;
+}
+
+// Removes one job index from the front (owner) or back (thief) of a queue; -1 if it is empty.
+static int take_job(WorkQueue* queue, int steal) {
+    int job = -1;
+#ifdef HAVE_THREADS
+    mtx_lock(&queue->lock);
+#endif
+    if (queue->head < queue->tail) job = steal ? --queue->tail : queue->head++;
+#ifdef HAVE_THREADS
+    mtx_unlock(&queue->lock);
+#endif
+    return job;
+}
+
+static int batch_worker(void* arg) {
+    BatchWorker* worker = arg;
+    BatchPool* pool = worker->pool;
+    CpuContext* ctx = malloc(sizeof(CpuContext));
+    if (ctx == NULL) return 1;
+    init_context(ctx);
+    ctx->in = NULL;
+
+    for (;;) {
+        int job_index = take_job(&pool->queues[worker->index], 0);
+        for (int v = 1; job_index < 0 && v < pool->worker_count; v++) {
+            job_index = take_job(&pool->queues[(worker->index + v) % pool->worker_count], 1);
+        }
+        if (job_index < 0) break; // Queues only ever shrink, so every job has been claimed.
+
+        BatchJob* job = &pool->jobs[job_index];
+        ctx->out = job->out.stream;
+        ctx->err = job->err.stream;
+        if (load_binary_program(ctx, job->filename) < 0) {
+            fprintf(ctx->err, "[Fatal Error] Could not load binary file '%s'.\n", job->filename);
+            job->status = 1;
+            continue;
+        }
+        run_program(ctx);
+        job->status = ctx->watchdog.expired;
+        if (job->dump.stream != NULL && write_dump(ctx, job->dump.stream, dump_format) < 0) job->status = 1;
+    }
+
+    destroy_context(ctx);
+    free(ctx);
+    return 0;
+}
+
+static int default_thread_count() {
+#if defined(HAVE_POSIX) && defined(_SC_NPROCESSORS_ONLN)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0) return (int)cores;
+#endif
+    return DEFAULT_BATCH_THREADS;
+}
+
+// Runs every program and prints their output, and their dumps to `dump_file` if there is one, in
+// input order. Returns the process exit status.
+int run_batch(const char** filenames, int count, int thread_count, FILE* dump_file) {
+    if (thread_count <= 0) thread_count = default_thread_count();
+    if (thread_count > count) thread_count = count;
+#ifndef HAVE_THREADS
+    thread_count = 1;
+#endif
+
+    BatchPool pool;
+    pool.jobs = calloc(count, sizeof(BatchJob));
+    pool.queues = calloc(thread_count, sizeof(WorkQueue));
+    pool.worker_count = thread_count;
+    BatchWorker* workers = calloc(thread_count, sizeof(BatchWorker));
+    if (pool.jobs == NULL || pool.queues == NULL || workers == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        pool.jobs[i].filename = filenames[i];
+        if (!open_capture(&pool.jobs[i].out) || !open_capture(&pool.jobs[i].err) ||
+            (dump_file != NULL && !open_capture(&pool.jobs[i].dump))) {
+            fprintf(stderr, "[Fatal Error] Could not create an output stream for '%s'.\n", filenames[i]);
+            return 1;
+        }
+    }
+    for (int w = 0; w < thread_count; w++) {
+        pool.queues[w].head = (int)((long long)count * w / thread_count);
+        pool.queues[w].tail = (int)((long long)count * (w + 1) / thread_count);
+        workers[w].pool = &pool;
+        workers[w].index = w;
+    }
+
+#ifdef HAVE_THREADS
+    thrd_t* threads = calloc(thread_count, sizeof(thrd_t));
+    if (threads == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+    for (int w = 0; w < thread_count; w++) mtx_init(&pool.queues[w].lock, mtx_plain);
+    // Worker 0 runs on the calling thread.
+    for (int w = 1; w < thread_count; w++) {
+        if (thrd_create(&threads[w], batch_worker, &workers[w]) != thrd_success) {
+            fprintf(stderr, "[Fatal Error] Could not start worker thread %d.\n", w);
+            return 1;
+        }
+    }
+    batch_worker(&workers[0]);
+    for (int w = 1; w < thread_count; w++) thrd_join(threads[w], NULL);
+    for (int w = 0; w < thread_count; w++) mtx_destroy(&pool.queues[w].lock);
+    free(threads);
+#else
+    batch_worker(&workers[0]);
+#endif
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        printf("--- Program %d: '%s' ---\n", i + 1, pool.jobs[i].filename);
+        fflush(stdout);
+        flush_capture(&pool.jobs[i].out, stdout);
+        fflush(stdout);
+        flush_capture(&pool.jobs[i].err, stderr);
+        flush_capture(&pool.jobs[i].dump, dump_file);
+        if (status == 0) status = pool.jobs[i].status; // The first failure decides the exit status.
+    }
+
+    free(workers);
+    free(pool.queues);
+    free(pool.jobs);
+    return status;
+}
+
+// --- Run Mode ---
+// `run` takes assembly sources instead of binaries, in a simulator built together with assembler.c
+// and -DCPUSIM_WITH_ASSEMBLER: each source is assembled in memory, without a listing, and its
+// machine code goes straight to the loader, with no binary file in between. Several sources run
+// one after another in order, while a second thread assembles the sources after the one running,
+// up to RUN_PIPELINE_DEPTH ahead. Only that thread assembles, since the assembler is not reentrant.
+typedef struct {
+    uint16_t* code;                // The assembled machine code, or NULL.
+    int count;                     // Instructions in code, or -1 when the source failed.
+    char error[256];
+} AssembledSource;
+
+typedef struct {
+    const char** filenames;
+    AssembledSource* sources;
+    int count;
+    int assembled;                 // Sources [0, assembled) are ready.
+    int taken;                     // The runner has taken sources [0, taken).
+    int threaded;                  // Set by the runner alone when the assembler thread started.
+#ifdef HAVE_THREADS
+    mtx_t lock;
+    cnd_t ready;                   // Signalled when a source is assembled.
+    cnd_t room;                    // Signalled when the runner takes a source.
+#endif
+} RunPipeline;
+
+// Reads and assembles one source file into a malloc()ed array of instruction words. Returns the
+// instruction count, or -1 with the reason in `error`.
+static int assemble_source_file(const char* filename, uint16_t** code, char* error, size_t error_size) {
+    *code = NULL;
+#ifdef CPUSIM_WITH_ASSEMBLER
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        snprintf(error, error_size, "[File Error] Failed to open source file '%s': %s", filename, strerror(errno));
+        return -1;
+    }
+    char* source = NULL;
+    size_t length = 0, capacity = 0, n;
+    do {
+        if (length == capacity) {
+            char* grown = realloc(source, capacity = capacity ? capacity * 2 : IO_BUFFER_SIZE);
+            if (grown == NULL) {
+                snprintf(error, error_size, "[Fatal Error] Out of memory.");
+                free(source);
+                fclose(f);
+                return -1;
+            }
+            source = grown;
+        }
+        n = fread(source + length, 1, capacity - length, f);
+        length += n;
+    } while (n > 0);
+    int failed = ferror(f);
+    fclose(f);
+    if (failed) {
+        snprintf(error, error_size, "[File Error] An error occurred while reading '%s'.", filename);
+        free(source);
+        return -1;
+    }
+    int count = cpusim_assemble(source, length, code, error, error_size);
+    free(source);
+    return count;
+#else
+    (void)filename;
+    snprintf(error, error_size, "[Fatal Error] This simulator was built without the assembler; build it with assembler.c and -DCPUSIM_WITH_ASSEMBLER to run sources.");
+    return -1;
+#endif
+}
+
+// Assembles a source file and loads the result. Returns the instruction count, or -1.
+int load_source_program(CpuContext* ctx, const char* filename) {
+    uint16_t* code;
+    char error[256];
+    int count = assemble_source_file(filename, &code, error, sizeof(error));
+    if (count < 0) {
+        fprintf(ctx->err, "%s\n", error);
+        return -1;
+    }
+    int loaded = load_program_buffer(ctx, code, (size_t)count * sizeof(uint16_t), filename, memory_words, memory_words_set);
+    free(code);
+    return loaded;
+}
+
+static void assemble_next_source(RunPipeline* pipeline, int i) {
+    AssembledSource* source = &pipeline->sources[i];
+    source->count = assemble_source_file(pipeline->filenames[i], &source->code, source->error, sizeof(source->error));
+}
+
+#ifdef HAVE_THREADS
+static int assembler_thread(void* arg) {
+    RunPipeline* pipeline = arg;
+    for (int i = 0; i < pipeline->count; i++) {
+        mtx_lock(&pipeline->lock);
+        while (i - pipeline->taken >= RUN_PIPELINE_DEPTH) cnd_wait(&pipeline->room, &pipeline->lock);
+        mtx_unlock(&pipeline->lock);
+        assemble_next_source(pipeline, i);
+        mtx_lock(&pipeline->lock);
+        pipeline->assembled = i + 1;
+        cnd_signal(&pipeline->ready);
+        mtx_unlock(&pipeline->lock);
+    }
+    return 0;
+}
+#endif
+
+// Waits for source `i` to be assembled and takes it from the pipeline.
+static AssembledSource* take_source(RunPipeline* pipeline, int i) {
+#ifdef HAVE_THREADS
+    if (pipeline->threaded) {
+        mtx_lock(&pipeline->lock);
+        while (pipeline->assembled <= i) cnd_wait(&pipeline->ready, &pipeline->lock);
+        pipeline->taken = i + 1;
+        cnd_signal(&pipeline->room);
+        mtx_unlock(&pipeline->lock);
+        return &pipeline->sources[i];
+    }
+#endif
+    assemble_next_source(pipeline, i); // No assembler thread: assemble in turn.
+    return &pipeline->sources[i];
+}
+
+// Assembles and runs every source in order, printing each program's output under the same header
+// as batch mode, and its dump to `dump_file` if there is one. Returns the process exit status.
+int run_sources(const char** filenames, int count, FILE* dump_file) {
+    RunPipeline pipeline = { 0 };
+    pipeline.filenames = filenames;
+    pipeline.count = count;
+    pipeline.sources = calloc(count, sizeof(AssembledSource));
+    CpuContext* ctx = malloc(sizeof(CpuContext));
+    if (pipeline.sources == NULL || ctx == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+    init_context(ctx);
+
+#ifdef HAVE_THREADS
+    thrd_t thread;
+    mtx_init(&pipeline.lock, mtx_plain);
+    cnd_init(&pipeline.ready);
+    cnd_init(&pipeline.room);
+    pipeline.threaded = thrd_create(&thread, assembler_thread, &pipeline) == thrd_success;
+#endif
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        AssembledSource* source = take_source(&pipeline, i);
+        printf("--- Program %d: '%s' ---\n", i + 1, filenames[i]);
+        fflush(stdout);
+        int job_status = 1;
+        if (source->count < 0) fprintf(stderr, "%s\n", source->error);
+        if (source->count < 0 || load_program_buffer(ctx, source->code, (size_t)source->count * sizeof(uint16_t), filenames[i], memory_words, memory_words_set) < 0) {
+            fprintf(stderr, "[Fatal Error] Could not load source file '%s'.\n", filenames[i]);
+        } else {
+            run_program(ctx);
+            job_status = ctx->watchdog.expired;
+            if (dump_file != NULL && write_dump(ctx, dump_file, dump_format) < 0) job_status = 1;
+        }
+        fflush(stdout);
+        free(source->code);
+        source->code = NULL;
+        if (status == 0) status = job_status; // The first failure decides the exit status.
+    }
+
+#ifdef HAVE_THREADS
+    if (pipeline.threaded) thrd_join(thread, NULL);
+    cnd_destroy(&pipeline.room);
+    cnd_destroy(&pipeline.ready);
+    mtx_destroy(&pipeline.lock);
+#endif
+    destroy_context(ctx);
+    free(ctx);
+    free(pipeline.sources);
+    return status;
+}
+
+// --- Serve Mode ---
+// --serve stays resident and runs jobs in the protocol of isa.h, read from stdin or from the
+// clients of a Unix socket. A reader per connection parses requests into a bounded queue, a pool of
+// workers runs them, each on its own context as in batch mode, and every response is written as
+// soon as its job ends. Loaded programs are cached as images with their decoded instructions,
+// keyed by a hash of the bytes they came from, so a repeated job skips assembly and decoding.
+// Assembly source is accepted when the simulator is built together with assembler.c and
+// -DCPUSIM_WITH_ASSEMBLER.
+typedef struct {
+    FILE* in;
+    FILE* out;
+    int owned;                     // in and out belong to the connection and are closed with it.
+    int pending;                   // The reader, plus jobs whose responses are not written yet.
+    int failed;                    // A write failed, so later responses are dropped.
+#ifdef HAVE_THREADS
+    mtx_t lock;                    // Guards pending and keeps responses whole.
+#endif
+} ServeConnection;
+
+typedef struct ServeJob {
+    ServeConnection* connection;
+    ServeRequest request;
+    const int32_t* input;          // The request body follows the job in the same block.
+    const uint8_t* program;
+    size_t program_size;
+    struct ServeJob* next;
+} ServeJob;
+
+typedef struct CacheEntry {
+    uint64_t hash;
+    uint32_t kind;
+    uint8_t* key;                  // The program bytes and the image, in one block.
+    size_t key_size;
+    uint8_t* image;
+    size_t image_size;
+    int users;                     // Workers loading from the image; evicted only once they are done.
+    struct CacheEntry* newer;      // Recency list, newest first.
+    struct CacheEntry* older;
+    struct CacheEntry* next;       // Bucket chain.
+} CacheEntry;
+
+typedef struct {
+    int32_t* values;
+    uint32_t count;
+    uint32_t capacity;
+    int dropped;                   // OUT values that did not fit a response.
+} ServeOutput;
+
+typedef struct {
+    ServeJob* head;                // Requests waiting for a worker, oldest first.
+    ServeJob* tail;
+    int length;
+    int closed;                    // No more requests will come; workers exit once the queue drains.
+    CacheEntry** buckets;
+    int bucket_count;              // A power of two, at least twice serve_cache_entries.
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    int entry_count;
+#ifdef HAVE_THREADS
+    mtx_t lock;                    // Guards the queue.
+    cnd_t ready;                   // Signalled when a request is queued or the queue closes.
+    cnd_t room;                    // Signalled when a worker takes a request.
+    mtx_t cache_lock;
+    mtx_t assembler_lock;          // cpusim_assemble() keeps its state in globals.
+#else
+    CpuContext* context;           // Runs every job on the reader's thread.
+#endif
+} ServeState;
+
+static ServeState serve;
+
+// FNV-1a, 64-bit, over the program kind and bytes.
+static uint64_t hash_program(uint32_t kind, const uint8_t* bytes, size_t size) {
+    uint64_t hash = (14695981039346656037ull ^ kind) * 1099511628211ull;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+static void unlink_entry(CacheEntry* entry) {
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else serve.newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else serve.oldest = entry->newer;
+}
+
+static void push_newest(CacheEntry* entry) {
+    entry->newer = NULL;
+    entry->older = serve.newest;
+    if (serve.newest != NULL) serve.newest->newer = entry;
+    else serve.oldest = entry;
+    serve.newest = entry;
+}
+
+// Looks for a cached program with these bytes. The caller holds cache_lock.
+static CacheEntry* find_entry(uint64_t hash, uint32_t kind, const uint8_t* key, size_t size) {
+    CacheEntry* entry = serve.buckets[hash & (serve.bucket_count - 1)];
+    while (entry != NULL && (entry->hash != hash || entry->kind != kind || entry->key_size != size || memcmp(entry->key, key, size) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+// Returns the cached program for these bytes, marked as in use and made the newest, or NULL.
+static CacheEntry* acquire_entry(uint64_t hash, uint32_t kind, const uint8_t* key, size_t size) {
+    if (serve.buckets == NULL) return NULL;
+#ifdef HAVE_THREADS
+    mtx_lock(&serve.cache_lock);
+#endif
+    CacheEntry* entry = find_entry(hash, kind, key, size);
+    if (entry != NULL) {
+        entry->users++;
+        unlink_entry(entry);
+        push_newest(entry);
+    }
+#ifdef HAVE_THREADS
+    mtx_unlock(&serve.cache_lock);
+#endif
+    return entry;
+}
+
+static void release_entry(CacheEntry* entry) {
+#ifdef HAVE_THREADS
+    mtx_lock(&serve.cache_lock);
+#endif
+    entry->users--;
+#ifdef HAVE_THREADS
+    mtx_unlock(&serve.cache_lock);
+#endif
+}
+
+// Caches the image built for these bytes, evicting the least recently used programs nobody is
+// loading. Another worker may have cached the same program meanwhile, and then that copy is kept.
+static void insert_entry(uint64_t hash, uint32_t kind, const uint8_t* key, size_t size, const uint8_t* image, size_t image_size) {
+    if (serve.buckets == NULL) return;
+    CacheEntry* entry = malloc(sizeof(CacheEntry));
+    uint8_t* block = entry != NULL ? malloc(size + image_size) : NULL;
+    if (block == NULL) {
+        free(entry);
+        return;
+    }
+    *entry = (CacheEntry){ hash, kind, block, size, block + size, image_size, 0, NULL, NULL, NULL };
+    memcpy(entry->key, key, size);
+    memcpy(entry->image, image, image_size);
+
+#ifdef HAVE_THREADS
+    mtx_lock(&serve.cache_lock);
+#endif
+    if (find_entry(hash, kind, key, size) != NULL) {
+        free(entry->key);
+        free(entry);
+    } else {
+        CacheEntry** bucket = &serve.buckets[hash & (serve.bucket_count - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        push_newest(entry);
+        serve.entry_count++;
+    }
+    for (CacheEntry* victim = serve.oldest; serve.entry_count > serve_cache_entries && victim != NULL; ) {
+        CacheEntry* newer = victim->newer;
+        if (victim->users == 0) {
+            CacheEntry** link = &serve.buckets[victim->hash & (serve.bucket_count - 1)];
+            while (*link != victim) link = &(*link)->next;
+            *link = victim->next;
+            unlink_entry(victim);
+            free(victim->key);
+            free(victim);
+            serve.entry_count--;
+        }
+        victim = newer;
+    }
+#ifdef HAVE_THREADS
+    mtx_unlock(&serve.cache_lock);
+#endif
+}
+
+// Loads a job's program into `ctx`, from the cache when the same bytes were loaded before.
+// Returns 1 for a cached program, 0 for a fresh one, or -1 after reporting why on ctx->err.
+static int load_serve_program(CpuContext* ctx, const ServeJob* job) {
+    uint32_t kind = job->request.kind;
+    uint64_t hash = hash_program(kind, job->program, job->program_size);
+    CacheEntry* entry = acquire_entry(hash, kind, job->program, job->program_size);
+    if (entry != NULL) {
+        int loaded = load_program_buffer(ctx, entry->image, entry->image_size, "cached program", memory_words, memory_words_set);
+        release_entry(entry);
+        return loaded < 0 ? -1 : 1;
+    }
+
+    const void* code = job->program;
+    size_t code_size = job->program_size;
+    uint16_t* assembled = NULL;
+    if (kind == SERVE_SOURCE) {
+#ifdef CPUSIM_WITH_ASSEMBLER
+        char error[256];
+#ifdef HAVE_THREADS
+        mtx_lock(&serve.assembler_lock);
+#endif
+        int count = cpusim_assemble((const char*)job->program, job->program_size, &assembled, error, sizeof(error));
+#ifdef HAVE_THREADS
+        mtx_unlock(&serve.assembler_lock);
+#endif
+        if (count < 0) {
+            fprintf(ctx->err, "%s\n", error);
+            return -1;
+        }
+        code = assembled;
+        code_size = (size_t)count * sizeof(uint16_t);
+#else
+        fprintf(ctx->err, "[Serve Error] This simulator was built without the assembler; send machine code.\n");
+        return -1;
+#endif
+    } else if (kind != SERVE_BINARY) {
+        fprintf(ctx->err, "[Serve Error] Unknown program kind %u.\n", (unsigned)kind);
+        return -1;
+    }
+    int loaded = load_program_buffer(ctx, code, code_size, "program", memory_words, memory_words_set);
+    free(assembled);
+    if (loaded < 0) return -1;
+
+    size_t image_size;
+    uint8_t* image = serve.buckets != NULL ? build_image(ctx, &image_size) : NULL;
+    if (image != NULL) insert_entry(hash, kind, job->program, job->program_size, image, image_size);
+    free(image);
+    return 0;
+}
+
+static void collect_output(void* user, int value) {
+    ServeOutput* output = user;
+    if (output->count == output->capacity) {
+        uint32_t capacity = output->capacity ? output->capacity * 2 : 256;
+        int32_t* grown = capacity <= SERVE_MAX_REQUEST / sizeof(int32_t) ? realloc(output->values, capacity * sizeof(int32_t)) : NULL;
+        if (grown == NULL) {
+            output->dropped++;
+            return;
+        }
+        output->values = grown;
+        output->capacity = capacity;
+    }
+    output->values[output->count++] = value;
+}
+
+// Drops one reference to a connection, closing it after the last.
+static void release_connection(ServeConnection* connection) {
+#ifdef HAVE_THREADS
+    mtx_lock(&connection->lock);
+#endif
+    int last = --connection->pending == 0;
+#ifdef HAVE_THREADS
+    mtx_unlock(&connection->lock);
+#endif
+    if (!last) return;
+    if (connection->owned) {
+        fclose(connection->in);
+        fclose(connection->out);
+    } else {
+        fflush(connection->out);
+    }
+#ifdef HAVE_THREADS
+    mtx_destroy(&connection->lock);
+#endif
+    free(connection);
+}
+
+static void write_response(ServeConnection* connection, ServeResponse* response, const int32_t* output, const char* message) {
+    response->length = (uint32_t)(sizeof(*response) - sizeof(response->length) + response->output_count * sizeof(int32_t) + response->message_length);
+#ifdef HAVE_THREADS
+    mtx_lock(&connection->lock);
+#endif
+    if (!connection->failed &&
+        (fwrite(response, sizeof(*response), 1, connection->out) != 1 ||
+         fwrite(output, sizeof(int32_t), response->output_count, connection->out) != response->output_count ||
+         fwrite(message, 1, response->message_length, connection->out) != response->message_length || fflush(connection->out) != 0)) {
+        connection->failed = 1; // The client went away.
+    }
+#ifdef HAVE_THREADS
+    mtx_unlock(&connection->lock);
+#endif
+}
+
+// Runs one job on a worker's context and answers it.
+static void run_serve_job(CpuContext* ctx, ServeJob* job) {
+    ServeResponse response = { 0 };
+    ServeOutput output = { 0 };
+    OutputCapture err = { 0 };
+    response.request_id = job->request.request_id;
+    ctx->err = open_capture(&err) ? err.stream : stderr;
+    ctx->out = ctx->err;
+    ctx->io.input = job->input;
+    ctx->io.input_count = (int)job->request.input_count;
+    ctx->io.output_fn = collect_output;
+    ctx->io.user = &output;
+
+    int loaded = load_serve_program(ctx, job);
+    if (loaded < 0) {
+        response.status = SERVE_ERROR;
+    } else {
+        uint64_t budget = job->request.budget;
+        reset_cpu(ctx);
+        arm_watchdog(ctx, budget == 0 ? run_budget : budget > INT64_MAX ? INT64_MAX : (long long)budget, run_deadline);
+        ctx->faulted = 0;
+        run_engine(ctx, ctx->entry_pc);
+        response.status = ctx->watchdog.expired == EXIT_BUDGET ? SERVE_BUDGET : ctx->watchdog.expired == EXIT_DEADLINE ? SERVE_DEADLINE :
+                          ctx->faulted ? SERVE_FAULTED : SERVE_HALTED;
+        response.cached = loaded == 1;
+    }
+    if (output.dropped > 0) fprintf(ctx->err, "[Serve Error] %d OUT values did not fit the response.\n", output.dropped);
+    response.output_count = output.count;
+
+    // The captured error stream becomes the message.
+    char* message = NULL;
+    if (err.stream != NULL) {
+#ifdef HAVE_POSIX
+        fclose(err.stream);
+        message = err.buffer;
+        response.message_length = (uint32_t)err.size;
+#else
+        long size = ftell(err.stream);
+        message = size > 0 ? malloc(size) : NULL;
+        rewind(err.stream);
+        if (message != NULL) response.message_length = (uint32_t)fread(message, 1, size, err.stream);
+        fclose(err.stream);
+#endif
+    }
+    ctx->err = stderr;
+    ctx->out = stderr;
+    write_response(job->connection, &response, output.values, message);
+    release_connection(job->connection);
+    free(message);
+    free(output.values);
+    free(job);
+}
+
+static void submit_job(ServeJob* job) {
+#ifdef HAVE_THREADS
+    mtx_lock(&serve.lock);
+    while (serve.length >= SERVE_QUEUE_LENGTH) cnd_wait(&serve.room, &serve.lock);
+    job->next = NULL;
+    if (serve.tail != NULL) serve.tail->next = job;
+    else serve.head = job;
+    serve.tail = job;
+    serve.length++;
+    cnd_signal(&serve.ready);
+    mtx_unlock(&serve.lock);
+#else
+    run_serve_job(serve.context, job);
+#endif
+}
+
+// Reads requests off a connection until it ends or sends something that is not a request.
+static int serve_reader(void* arg) {
+    ServeConnection* connection = arg;
+    ServeRequest request;
+    const size_t fixed = sizeof(request) - sizeof(request.length);
+    while (fread(&request, sizeof(request), 1, connection->in) == 1) {
+        if (request.length < fixed || request.length > SERVE_MAX_REQUEST || request.input_count > (request.length - fixed) / sizeof(int32_t)) {
+            fprintf(stderr, "[Serve Error] Malformed request %u; closing the connection.\n", (unsigned)request.request_id);
+            break;
+        }
+        size_t body = request.length - fixed;
+        ServeJob* job = malloc(sizeof(ServeJob) + body);
+        if (job == NULL) {
+            fprintf(stderr, "[Serve Error] Out of memory for request %u; closing the connection.\n", (unsigned)request.request_id);
+            break;
+        }
+        if (fread(job + 1, 1, body, connection->in) != body) {
+            free(job);
+            break;
+        }
+        job->connection = connection;
+        job->request = request;
+        job->input = (const int32_t*)(job + 1);
+        job->program = (const uint8_t*)(job->input + request.input_count);
+        job->program_size = body - request.input_count * sizeof(int32_t);
+#ifdef HAVE_THREADS
+        mtx_lock(&connection->lock);
+#endif
+        connection->pending++;
+#ifdef HAVE_THREADS
+        mtx_unlock(&connection->lock);
+#endif
+        submit_job(job);
+    }
+    release_connection(connection);
+    return 0;
+}
+
+static ServeConnection* open_connection(FILE* in, FILE* out, int owned) {
+    ServeConnection* connection = calloc(1, sizeof(ServeConnection));
+    if (connection == NULL || in == NULL || out == NULL) {
+        if (owned && in != NULL) fclose(in);
+        if (owned && out != NULL) fclose(out);
+        free(connection);
+        return NULL;
+    }
+    connection->in = in;
+    connection->out = out;
+    connection->owned = owned;
+    connection->pending = 1; // The reader.
+#ifdef HAVE_THREADS
+    mtx_init(&connection->lock, mtx_plain);
+#endif
+    return connection;
+}
+
+static CpuContext* create_serve_context() {
+    CpuContext* ctx = malloc(sizeof(CpuContext));
+    if (ctx == NULL) return NULL;
+    init_context(ctx);
+    ctx->in = NULL;
+    ctx->io.headless = 1;
+    ctx->io.binary = 0;
+    ctx->watched = 1; // Every job may bring a budget.
+    return ctx;
+}
+
+#ifdef HAVE_THREADS
+static int serve_worker(void* arg) {
+    CpuContext* ctx = arg;
+    for (;;) {
+        mtx_lock(&serve.lock);
+        while (serve.head == NULL && !serve.closed) cnd_wait(&serve.ready, &serve.lock);
+        ServeJob* job = serve.head;
+        if (job != NULL) {
+            serve.head = job->next;
+            if (serve.head == NULL) serve.tail = NULL;
+            serve.length--;
+            cnd_signal(&serve.room);
+        }
+        mtx_unlock(&serve.lock);
+        if (job == NULL) break;
+        run_serve_job(ctx, job);
+    }
+    destroy_context(ctx);
+    free(ctx);
+    return 0;
+}
+#endif
+
+// Accepts clients until the listening socket fails; each gets a reader thread.
+static int serve_socket(const char* path) {
+#ifdef HAVE_POSIX
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "[Serve Error] Socket path '%s' is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // A socket left by an earlier server.
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "[Serve Error] Could not listen on '%s': %s\n", path, strerror(errno));
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up only fails its own writes.
+    fprintf(stderr, "Serving on '%s'.\n", path);
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "[Serve Error] Could not accept a connection: %s\n", strerror(errno));
+            break;
+        }
+        int write_fd = dup(fd);
+        ServeConnection* connection = open_connection(fdopen(fd, "rb"), write_fd >= 0 ? fdopen(write_fd, "wb") : NULL, 1);
+        if (connection == NULL) {
+            fprintf(stderr, "[Serve Error] Could not set up a connection.\n");
+            continue;
+        }
+#ifdef HAVE_THREADS
+        thrd_t reader;
+        if (thrd_create(&reader, serve_reader, connection) == thrd_success) thrd_detach(reader);
+        else serve_reader(connection);
+#else
+        serve_reader(connection);
+#endif
+    }
+    close(listener);
+    unlink(path);
+    return 1;
+#else
+    fprintf(stderr, "[Serve Error] Unix sockets are not available on this host; use --serve with stdin.\n");
+    return 1;
+#endif
+}
+
+// Serves until stdin ends, or for as long as the socket listens. Returns the exit status.
+int run_serve(const char* socket_path, int thread_count) {
+    if (thread_count <= 0) thread_count = default_thread_count();
+    if (serve_cache_entries > 0) {
+        serve.bucket_count = 1;
+        while (serve.bucket_count < 2 * serve_cache_entries) serve.bucket_count *= 2;
+        serve.buckets = calloc(serve.bucket_count, sizeof(CacheEntry*));
+        if (serve.buckets == NULL) {
+            fprintf(stderr, "[Fatal Error] Out of memory.\n");
+            return 1;
+        }
+    }
+
+#ifdef HAVE_THREADS
+    mtx_init(&serve.lock, mtx_plain);
+    cnd_init(&serve.ready);
+    cnd_init(&serve.room);
+    mtx_init(&serve.cache_lock, mtx_plain);
+    mtx_init(&serve.assembler_lock, mtx_plain);
+    thrd_t* workers = calloc(thread_count, sizeof(thrd_t));
+    int started = 0;
+    for (; workers != NULL && started < thread_count; started++) {
+        CpuContext* ctx = create_serve_context();
+        if (ctx == NULL || thrd_create(&workers[started], serve_worker, ctx) != thrd_success) {
+            free(ctx);
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "[Fatal Error] Could not start any serve workers.\n");
+        return 1;
+    }
+#else
+    serve.context = create_serve_context();
+    if (serve.context == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        return 1;
+    }
+#endif
+
+    int status = 0;
+    if (socket_path != NULL) {
+        status = serve_socket(socket_path);
+    } else {
+        ServeConnection* connection = open_connection(stdin, stdout, 0);
+        if (connection == NULL) status = 1;
+        else serve_reader(connection);
+    }
+
+    // Let the workers finish what was queued.
+#ifdef HAVE_THREADS
+    mtx_lock(&serve.lock);
+    serve.closed = 1;
+    cnd_broadcast(&serve.ready);
+    mtx_unlock(&serve.lock);
+    for (int w = 0; w < started; w++) thrd_join(workers[w], NULL);
+    free(workers);
+#else
+    destroy_context(serve.context);
+    free(serve.context);
+#endif
+    while (serve.oldest != NULL) {
+        CacheEntry* entry = serve.oldest;
+        unlink_entry(entry);
+        free(entry->key);
+        free(entry);
+    }
+    free(serve.buckets);
+    return status;
+}
+
+// --- Vector Mode ---
+// Runs one program over many input vectors, VECTOR_LANES instances at a time. Instance state is
+// kept as structure-of-arrays (regs[r][lane], memory[address][lane]) and every instruction is
+// applied to all lanes at once under a lane mask, in plain loops the compiler turns into SIMD code
+// for the target (SSE/AVX2/AVX-512/NEON; build with -O3 -march=native for the widest). When lanes
+// take different branches, the group with the lowest PC runs next, so lanes meet up again at the
+// first common PC (loop exits, join points) and continue together.
+typedef struct {
+    int* values;
+    int count, capacity;
+} IntList;
+
+typedef struct {
+    int regs[NUM_REGISTERS][VECTOR_LANES];
+    int cmp[VECTOR_LANES];                  // Last comparison result, as in Flags.
+    int pc[VECTOR_LANES];
+    int mask[VECTOR_LANES];                 // -1 for lanes in the group being executed, else 0.
+    int* memory;                            // memory[address * VECTOR_LANES + lane].
+    IntList input[VECTOR_LANES];            // INP values of each lane's instance.
+    int input_pos[VECTOR_LANES];
+    IntList output[VECTOR_LANES];           // OUT values produced by each lane's instance.
+    int instance[VECTOR_LANES];             // Input line number of the instance in each lane.
+    int lane_count;                         // Lanes holding an instance in this chunk.
+} VectorState;
+
+static int append_int(IntList* list, int value) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        int* values = realloc(list->values, capacity * sizeof(int));
+        if (values == NULL) return 0;
+        list->values = values;
+        list->capacity = capacity;
+    }
+    list->values[list->count++] = value;
+    return 1;
+}
+
+// Reads a whole line of any length into *line, growing it as needed. Returns 0 at end of file.
+static int read_line(FILE* f, char** line, size_t* capacity) {
+    size_t length = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (length + 2 > *capacity) {
+            size_t grown = *capacity ? *capacity * 2 : 256;
+            char* buffer = realloc(*line, grown);
+            if (buffer == NULL) break;
+            *line = buffer;
+            *capacity = grown;
+        }
+        (*line)[length++] = (char)c;
+        if (c == '\n') break;
+    }
+    if (length == 0) return 0;
+    (*line)[length] = '\0';
+    return 1;
+}
+
+// Parses one line of whitespace-separated integers into `list`.
+static void parse_input_line(const char* line, IntList* list) {
+    list->count = 0;
+    for (;;) {
+        char* end;
+        long value = strtol(line, &end, 10);
+        if (end == line) break;
+        append_int(list, (int)value);
+        line = end;
+    }
+}
+
+// Lane-parallel kernels. The body may refer to the lane index l; results are merged under the mask.
+#define FOR_LANES(...) for (int l = 0; l < VECTOR_LANES; l++) { __VA_ARGS__; }
+#define BLEND(dst, value) ((dst) = ((dst) & ~m[l]) | ((value) & m[l]))
+
+// Block instructions, one lane at a time down that lane's column of memory.
+#define LANE_BLOCK_FITS(address, count) ((count) >= 0 && (address) >= 0 && (count) <= ctx->memory_size - (address))
+static int vector_block_lanes(CpuContext* ctx, VectorState* v, const DecodedInstruction* insn, int pc) {
+    for (int l = 0; l < VECTOR_LANES; l++) {
+        if (!v->mask[l]) continue;
+        int a = v->regs[insn->reg1][l], b = v->regs[insn->reg2][l], count = v->regs[insn->operand][l];
+        int* column = v->memory + l; // Word i of this lane is column[i * VECTOR_LANES].
+        if (!LANE_BLOCK_FITS(a, count) || (insn->opcode != OP_MEMSET && !LANE_BLOCK_FITS(b, count))) {
+            int first = LANE_BLOCK_FITS(a, count) ? 0 : 1;
+            fprintf(ctx->err, "[Memory Error] Instance %d: Attempted to %s invalid memory block of %d words at address %d.\n",
+                v->instance[l], first && insn->opcode != OP_MEMCMP ? "write to" : "read", count, first ? a : b);
+            continue;
+        }
+        switch (insn->opcode) {
+            case OP_MEMCPY:
+                if (a <= b) { for (int i = 0; i < count; i++) column[(size_t)(a + i) * VECTOR_LANES] = column[(size_t)(b + i) * VECTOR_LANES]; }
+                else { for (int i = count - 1; i >= 0; i--) column[(size_t)(a + i) * VECTOR_LANES] = column[(size_t)(b + i) * VECTOR_LANES]; }
+                break;
+            case OP_MEMSET:
+                for (int i = 0; i < count; i++) column[(size_t)(a + i) * VECTOR_LANES] = b;
+                break;
+            default: {
+                int result = 0;
+                for (int i = 0; i < count && result == 0; i++) {
+                    int x = column[(size_t)(a + i) * VECTOR_LANES], y = column[(size_t)(b + i) * VECTOR_LANES];
+                    result = (x > y) - (x < y);
+                }
+                v->cmp[l] = result;
+                break;
+            }
+        }
+    }
+    return pc + 1;
+}
+#undef LANE_BLOCK_FITS
+
+// Instructions that divide, touch memory or do I/O run one lane at a time.
+static int vector_step_lanes(CpuContext* ctx, VectorState* v, const DecodedInstruction* insn, int pc) {
+    if (insn->opcode >= OPCODE_COUNT) return vector_block_lanes(ctx, v, insn, pc);
+    int* d = v->regs[insn->reg1];
+    int* s = v->regs[insn->reg2];
+    int* esp = v->regs[7];
+    const int imm = insn->operand;
+    int next = -2; // The shared next PC while every lane agrees, -1 once they differ.
+
+    for (int l = 0; l < VECTOR_LANES; l++) {
+        if (!v->mask[l]) continue;
+        int lane_next = pc + 1, address = 0, is_access = 1, is_write = 0;
+
+        // Work out which memory word (if any) the instruction touches for this lane.
+        switch (insn->opcode) {
+            case 0b00111: address = imm; break;
+            case 0b01000: address = imm; is_write = 1; break;
+            case 0b01111: address = s[l] + imm; break;
+            case 0b11111: address = s[l] + imm; is_write = 1; break;
+            case 0b01011: case 0b01101: address = esp[l] - 1; is_write = 1; break;
+            case 0b01100: case 0b01110: address = esp[l]; break;
+            default: is_access = 0; break;
+        }
+        int in_range = address >= 0 && address < ctx->memory_size;
+        int* word = &v->memory[(size_t)(in_range ? address : 0) * VECTOR_LANES + l];
+        if (is_access && !in_range) {
+            fprintf(ctx->err, "[Memory Error] Instance %d: Attempted to %s invalid memory address %d.\n",
+                v->instance[l], is_write ? "write to" : "read", address);
+        }
+        int loaded = (is_access && !is_write && in_range) ? *word : 0;
+
+        switch (insn->opcode) {
+            case 0b00010:
+                if (s[l] == 0) {
+                    fprintf(ctx->err, "[Runtime Error] Instance %d: Division by zero at PC %d.\n", v->instance[l], pc);
+                    lane_next = -1;
+                } else {
+                    d[l] /= s[l];
+                }
+                break;
+            case 0b00100:
+                if (v->input_pos[l] < v->input[l].count) {
+                    d[l] = v->input[l].values[v->input_pos[l]++];
+                } else {
+                    fprintf(ctx->err, "[Runtime Error] Instance %d: Invalid integer input.\n", v->instance[l]);
+                    d[l] = 0;
+                }
+                break;
+            case 0b00101: append_int(&v->output[l], d[l]); break;
+            case 0b00111: case 0b01111: d[l] = loaded; break;
+            case 0b01000: case 0b11111: if (in_range) *word = d[l]; break;
+            case 0b01011: esp[l]--; if (in_range) *word = d[l]; break;
+            case 0b01100: d[l] = loaded; esp[l]++; break;
+            case 0b01101: esp[l]--; if (in_range) *word = pc + 1; lane_next = imm; break;
+            case 0b01110: esp[l]++; lane_next = loaded; break;
+            default: break;
+        }
+        v->pc[l] = lane_next;
+        if (next == -2) next = lane_next;
+        else if (next != lane_next) next = -1;
+    }
+    return next;
+}
+
+// Executes the instruction at `pc` for every lane in the mask. Returns the next PC when all of
+// them move on to the same place, or -1 after storing a separate next PC into each lane's pc[].
+static int vector_step(CpuContext* ctx, VectorState* v, int pc) {
+    const DecodedInstruction* insn = &ctx->decoded_program[pc];
+    int* d = v->regs[insn->reg1];
+    int* s = v->regs[insn->reg2];
+    const int* m = v->mask;
+    const int imm = insn->operand;
+    int taken[VECTOR_LANES];
+
+    switch (insn->opcode) {
+        case 0b00000: FOR_LANES(BLEND(v->pc[l], -1)) return -1; // HLT
+        case 0b00001: FOR_LANES(BLEND(d[l], d[l] * s[l])) return pc + 1;
+        case 0b00011: FOR_LANES(BLEND(d[l], d[l] ^ s[l])) return pc + 1;
+        case 0b00110: FOR_LANES(BLEND(d[l], imm)) return pc + 1;
+        case 0b01001: FOR_LANES(BLEND(d[l], d[l] + 1)) return pc + 1;
+        case 0b01010: FOR_LANES(BLEND(d[l], d[l] - 1)) return pc + 1;
+        case 0b10000: FOR_LANES(BLEND(d[l], d[l] + s[l])) return pc + 1;
+        case 0b10001: FOR_LANES(BLEND(d[l], d[l] - s[l])) return pc + 1;
+        case 0b10010: FOR_LANES(BLEND(d[l], s[l])) return pc + 1;
+        case 0b10011: FOR_LANES(BLEND(d[l], d[l] + imm)) return pc + 1;
+        case 0b10100: FOR_LANES(BLEND(d[l], d[l] - imm)) return pc + 1;
+        case 0b10110: FOR_LANES(BLEND(d[l], ~d[l])) return pc + 1;
+        case 0b10101: FOR_LANES(BLEND(v->cmp[l], d[l] - imm)) return pc + 1;
+        case 0b10111: FOR_LANES(BLEND(v->cmp[l], d[l] - s[l])) return pc + 1;
+        case 0b11000: return imm;
+        case 0b11001: FOR_LANES(taken[l] = -(v->cmp[l] == 0) & m[l]) break;
+        case 0b11010: FOR_LANES(taken[l] = -(v->cmp[l] != 0) & m[l]) break;
+        case 0b11011: FOR_LANES(taken[l] = -(v->cmp[l] > 0) & m[l]) break;
+        case 0b11100: FOR_LANES(taken[l] = -(v->cmp[l] < 0) & m[l]) break;
+        case 0b11101: FOR_LANES(taken[l] = -(v->cmp[l] >= 0) & m[l]) break;
+        case 0b11110: FOR_LANES(taken[l] = -(v->cmp[l] <= 0) & m[l]) break;
+        default: return vector_step_lanes(ctx, v, insn, pc);
+    }
+
+    // Conditional jump: stay together if every lane in the group agrees, otherwise split.
+    int any = 0, all = -1;
+    FOR_LANES(any |= taken[l], all &= taken[l] | ~m[l])
+    if (all) return imm;
+    if (!any) return pc + 1;
+    FOR_LANES(BLEND(v->pc[l], taken[l] ? imm : pc + 1))
+    return -1;
+}
+
+#undef BLEND
+#undef FOR_LANES
+
+// Runs the lanes of one chunk until every instance has left the program. The group keeps running
+// without rescanning lanes while it moves to a single PC below that of every waiting lane.
+static void vector_run_chunk(CpuContext* ctx, VectorState* v) {
+    const int count = ctx->program_instruction_count;
+    int pc = -1, waiting_pc = count;
+
+    for (;;) {
+        if (pc < 0) {
+            // The new group is every unfinished lane sitting at the lowest PC.
+            pc = count;
+            for (int l = 0; l < v->lane_count; l++) {
+                if (v->pc[l] >= 0 && v->pc[l] < pc) pc = v->pc[l];
+            }
+            if (pc == count) return;
+            waiting_pc = count;
+            for (int l = 0; l < VECTOR_LANES; l++) {
+                int live = l < v->lane_count && v->pc[l] >= 0 && v->pc[l] < count;
+                v->mask[l] = (live && v->pc[l] == pc) ? -1 : 0;
+                if (live && v->pc[l] != pc && v->pc[l] < waiting_pc) waiting_pc = v->pc[l];
+            }
+        }
+
+        int next = vector_step(ctx, v, pc);
+        if (next >= 0 && next < waiting_pc) {
+            pc = next;
+            continue;
+        }
+        // Park the group at its next PC (if shared) and regroup.
+        if (next >= 0) {
+            for (int l = 0; l < VECTOR_LANES; l++) {
+                if (v->mask[l]) v->pc[l] = next;
+            }
+        }
+        pc = -1;
+    }
+}
+
+static void vector_flush_chunk(CpuContext* ctx, VectorState* v) {
+    for (int l = 0; l < v->lane_count; l++) {
+        for (int i = 0; i < v->output[l].count; i++) {
+            fprintf(ctx->out, i == 0 ? "%d" : " %d", v->output[l].values[i]);
+        }
+        fputc('\n', ctx->out);
+    }
+}
+
+// Reads one instance per line of `input_filename`, runs them all and prints one line of OUT
+// values per instance, in input order. Returns the process exit status.
+int run_vector(CpuContext* ctx, const char* input_filename) {
+    FILE* f = fopen(input_filename, "r");
+    if (f == NULL) {
+        fprintf(ctx->err, "[Loader Error] Failed to open input vector file: %s\n", strerror(errno));
+        return 1;
+    }
+    VectorState* v = calloc(1, sizeof(VectorState));
+    size_t memory_words = (size_t)ctx->memory_size * VECTOR_LANES;
+    if (v == NULL || (v->memory = alloc_guest_memory(memory_words)) == NULL) {
+        fprintf(ctx->err, "[Fatal Error] Out of memory.\n");
+        free(v);
+        fclose(f);
+        return 1;
+    }
+    int fresh = 1;
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    int instance = 0, done = 0;
+    while (!done) {
+        v->lane_count = 0;
+        while (v->lane_count < VECTOR_LANES) {
+            if (!read_line(f, &line, &line_capacity)) {
+                done = 1;
+                break;
+            }
+            int l = v->lane_count++;
+            parse_input_line(line, &v->input[l]);
+            v->input_pos[l] = 0;
+            v->output[l].count = 0;
+            v->instance[l] = ++instance;
+        }
+        if (v->lane_count == 0) break;
+
+        // Every lane starts from the same reset state as run_program().
+        memset(v->regs, 0, sizeof(v->regs));
+        for (int l = 0; l < VECTOR_LANES; l++) v->cmp[l] = 1;
+        for (int l = 0; l < VECTOR_LANES; l++) v->pc[l] = ctx->entry_pc;
+        if (!fresh) clear_guest_memory(v->memory, memory_words);
+        fresh = 0;
+        if (ctx->image.data != NULL) {
+            for (uint32_t a = 0; a < ctx->image.header->data_length; a++) {
+                for (int l = 0; l < VECTOR_LANES; l++) v->memory[(size_t)(ctx->image.header->data_address + a) * VECTOR_LANES + l] = ctx->image.data[a];
+            }
+        }
+        for (int l = 0; l < VECTOR_LANES; l++) v->regs[6][l] = v->regs[7][l] = ctx->memory_size;
+
+        vector_run_chunk(ctx, v);
+        vector_flush_chunk(ctx, v);
+    }
+
+    free(line);
+    fclose(f);
+    for (int l = 0; l < VECTOR_LANES; l++) {
+        free(v->input[l].values);
+        free(v->output[l].values);
+    }
+    free_guest_memory(v->memory, memory_words);
+    free(v);
+    return 0;
+}
+
+// --- Headless I/O ---
+// Reads every whitespace-separated integer from `filename` (stdin when NULL) into a new array for
+// the headless INP channel. Returns NULL after printing an error.
+int* read_input_values(const char* filename, int* count) {
+    FILE* f = filename != NULL ? fopen(filename, "r") : stdin;
+    if (f == NULL) {
+        fprintf(stderr, "[Loader Error] Failed to open input file: %s\n", strerror(errno));
+        return NULL;
+    }
+    int capacity = 256, value, matched;
+    int* values = malloc(capacity * sizeof(int));
+    *count = 0;
+    while (values != NULL && (matched = fscanf(f, "%d", &value)) == 1) {
+        if (*count == capacity) {
+            int* grown = realloc(values, 2 * capacity * sizeof(int));
+            if (grown == NULL) {
+                free(values);
+                values = NULL;
+                break;
+            }
+            values = grown;
+            capacity *= 2;
+        }
+        values[(*count)++] = value;
+    }
+    if (values == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+    } else if (matched != EOF) {
+        fprintf(stderr, "[Loader Error] Input contains a value that is not an integer (after %d values).\n", *count);
+        free(values);
+        values = NULL;
+    }
+    if (f != stdin) fclose(f);
+    return values;
+}
+
+// Writes out any buffered headless OUT values.
+void flush_output(CpuContext* ctx) {
+    IoChannel* io = &ctx->io;
+    if (io->length == 0) return;
+    FILE* sink = io->sink != NULL ? io->sink : ctx->out;
+    if (fwrite(io->buffer, 1, io->length, sink) != io->length) {
+        fprintf(ctx->err, "[Runtime Error] Failed to write program output.\n");
+    }
+    io->length = 0;
+}
+
+// --- Guest Memory ---
+// Main memory is reserved as demand-zero pages: the host only backs the pages a program touches,
+// and clearing it swaps in fresh zero pages instead of writing every word, so setup and reset cost
+// follow the memory actually used rather than the configured size (see also Dirty Pages).
+int* alloc_guest_memory(size_t words) {
+#ifdef HAVE_POSIX
+    void* memory = mmap(NULL, words * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+#else
+    return calloc(words, sizeof(int));
+#endif
+}
+
+void clear_guest_memory(int* memory, size_t words) {
+    size_t bytes = words * sizeof(int);
+#ifdef HAVE_POSIX
+    // Remapping in place drops the touched pages; small memories are quicker to clear directly.
+    if (bytes > MEMSET_RESET_LIMIT &&
+        mmap(memory, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+        return;
+    }
+#endif
+    memset(memory, 0, bytes);
+}
+
+void free_guest_memory(int* memory, size_t words) {
+    if (memory == NULL) return;
+#ifdef HAVE_POSIX
+    munmap(memory, words * sizeof(int));
+#else
+    (void)words;
+    free(memory);
+#endif
+}
+
+// --- Dirty Pages ---
+// Stores mark the page they land in (MARK_DIRTY), so between back-to-back runs reset_cpu() only
+// clears the pages the last run wrote, and a dump only compares those pages against the previous
+// dump. The map is one byte per page so the mark is a single store, also in translated code.
+// Bytes of the dirty map for `words` of memory, rounded up so the map can be scanned 8 pages at a time.
+static size_t dirty_pages(int words) {
+    size_t pages = ((size_t)words + (1 << DIRTY_PAGE_SHIFT) - 1) >> DIRTY_PAGE_SHIFT;
+    return (pages + 7) & ~(size_t)7;
+}
+
+// Replaces main memory with `words` zero words and an empty dirty map. Returns 0, or -1 when out of
+// memory, which leaves the old memory alone.
+static int resize_memory(CpuContext* ctx, int words) {
+    int* memory = alloc_guest_memory(words);
+    uint8_t* dirty = calloc(dirty_pages(words), 1);
+    if (memory == NULL || dirty == NULL) {
+        free_guest_memory(memory, words);
+        free(dirty);
+        return -1;
+    }
+    free_guest_memory(ctx->memory, ctx->memory_size);
+    free_guest_memory(ctx->dump_base, ctx->memory_size);
+    free(ctx->dirty);
+    ctx->memory = memory;
+    ctx->dirty = dirty;
+    ctx->dump_base = NULL;
+    ctx->memory_size = words;
+    ctx->memory_mask = words - 1;
+    return 0;
+}
+
+// Marks `count` words from `address` dirty; with --mask-addresses the block may wrap.
+static void mark_dirty_block(CpuContext* ctx, int address, int count) {
+    if (count <= 0) return;
+    if (ctx->masked_addresses) {
+        address &= ctx->memory_mask;
+        if (count >= ctx->memory_size) count = ctx->memory_size;
+        if (count > ctx->memory_size - address) {
+            mark_dirty_block(ctx, 0, count - (ctx->memory_size - address));
+            count = ctx->memory_size - address;
+        }
+    }
+    size_t first = (size_t)address >> DIRTY_PAGE_SHIFT, last = ((size_t)address + count - 1) >> DIRTY_PAGE_SHIFT;
+    memset(ctx->dirty + first, 1, last - first + 1);
+}
+
+// Zeroes the dirty pages of memory, and of the dump base with them, and empties the map. Once more
+// than DIRTY_RESET_LIMIT bytes have been cleared, the rest of memory gets fresh pages instead, as
+// clear_guest_memory() does.
+static void clear_dirty_memory(CpuContext* ctx) {
+    size_t pages = dirty_pages(ctx->memory_size), cleared = 0;
+    for (size_t p = 0; p < pages; p += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, ctx->dirty + p, 8);
+        if (chunk == 0) continue;
+        for (size_t q = p; q < p + 8; q++) {
+            if (!ctx->dirty[q]) continue;
+            size_t first = q << DIRTY_PAGE_SHIFT, words = (size_t)ctx->memory_size - first;
+            if (words > (size_t)1 << DIRTY_PAGE_SHIFT) words = (size_t)1 << DIRTY_PAGE_SHIFT;
+            if ((cleared += words * sizeof(int)) > DIRTY_RESET_LIMIT) {
+                clear_guest_memory(ctx->memory, ctx->memory_size);
+                if (ctx->dump_base != NULL) clear_guest_memory(ctx->dump_base, ctx->memory_size);
+                memset(ctx->dirty, 0, pages);
+                return;
+            }
+            memset(ctx->memory + first, 0, words * sizeof(int));
+            if (ctx->dump_base != NULL) memset(ctx->dump_base + first, 0, words * sizeof(int));
+            ctx->dirty[q] = 0;
+        }
+    }
+}
+
+// --- Snapshots ---
+// A snapshot is the CPU state at one PC plus an image of main memory. Both live in one file:
+// a SnapshotHeader, then the raw memory words at SNAPSHOT_MEMORY_OFFSET. On POSIX hosts guest
+// memory is mapped privately from that image, so pages stay shared with the file until the
+// program writes them. Restoring maps the image again, which only costs the pages touched since
+// the snapshot. --save-snapshot writes the same layout to disk, and --load-snapshot maps it
+// straight back in for a warm start.
+#define SNAPSHOT_MAGIC "CPUSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304  // Memory words are stored in the byte order of the host.
+#define SNAPSHOT_MEMORY_OFFSET 65536    // Page-aligned for host pages up to 64 KB.
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;                // SNAPSHOT_BYTE_ORDER, as written by the saving host.
+    uint32_t program_hash;              // FNV-1a of the machine code the snapshot belongs to.
+    int32_t program_instruction_count;
+    int32_t memory_size;
+    int32_t pc;
+    int32_t flags_result;
+    int32_t regs[NUM_REGISTERS];
+} SnapshotHeader;
+
+typedef struct {
+    SnapshotHeader header;
+    FILE* file;                         // Holds the memory image; owned by the snapshot.
+} Snapshot;
+
+static uint32_t program_hash(const CpuContext* ctx) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < ctx->program_instruction_count; i++) {
+        hash = (hash ^ (ctx->machine_code[i] & 0xFF)) * 16777619u;
+        hash = (hash ^ (ctx->machine_code[i] >> 8)) * 16777619u;
+    }
+    for (int i = 0; i < ctx->wide_count; i++) hash = (hash ^ (uint32_t)ctx->wide_operands[i].operand) * 16777619u;
+    return hash;
+}
+
+// Makes guest memory a private copy of the snapshot's memory image.
+static int map_snapshot_memory(CpuContext* ctx, const Snapshot* snapshot) {
+    size_t bytes = (size_t)ctx->memory_size * sizeof(int);
+    mark_dirty_block(ctx, 0, ctx->memory_size);
+#ifdef HAVE_POSIX
+    if (mmap(ctx->memory, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(snapshot->file), SNAPSHOT_MEMORY_OFFSET) != MAP_FAILED) {
+        return 0;
+    }
+#endif
+    if (fseek(snapshot->file, SNAPSHOT_MEMORY_OFFSET, SEEK_SET) != 0 || fread(ctx->memory, 1, bytes, snapshot->file) != bytes) {
+        fprintf(ctx->err, "[Snapshot Error] Could not read the memory image.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Captures the CPU state at `pc` into `file`, which the snapshot then owns. Returns 0 on success.
+int take_snapshot(CpuContext* ctx, int pc, FILE* file, Snapshot* snapshot) {
+    SnapshotHeader* header = &snapshot->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header->version = SNAPSHOT_VERSION;
+    header->byte_order = SNAPSHOT_BYTE_ORDER;
+    header->program_hash = program_hash(ctx);
+    header->program_instruction_count = ctx->program_instruction_count;
+    header->memory_size = ctx->memory_size;
+    header->pc = pc;
+    header->flags_result = ctx->flags.result;
+    memcpy(header->regs, ctx->registers.regs, sizeof(header->regs));
+    snapshot->file = file;
+
+    size_t bytes = (size_t)ctx->memory_size * sizeof(int);
+    if (fwrite(header, sizeof(*header), 1, file) != 1 || fseek(file, SNAPSHOT_MEMORY_OFFSET, SEEK_SET) != 0 ||
+        fwrite(ctx->memory, 1, bytes, file) != bytes || fflush(file) != 0) {
+        fprintf(ctx->err, "[Snapshot Error] Could not write the snapshot: %s\n", strerror(errno));
+        return -1;
+    }
+    return map_snapshot_memory(ctx, snapshot);
+}
+
+// Returns the CPU to the snapshot's state and gives the PC to resume from, or -1.
+int restore_snapshot(CpuContext* ctx, const Snapshot* snapshot) {
+    memcpy(ctx->registers.regs, snapshot->header.regs, sizeof(ctx->registers.regs));
+    ctx->flags.result = snapshot->header.flags_result;
+    if (map_snapshot_memory(ctx, snapshot) < 0) return -1;
+    return snapshot->header.pc;
+}
+
+// Opens a snapshot saved by --save-snapshot for the program loaded in `ctx`, resizing memory to
+// match it. Returns 0 on success.
+int open_snapshot(CpuContext* ctx, const char* filename, Snapshot* snapshot) {
+    SnapshotHeader* header = &snapshot->header;
+    snapshot->file = fopen(filename, "rb");
+    if (snapshot->file == NULL) {
+        fprintf(ctx->err, "[Snapshot Error] Failed to open snapshot file: %s\n", strerror(errno));
+        return -1;
+    }
+    const char* problem = NULL;
+    if (fread(header, sizeof(*header), 1, snapshot->file) != 1 || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        problem = "is not a snapshot";
+    } else if (header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER) {
+        problem = "was written by an incompatible version or host";
+    } else if (header->program_hash != program_hash(ctx) || header->program_instruction_count != ctx->program_instruction_count) {
+        problem = "was taken from a different program";
+    } else if (header->memory_size < MEMORY_SIZE || header->memory_size > MAX_MEMORY_SIZE ||
+               header->pc < 0 || header->pc > ctx->program_instruction_count) {
+        problem = "is corrupt";
+    }
+    if (problem != NULL) {
+        fprintf(ctx->err, "[Snapshot Error] '%s' %s.\n", filename, problem);
+        fclose(snapshot->file);
+        return -1;
+    }
+
+    if (header->memory_size != ctx->memory_size) {
+        if (resize_memory(ctx, header->memory_size) < 0) {
+            fprintf(ctx->err, "[Snapshot Error] Could not reserve %d words of memory.\n", header->memory_size);
+            fclose(snapshot->file);
+            return -1;
+        }
+        verify_memory_accesses(ctx); // The proven address range changed.
+        watch_branches(ctx);
+    }
+    return 0;
+}
+
+void close_snapshot(Snapshot* snapshot) {
+    if (snapshot->file != NULL) fclose(snapshot->file);
+    snapshot->file = NULL;
+}
+
+// Runs from a reset CPU until the program is about to execute `stop_pc`. Steps one instruction at
+// a time, so the stop is exact even inside a superinstruction. Returns -1 if the program ends first.
+static int run_to_pc(CpuContext* ctx, int stop_pc) {
+    reset_cpu(ctx);
+    arm_watchdog(ctx, run_budget, run_deadline);
+    int pc = ctx->entry_pc;
+    while (pc >= 0 && pc < ctx->program_instruction_count && pc != stop_pc) {
+        const DecodedInstruction* insn = &ctx->decoded_program[pc];
+        pc = handler_table[unfused_handler(insn)](ctx, insn, pc);
+    }
+    report_watchdog(ctx);
+    flush_output(ctx);
+    return pc == stop_pc ? pc : -1;
+}
+
+// Drives --snapshot-at/--save-snapshot/--load-snapshot/--explore. Returns the exit status.
+int run_snapshot_mode(CpuContext* ctx, int snapshot_pc, const char* save_filename, const char* load_filename, const char* explore_filename) {
+    Snapshot snapshot = { 0 };
+    int pc;
+
+    if (load_filename != NULL) {
+        if (open_snapshot(ctx, load_filename, &snapshot) < 0) return 1;
+    } else {
+        if (run_to_pc(ctx, snapshot_pc) < 0) {
+            fprintf(ctx->err, "[Snapshot Error] The program ended before reaching PC %d.\n", snapshot_pc);
+            return 1;
+        }
+        FILE* file = save_filename != NULL ? fopen(save_filename, "w+b") : tmpfile();
+        if (file == NULL) {
+            fprintf(ctx->err, "[Snapshot Error] Failed to create snapshot file: %s\n", strerror(errno));
+            return 1;
+        }
+        if (take_snapshot(ctx, snapshot_pc, file, &snapshot) < 0) {
+            close_snapshot(&snapshot);
+            return 1;
+        }
+        if (save_filename != NULL && explore_filename == NULL) {
+            fprintf(ctx->out, "Saved snapshot at PC %d to '%s'.\n", snapshot_pc, save_filename);
+            close_snapshot(&snapshot);
+            return 0;
+        }
+    }
+
+    if (explore_filename == NULL) {
+        // A warm start: carry on from the loaded snapshot.
+        pc = restore_snapshot(ctx, &snapshot);
+        if (pc >= 0) resume_program(ctx, pc);
+        close_snapshot(&snapshot);
+        return pc >= 0 ? 0 : 1;
+    }
+
+    // One continuation per line of the explore file, each from the same snapshot and with that
+    // line's integers as its INP values.
+    FILE* f = fopen(explore_filename, "r");
+    if (f == NULL) {
+        fprintf(ctx->err, "[Loader Error] Failed to open explore file: %s\n", strerror(errno));
+        close_snapshot(&snapshot);
+        return 1;
+    }
+    char* line = NULL;
+    size_t line_capacity = 0;
+    IntList input = { 0 };
+    int status = 0;
+    ctx->io.headless = 1;
+    for (int n = 1; status == 0 && read_line(f, &line, &line_capacity); n++) {
+        parse_input_line(line, &input);
+        ctx->io.input = input.values;
+        ctx->io.input_count = input.count;
+        ctx->io.input_pos = 0;
+        fprintf(ctx->out, "--- Continuation %d ---\n", n);
+        pc = restore_snapshot(ctx, &snapshot);
+        if (pc < 0) status = 1;
+        else resume_program(ctx, pc);
+    }
+    free(input.values);
+    free(line);
+    fclose(f);
+    close_snapshot(&snapshot);
+    return status;
+}
+
+// --- Library API ---
+// The cpusim.h interface over a context of its own. Library contexts are headless, always decode
+// with watched branches so any run can be given a budget, and stop between runs at a PC to resume
+// from.
+struct CpuSim {
+    CpuContext ctx;
+    int pc;                        // Where the next run or step starts.
+    CpuSimStatus status;
+    int memory_words;              // Memory size to load programs with.
+    int memory_forced;             // memory_words overrides the size an image asks for.
+};
+
+CpuSim* cpusim_create(int memory_words) {
+    if (memory_words != 0 && (memory_words < MEMORY_SIZE || memory_words > MAX_MEMORY_SIZE)) return NULL;
+    CpuSim* sim = malloc(sizeof(CpuSim));
+    if (sim == NULL) return NULL;
+    CpuContext* ctx = &sim->ctx;
+    init_context(ctx);
+    ctx->in = NULL;
+    ctx->io.headless = 1;
+    ctx->io.binary = 0;
+    ctx->masked_addresses = 0;
+    ctx->watched = 1;
+    ctx->engine = ENGINE_THREADED;
+    sim->pc = 0;
+    sim->status = CPUSIM_HALTED;
+    sim->memory_words = memory_words != 0 ? memory_words : MEMORY_SIZE;
+    sim->memory_forced = memory_words != 0;
+    return sim;
+}
+
+void cpusim_destroy(CpuSim* sim) {
+    if (sim == NULL) return;
+    destroy_context(&sim->ctx);
+    free(sim);
+}
+
+int cpusim_load(CpuSim* sim, const void* program, size_t size) {
+    int instructions = load_program_buffer(&sim->ctx, program, size, "program", sim->memory_words, sim->memory_forced);
+    if (instructions < 0) sim->ctx.program_instruction_count = 0; // Nothing half-loaded may run.
+    cpusim_reset(sim);
+    return instructions;
+}
+
+void cpusim_reset(CpuSim* sim) {
+    CpuContext* ctx = &sim->ctx;
+    if (ctx->memory != NULL) reset_cpu(ctx);
+    sim->pc = ctx->entry_pc;
+    sim->status = ctx->program_instruction_count > 0 ? CPUSIM_RUNNING : CPUSIM_HALTED;
+}
+
+// Records how a run or step that reached `pc` left the program.
+static CpuSimStatus cpusim_stopped(CpuSim* sim, int pc) {
+    CpuContext* ctx = &sim->ctx;
+    flush_output(ctx);
+    if (pc >= 0 && pc < ctx->program_instruction_count) sim->pc = pc;
+    else sim->status = ctx->faulted ? CPUSIM_FAULTED : CPUSIM_HALTED;
+    return sim->status;
+}
+
+CpuSimStatus cpusim_run(CpuSim* sim, long long budget) {
+    CpuContext* ctx = &sim->ctx;
+    if (sim->status != CPUSIM_RUNNING) return sim->status;
+    arm_watchdog(ctx, budget, 0);
+    ctx->faulted = 0;
+    run_engine(ctx, sim->pc);
+    return cpusim_stopped(sim, ctx->watchdog.expired ? ctx->watchdog.stop_pc : -1);
+}
+
+// Runs the unfused handler, as run_to_pc() does, so a step never covers several instructions.
+CpuSimStatus cpusim_step(CpuSim* sim) {
+    CpuContext* ctx = &sim->ctx;
+    if (sim->status != CPUSIM_RUNNING) return sim->status;
+    if (sim->pc >= ctx->program_instruction_count) return cpusim_stopped(sim, -1);
+    const DecodedInstruction* insn = &ctx->decoded_program[sim->pc];
+    arm_watchdog(ctx, 0, 0);
+    ctx->faulted = 0;
+    return cpusim_stopped(sim, handler_table[unfused_handler(insn)](ctx, insn, sim->pc));
+}
+
+CpuSimStatus cpusim_status(const CpuSim* sim) { return sim->status; }
+
+int cpusim_get_register(const CpuSim* sim, int reg) {
+    return reg >= 0 && reg < NUM_REGISTERS ? sim->ctx.registers.regs[reg] : 0;
+}
+
+void cpusim_set_register(CpuSim* sim, int reg, int value) {
+    if (reg >= 0 && reg < NUM_REGISTERS) sim->ctx.registers.regs[reg] = value;
+}
+
+int cpusim_get_pc(const CpuSim* sim) { return sim->pc; }
+
+int cpusim_set_pc(CpuSim* sim, int pc) {
+    if (pc < 0 || pc >= sim->ctx.program_instruction_count) return -1;
+    sim->pc = pc;
+    sim->status = CPUSIM_RUNNING;
+    return 0;
+}
+
+int cpusim_get_flags(const CpuSim* sim) {
+    return (FLAG_ZF(sim->ctx.flags) ? CPUSIM_FLAG_ZF : 0) | (FLAG_SF(sim->ctx.flags) ? CPUSIM_FLAG_SF : 0);
+}
+
+int cpusim_memory_size(const CpuSim* sim) { return sim->ctx.memory_size; }
+
+int cpusim_read_memory(const CpuSim* sim, int address, int* value) {
+    if (address < 0 || address >= sim->ctx.memory_size) return -1;
+    *value = sim->ctx.memory[address];
+    return 0;
+}
+
+int cpusim_write_memory(CpuSim* sim, int address, int value) {
+    if (address < 0 || address >= sim->ctx.memory_size) return -1;
+    sim->ctx.memory[address] = value;
+    MARK_DIRTY(&sim->ctx, address);
+    return 0;
+}
+
+int cpusim_dump(CpuSim* sim, FILE* file, CpuSimDumpFormat format) {
+    if (sim->ctx.memory == NULL) return -1;
+    return write_dump(&sim->ctx, file, (DumpFormat)format);
+}
+
+void cpusim_set_io(CpuSim* sim, CpuSimInput input, CpuSimOutput output, void* user) {
+    sim->ctx.io.input_fn = input;
+    sim->ctx.io.output_fn = output;
+    sim->ctx.io.user = user;
+}
+
+void cpusim_set_error_stream(CpuSim* sim, FILE* err) { sim->ctx.err = err != NULL ? err : stderr; }
+
+void cpusim_set_engine(CpuSim* sim, CpuSimEngine engine) { sim->ctx.engine = (Engine)engine; }
+
+// --- Utility Functions ---
+void write_memory(CpuContext* ctx, int address, int data) {
+    if (address >= 0 && address < ctx->memory_size) {
+        ctx->memory[address] = data;
+        MARK_DIRTY(ctx, address);
+    } else {
+        fprintf(ctx->err, "[Memory Error] Attempted to write to invalid memory address %d.\n", address);
+    }
+}
+
+int read_memory(CpuContext* ctx, int address) {
+    if (address >= 0 && address < ctx->memory_size) return ctx->memory[address];
+    fprintf(ctx->err, "[Memory Error] Attempted to read invalid memory address %d.\n", address);
+    return 0;
+}
+
+void dump_contents(CpuContext* ctx, FILE* f) {
+    const Registers* r = &ctx->registers;
+    fprintf(f, "\n--- CPU State Dump ---\n");
+    fprintf(f, "Registers: EAX=%-5d EBX=%-5d ECX=%-5d EDX=%-5d\n", r->EAX, r->EBX, r->ECX, r->EDX);
+    fprintf(f, "           ESI=%-5d EDI=%-5d EBP=%-5d ESP=%-5d\n", r->ESI, r->EDI, r->EBP, r->ESP);
+    fprintf(f, "Flags:     ZF=%d SF=%d\n", FLAG_ZF(ctx->flags), FLAG_SF(ctx->flags));
+    fprintf(f, "Memory Contents (%d words):\n", ctx->memory_size);
+    for (int i = 0; i < ctx->memory_size; ++i) {
+        if (i % 8 == 0) fprintf(f, "  [%02d]:", i);
+        fprintf(f, " %5d", ctx->memory[i]);
+        if ((i + 1) % 8 == 0 || i == ctx->memory_size - 1) fprintf(f, "\n");
+    }
+    fprintf(f, "----------------------\n");
+}
+
+// Collects the words of the dirty pages that differ from the dump base, in address order, and
+// brings the base up to date. Returns the change count, or -1 when out of memory.
+static int collect_changes(CpuContext* ctx, DumpChange** changes) {
+    *changes = NULL;
+    if (ctx->dump_base == NULL && (ctx->dump_base = alloc_guest_memory(ctx->memory_size)) == NULL) return -1;
+    int count = 0, capacity = 0;
+    size_t pages = dirty_pages(ctx->memory_size);
+    for (size_t p = 0; p < pages; p++) {
+        if (!ctx->dirty[p]) continue;
+        int first = (int)(p << DIRTY_PAGE_SHIFT), end = first + (1 << DIRTY_PAGE_SHIFT);
+        if (end > ctx->memory_size) end = ctx->memory_size;
+        if (memcmp(ctx->memory + first, ctx->dump_base + first, (size_t)(end - first) * sizeof(int)) == 0) continue;
+        for (int a = first; a < end; a++) {
+            if (ctx->memory[a] == ctx->dump_base[a]) continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                DumpChange* grown = realloc(*changes, (size_t)capacity * sizeof(DumpChange));
+                if (grown == NULL) {
+                    free(*changes);
+                    *changes = NULL;
+                    return -1;
+                }
+                *changes = grown;
+            }
+            (*changes)[count].address = (uint32_t)a;
+            (*changes)[count].value = ctx->memory[a];
+            count++;
+            ctx->dump_base[a] = ctx->memory[a];
+        }
+    }
+    return count;
+}
+
+// Flushes a dump to `f` and reports a failed write. Returns -1 if `status` or the stream show one.
+static int finish_dump(CpuContext* ctx, FILE* f, int status) {
+    if (fflush(f) != 0 || ferror(f)) status = -1;
+    if (status != 0) fprintf(ctx->err, "[Dump Error] Could not write the dump: %s\n", strerror(errno));
+    return status;
+}
+
+// Writes the registers, flags and memory to `f`: all of memory as text, or in the other formats
+// only the words that changed since the previous dump (or since the reset, for the first). Returns
+// 0, or -1 after reporting an error, including a write that failed or fell short.
+int write_dump(CpuContext* ctx, FILE* f, DumpFormat format) {
+    int status = 0;
+    if (format == DUMP_TEXT) {
+        dump_contents(ctx, f);
+        return finish_dump(ctx, f, status);
+    }
+    DumpChange* changes;
+    int count = collect_changes(ctx, &changes);
+    if (count < 0) {
+        fprintf(ctx->err, "[Dump Error] Out of memory.\n");
+        return -1;
+    }
+    if (format == DUMP_JSON) {
+        fprintf(f, "{\"registers\":{");
+        for (int r = 0; r < NUM_REGISTERS; r++) fprintf(f, "%s\"%s\":%d", r ? "," : "", register_names[r], ctx->registers.regs[r]);
+        fprintf(f, "},\"ZF\":%d,\"SF\":%d,\"memory_size\":%d,\"changes\":[", FLAG_ZF(ctx->flags), FLAG_SF(ctx->flags), ctx->memory_size);
+        for (int i = 0; i < count; i++) fprintf(f, "%s[%u,%d]", i ? "," : "", changes[i].address, changes[i].value);
+        fprintf(f, "]}\n");
+    } else {
+        DumpHeader header = { 0 };
+        memcpy(header.magic, DUMP_MAGIC, sizeof(DUMP_MAGIC));
+        header.version = DUMP_VERSION;
+        header.byte_order = DUMP_BYTE_ORDER;
+        memcpy(header.regs, ctx->registers.regs, sizeof(header.regs));
+        header.flags = (FLAG_ZF(ctx->flags) ? DUMP_FLAG_ZF : 0) | (FLAG_SF(ctx->flags) ? DUMP_FLAG_SF : 0);
+        header.memory_size = (uint32_t)ctx->memory_size;
+        header.change_count = (uint32_t)count;
+        if (fwrite(&header, sizeof(header), 1, f) != 1) status = -1;
+        if (status == 0 && count > 0 && fwrite(changes, sizeof(DumpChange), count, f) != (size_t)count) status = -1;
     }
-    printf("----------------------\n");
+    free(changes);
+    return finish_dump(ctx, f, status);
 }
@@ -0,0 +1,158 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "isa.h"
+
+// --- Configuration Constants ---
+#define MAX_LABEL_LENGTH 64     // Maximum character length of a symbol name.
+#define READ_CHUNK_RECORDS 4096 // Trace records read from the file at a time.
+
+// --- Core Data Structures ---
+
+// One label of an assembler symbol file.
+typedef struct {
+    char name[MAX_LABEL_LENGTH];
+    int address;
+} Symbol;
+
+// --- Global State Variables ---
+
+Symbol* symbols = NULL; // Labels sorted by address, if a symbol file was given.
+int symbol_count = 0;
+
+// --- Function Prototypes ---
+int  load_symbols(const char* filename);
+void format_location(int pc, char* text, size_t size);
+void disassemble(uint16_t word, char* text, size_t size);
+void print_record(uint64_t index, const TraceRecord* record);
+
+
+int main(int argc, char* argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <trace file> [symbol file]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3 && load_symbols(argv[2]) < 0) return 1;
+
+    FILE* f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "[File Error] Failed to open trace file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "[File Error] '%s' is not a trace file.\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord) || header.byte_order != TRACE_BYTE_ORDER) {
+        fprintf(stderr, "[File Error] '%s' was written by an incompatible simulator or host.\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    TraceRecord* records = malloc(READ_CHUNK_RECORDS * sizeof(TraceRecord));
+    if (records == NULL) {
+        fprintf(stderr, "[Fatal Error] Out of memory.\n");
+        fclose(f);
+        return 1;
+    }
+    if (header.first_record > 0) printf("... %llu earlier records were not kept ...\n", (unsigned long long)header.first_record);
+    uint64_t index = header.first_record;
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), READ_CHUNK_RECORDS, f)) > 0) {
+        for (size_t i = 0; i < count; i++) print_record(index++, &records[i]);
+    }
+
+    free(records);
+    fclose(f);
+    free(symbols);
+    return 0;
+}
+
+// Reads the "ADDRESS NAME" lines the assembler writes, keeping them sorted by address.
+int load_symbols(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "[File Error] Failed to open symbol file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int capacity = 0;
+    Symbol symbol;
+    while (fscanf(f, "%d %63s", &symbol.address, symbol.name) == 2) {
+        if (symbol_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            Symbol* grown = realloc(symbols, capacity * sizeof(Symbol));
+            if (grown == NULL) break;
+            symbols = grown;
+        }
+        int i = symbol_count++;
+        while (i > 0 && symbols[i - 1].address > symbol.address) {
+            symbols[i] = symbols[i - 1];
+            i--;
+        }
+        symbols[i] = symbol;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Names `pc` as "label" or "label+offset" after the closest label at or below it.
+void format_location(int pc, char* text, size_t size) {
+    int lo = 0, hi = symbol_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].address <= pc) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) snprintf(text, size, "%d", pc);
+    else if (symbols[lo - 1].address == pc) snprintf(text, size, "%s", symbols[lo - 1].name);
+    else snprintf(text, size, "%s+%d", symbols[lo - 1].name, pc - symbols[lo - 1].address);
+}
+
+// Turns an instruction word back into the assembly it was encoded from.
+void disassemble(uint16_t word, char* text, size_t size) {
+    const InstructionForm* form = (word >> 11) == 0 && BLOCK_OP(word) != 0 ? &block_forms[BLOCK_OP(word) - 1] : &instruction_forms[word >> 11];
+    const char* reg1 = register_names[(word >> 8) & 0x7];
+    const char* reg2 = register_names[(word >> 5) & 0x7];
+    int value = word & 0xFF;
+    int offset = word & 0x1F;
+    char target[MAX_LABEL_LENGTH + 16];
+
+    switch (form->form) {
+        case FORM_NONE: snprintf(text, size, "%s", form->mnemonic); break;
+        case FORM_REG: snprintf(text, size, "%s %s", form->mnemonic, reg1); break;
+        case FORM_ADDR:
+            format_location(value, target, sizeof(target));
+            snprintf(text, size, "%s %s", form->mnemonic, target);
+            break;
+        case FORM_REG_REG: snprintf(text, size, "%s %s, %s", form->mnemonic, reg1, reg2); break;
+        case FORM_REG_IMM: snprintf(text, size, "%s %s, #%d", form->mnemonic, reg1, value); break;
+        case FORM_REG_ADDR: snprintf(text, size, "%s %s, [%d]", form->mnemonic, reg1, value); break;
+        case FORM_ADDR_REG: snprintf(text, size, "%s [%d], %s", form->mnemonic, value, reg1); break;
+        case FORM_REG_BASE_OFF: snprintf(text, size, "%s %s, [%s+%d]", form->mnemonic, reg1, reg2, offset); break;
+        case FORM_BASE_OFF_REG: snprintf(text, size, "%s [%s+%d], %s", form->mnemonic, reg2, offset, reg1); break;
+        case FORM_REG_REG_REG: snprintf(text, size, "%s %s, %s, %s", form->mnemonic, reg1, reg2, register_names[word & 0x7]); break;
+    }
+}
+
+// Prints one record: its index, PC, disassembly and what the instruction changed or read.
+void print_record(uint64_t index, const TraceRecord* record) {
+    char location[MAX_LABEL_LENGTH + 16];
+    char text[MAX_LABEL_LENGTH + 32];
+    format_location(record->pc, location, sizeof(location));
+    disassemble(record->word, text, sizeof(text));
+
+    int has_details = record->reg != TRACE_NO_REGISTER || record->flags != 0;
+    printf(has_details ? "%10llu  %-16s %-24s" : "%10llu  %-16s %s", (unsigned long long)index, location, text);
+    if (record->reg != TRACE_NO_REGISTER && record->reg < 8) printf("  %s=%d", register_names[record->reg], record->reg_value);
+    if (record->flags & TRACE_MEMORY_WRITE) printf("  [%d] <- %d", record->address, record->value);
+    if (record->flags & TRACE_MEMORY_READ) printf("  [%d] -> %d", record->address, record->value);
+    printf("\n");
+}